@@ -0,0 +1,335 @@
+#include <string.h>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "Bitmap.h"
+#include "ufs.h"
+
+using namespace std;
+
+#define BITS_PER_BLOCK (UFS_BLOCK_SIZE * 8)
+#define WORDS_PER_BLOCK (UFS_BLOCK_SIZE / 8)
+
+static int firstZero(uint64_t word) {
+  return __builtin_ctzll(~word);
+}
+
+static size_t popcountScalar(const uint64_t *words, size_t count) {
+  size_t total = 0;
+  for (size_t i = 0; i < count; ++i) {
+    total += __builtin_popcountll(words[i]);
+  }
+  return total;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Nibble lookup popcount (Mula): 32 bytes per iteration, with byte counts
+// summed into 64-bit lanes by _mm256_sad_epu8.
+__attribute__((target("avx2")))
+static size_t popcountAvx2(const uint64_t *words, size_t count) {
+  const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                          0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i lowMask = _mm256_set1_epi8(0x0f);
+  __m256i totals = _mm256_setzero_si256();
+
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (words + i));
+    __m256i lo = _mm256_and_si256(v, lowMask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), lowMask);
+    __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+    totals = _mm256_add_epi64(totals, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+  }
+
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i *) lanes, totals);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + popcountScalar(words + i, count - i);
+}
+#endif
+
+// Chosen once, at startup, based on what the CPU supports.
+static size_t (*popcountWords)(const uint64_t *, size_t) =
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_supports("avx2") ? popcountAvx2 : popcountScalar;
+#else
+  popcountScalar;
+#endif
+
+Bitmap::Bitmap() {
+  this->addr = 0;
+  this->len = 0;
+  this->numBits = 0;
+  this->freeBits = 0;
+  this->reservedBits = 0;
+}
+
+void Bitmap::load(Disk *disk, int addr, int len, int numBits) {
+  this->addr = addr;
+  this->len = len;
+  this->numBits = numBits;
+  words.assign((size_t) len * WORDS_PER_BLOCK, 0);
+  reserved.assign(words.size(), 0);
+  reservedBits = 0;
+  dirty.assign(len, false);
+
+  for (int i = 0; i < len; ++i) {
+    disk->readBlock(addr + i, words.data() + (size_t) i * WORDS_PER_BLOCK);
+  }
+  buildSummary();
+  freeBits = scanFree();
+}
+
+// Reserved bits are written as clear
+void Bitmap::flush(Disk *disk) {
+  uint64_t block[WORDS_PER_BLOCK];
+  for (int i = 0; i < len; ++i) {
+    if (dirty[i]) {
+      const size_t first = (size_t) i * WORDS_PER_BLOCK;
+      for (size_t word = 0; word < WORDS_PER_BLOCK; ++word) {
+        block[word] = words[first + word] & ~reserved[first + word];
+      }
+      disk->writeBlock(addr + i, block);
+      dirty[i] = false;
+    }
+  }
+}
+
+void Bitmap::markDirty(int bit) {
+  dirty[bit / BITS_PER_BLOCK] = true;
+}
+
+// The bits of `word` that describe real inodes or blocks.
+uint64_t Bitmap::validMask(size_t word) {
+  size_t first = word * 64;
+  if (first >= (size_t) numBits) {
+    return 0;
+  }
+  size_t valid = numBits - first;
+  return valid >= 64 ? ~0ULL : (1ULL << valid) - 1;
+}
+
+bool Bitmap::wordFull(size_t word) {
+  uint64_t mask = validMask(word);
+  return (words[word] & mask) == mask;
+}
+
+void Bitmap::buildSummary() {
+  summary.clear();
+  size_t count = words.size();
+  do {
+    size_t summaryWords = (count + 63) / 64;
+    // padding bits start out set so searches never descend into them
+    vector<uint64_t> level(summaryWords, ~0ULL);
+    summary.push_back(level);
+    count = summaryWords;
+  } while (count > 1);
+
+  rebuildSummary(0, words.size());
+}
+
+void Bitmap::rebuildSummary(size_t firstWord, size_t lastWord) {
+  for (size_t word = firstWord; word < lastWord && word < words.size(); ++word) {
+    if (wordFull(word)) {
+      markFull(word);
+    } else {
+      markNotFull(word);
+    }
+  }
+}
+
+void Bitmap::markFull(size_t word) {
+  for (size_t level = 0; level < summary.size(); ++level) {
+    uint64_t &entry = summary[level][word / 64];
+    entry |= 1ULL << (word % 64);
+    if (entry != ~0ULL) {
+      return;
+    }
+    word /= 64;
+  }
+}
+
+void Bitmap::markNotFull(size_t word) {
+  for (size_t level = 0; level < summary.size(); ++level) {
+    uint64_t &entry = summary[level][word / 64];
+    bool wasFull = entry == ~0ULL;
+    entry &= ~(1ULL << (word % 64));
+    if (!wasFull) {
+      return;
+    }
+    word /= 64;
+  }
+}
+
+bool Bitmap::isSet(int bit) {
+  return (words[bit / 64] >> (bit % 64)) & 1;
+}
+
+void Bitmap::clear(int bit) {
+  clearInMemory(bit);
+  markDirty(bit);
+}
+
+void Bitmap::setInMemory(int bit) {
+  if (!isSet(bit)) {
+    freeBits--;
+  }
+  words[bit / 64] |= 1ULL << (bit % 64);
+  if (wordFull(bit / 64)) {
+    markFull(bit / 64);
+  }
+}
+
+void Bitmap::clearInMemory(int bit) {
+  if (isSet(bit)) {
+    freeBits++;
+  }
+  bool wasFull = wordFull(bit / 64);
+  words[bit / 64] &= ~(1ULL << (bit % 64));
+  if (wasFull) {
+    markNotFull(bit / 64);
+  }
+}
+
+bool Bitmap::isReserved(int bit) {
+  return (reserved[bit / 64] >> (bit % 64)) & 1;
+}
+
+void Bitmap::reserve(int bit) {
+  setInMemory(bit);
+  reserved[bit / 64] |= 1ULL << (bit % 64);
+  reservedBits++;
+}
+
+void Bitmap::unreserve(int bit) {
+  if (isReserved(bit)) {
+    reserved[bit / 64] &= ~(1ULL << (bit % 64));
+    reservedBits--;
+    clearInMemory(bit);
+  }
+}
+
+void Bitmap::claim(int bit) {
+  if (isReserved(bit)) {
+    reserved[bit / 64] &= ~(1ULL << (bit % 64));
+    reservedBits--;
+    markDirty(bit);
+  }
+}
+
+int Bitmap::findFirstFree() {
+  if (words.empty() || summary.back()[0] == ~0ULL) {
+    return -1;
+  }
+
+  // Walk down the summary tree: at each level the first clear bit names
+  // the word one level down that still has room.
+  size_t word = 0;
+  for (size_t level = summary.size(); level-- > 0;) {
+    word = word * 64 + firstZero(summary[level][word]);
+  }
+
+  size_t bit = word * 64 + firstZero(words[word] | ~validMask(word));
+  return bit < (size_t) numBits ? (int) bit : -1;
+}
+
+// First word at or after `word` that is not full, or words.size(). Climbs
+// the summary tree until an entry has a clear bit at or after the position
+// it came from, then walks back down to the word that bit leads to.
+size_t Bitmap::nextNotFull(size_t word) {
+  size_t index = word;
+  size_t level = 0;
+  for (;; ++level) {
+    if (level == summary.size() || index / 64 >= summary[level].size()) {
+      return words.size();
+    }
+    uint64_t open = ~summary[level][index / 64] & (~0ULL << (index % 64));
+    if (open != 0) {
+      index = index / 64 * 64 + __builtin_ctzll(open);
+      break;
+    }
+    index = index / 64 + 1;
+  }
+
+  while (level-- > 0) {
+    index = index * 64 + firstZero(summary[level][index]);
+  }
+  return index;
+}
+
+int Bitmap::freeRunAt(int bit, int maxLength) {
+  int length = 0;
+  size_t position = bit;
+  while (length < maxLength && position < (size_t) numBits) {
+    size_t word = position / 64;
+    int offset = position % 64;
+    // bits past numBits count as used
+    uint64_t used = (words[word] | ~validMask(word)) >> offset;
+    if (used != 0) {
+      length += __builtin_ctzll(used);
+      break;
+    }
+    length += 64 - offset;
+    position += 64 - offset;
+  }
+  return min(length, maxLength);
+}
+
+int Bitmap::findFreeRun(int minLength, int maxLength, int *length) {
+  size_t position = 0;
+  while (position < (size_t) numBits) {
+    size_t word = position / 64;
+    uint64_t clear = ~(words[word] | ~validMask(word)) & (~0ULL << (position % 64));
+    if (clear == 0) {
+      // skip full words through the summary tree rather than one by one
+      word = nextNotFull(word + 1);
+      if (word >= words.size()) {
+        return -1;
+      }
+      position = word * 64;
+      continue;
+    }
+
+    position = word * 64 + __builtin_ctzll(clear);
+    int run = freeRunAt(position, maxLength);
+    if (run >= minLength) {
+      *length = run;
+      return position;
+    }
+    position += run;
+  }
+  return -1;
+}
+
+int Bitmap::countFree() {
+  return freeBits;
+}
+
+int Bitmap::countReserved() {
+  return reservedBits;
+}
+
+int Bitmap::scanFree() {
+  size_t fullWords = numBits / 64;
+  size_t used = popcountWords(words.data(), fullWords);
+  if (numBits % 64 != 0) {
+    used += __builtin_popcountll(words[fullWords] & validMask(fullWords));
+  }
+  return numBits - (int) used;
+}
+
+void Bitmap::copyTo(unsigned char *buffer) {
+  uint64_t *out = (uint64_t *) buffer;
+  for (size_t word = 0; word < words.size(); ++word) {
+    out[word] = words[word] & ~reserved[word];
+  }
+}
+
+void Bitmap::copyFrom(const unsigned char *buffer) {
+  memcpy(words.data(), buffer, words.size() * sizeof(uint64_t));
+  dirty.assign(len, true);
+  rebuildSummary(0, words.size());
+  freeBits = scanFree();
+}
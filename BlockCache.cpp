@@ -0,0 +1,123 @@
+#include <string.h>
+
+#include "BlockCache.h"
+
+using namespace std;
+
+BlockCache::BlockCache(int capacity, int blockSize, ReplacementPolicyType policy) {
+  this->blockSize = blockSize;
+  this->totalCapacity = capacity;
+  this->hitCount = 0;
+  this->missCount = 0;
+  this->evictionCount = 0;
+
+  for (int idx = 0; idx < BLOCK_CACHE_SHARDS; ++idx) {
+    Shard *shard = new Shard();
+    pthread_mutex_init(&shard->lock, NULL);
+    shard->generation = 0;
+    // spread the remainder over the first shards
+    shard->capacity = capacity / BLOCK_CACHE_SHARDS + (idx < capacity % BLOCK_CACHE_SHARDS ? 1 : 0);
+    shard->policy = ReplacementPolicy::create(policy, shard->capacity);
+    shards.push_back(shard);
+  }
+}
+
+BlockCache::~BlockCache() {
+  for (size_t idx = 0; idx < shards.size(); ++idx) {
+    unordered_map<int, unsigned char *>::iterator iter;
+    for (iter = shards[idx]->blocks.begin(); iter != shards[idx]->blocks.end(); iter++) {
+      delete [] iter->second;
+    }
+    delete shards[idx]->policy;
+    pthread_mutex_destroy(&shards[idx]->lock);
+    delete shards[idx];
+  }
+}
+
+BlockCache::Shard &BlockCache::shardFor(int blockNumber) {
+  return *shards[blockNumber % BLOCK_CACHE_SHARDS];
+}
+
+bool BlockCache::get(int blockNumber, void *buffer) {
+  Shard &shard = shardFor(blockNumber);
+  pthread_mutex_lock(&shard.lock);
+  unordered_map<int, unsigned char *>::iterator found = shard.blocks.find(blockNumber);
+  if (found == shard.blocks.end()) {
+    pthread_mutex_unlock(&shard.lock);
+    missCount++;
+    return false;
+  }
+
+  shard.policy->hit(blockNumber);
+  memcpy(buffer, found->second, blockSize);
+  pthread_mutex_unlock(&shard.lock);
+  hitCount++;
+  return true;
+}
+
+uint64_t BlockCache::fillToken(int blockNumber) {
+  Shard &shard = shardFor(blockNumber);
+  pthread_mutex_lock(&shard.lock);
+  uint64_t token = shard.generation;
+  pthread_mutex_unlock(&shard.lock);
+  return token;
+}
+
+void BlockCache::fill(int blockNumber, const void *buffer, uint64_t token) {
+  Shard &shard = shardFor(blockNumber);
+  pthread_mutex_lock(&shard.lock);
+  if (shard.generation == token && shard.blocks.find(blockNumber) == shard.blocks.end()) {
+    insertLocked(shard, blockNumber, buffer);
+  }
+  pthread_mutex_unlock(&shard.lock);
+}
+
+void BlockCache::put(int blockNumber, const void *buffer) {
+  Shard &shard = shardFor(blockNumber);
+  pthread_mutex_lock(&shard.lock);
+  shard.generation++;
+  unordered_map<int, unsigned char *>::iterator found = shard.blocks.find(blockNumber);
+  if (found != shard.blocks.end()) {
+    memcpy(found->second, buffer, blockSize);
+    shard.policy->hit(blockNumber);
+  } else {
+    insertLocked(shard, blockNumber, buffer);
+  }
+  pthread_mutex_unlock(&shard.lock);
+}
+
+void BlockCache::insertLocked(Shard &shard, int blockNumber, const void *buffer) {
+  if (shard.capacity <= 0) {
+    return;
+  }
+
+  unsigned char *data;
+  int victim = shard.policy->admit(blockNumber);
+  if (victim >= 0) {
+    // reuse the evicted block's buffer
+    data = shard.blocks[victim];
+    shard.blocks.erase(victim);
+    evictionCount++;
+  } else {
+    data = new unsigned char[blockSize];
+  }
+
+  memcpy(data, buffer, blockSize);
+  shard.blocks[blockNumber] = data;
+}
+
+int BlockCache::capacity() {
+  return totalCapacity;
+}
+
+unsigned long BlockCache::hits() {
+  return hitCount.load();
+}
+
+unsigned long BlockCache::misses() {
+  return missCount.load();
+}
+
+unsigned long BlockCache::evictions() {
+  return evictionCount.load();
+}
@@ -0,0 +1,92 @@
+#include "DentryCache.h"
+
+using namespace std;
+
+DentryCache::DentryCache(int capacity) {
+  pthread_mutex_init(&lock, NULL);
+  this->capacity = capacity;
+  this->hitCount = 0;
+  this->missCount = 0;
+}
+
+DentryCache::~DentryCache() {
+  pthread_mutex_destroy(&lock);
+}
+
+// Names never contain '/', so it separates the two halves of the key.
+string DentryCache::keyFor(int parentInodeNumber, const string &name) {
+  return to_string(parentInodeNumber) + "/" + name;
+}
+
+bool DentryCache::get(int parentInodeNumber, const string &name, int *inodeNumber) {
+  string key = keyFor(parentInodeNumber, name);
+
+  pthread_mutex_lock(&lock);
+  unordered_map<string, EntryList::iterator>::iterator found = index.find(key);
+  if (found == index.end()) {
+    pthread_mutex_unlock(&lock);
+    missCount++;
+    return false;
+  }
+
+  entries.splice(entries.begin(), entries, found->second);
+  *inodeNumber = found->second->second;
+  pthread_mutex_unlock(&lock);
+  hitCount++;
+  return true;
+}
+
+void DentryCache::put(int parentInodeNumber, const string &name, int inodeNumber) {
+  if (capacity <= 0) {
+    return;
+  }
+  string key = keyFor(parentInodeNumber, name);
+
+  pthread_mutex_lock(&lock);
+  unordered_map<string, EntryList::iterator>::iterator found = index.find(key);
+  if (found != index.end()) {
+    found->second->second = inodeNumber;
+    entries.splice(entries.begin(), entries, found->second);
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  if ((int) index.size() >= capacity) {
+    index.erase(entries.back().first);
+    entries.pop_back();
+  }
+  entries.push_front(make_pair(key, inodeNumber));
+  index[key] = entries.begin();
+  pthread_mutex_unlock(&lock);
+}
+
+void DentryCache::forgetDirectory(int inodeNumber) {
+  string prefix = to_string(inodeNumber) + "/";
+
+  pthread_mutex_lock(&lock);
+  EntryList::iterator iter = entries.begin();
+  while (iter != entries.end()) {
+    if (iter->first.compare(0, prefix.size(), prefix) == 0) {
+      index.erase(iter->first);
+      iter = entries.erase(iter);
+    } else {
+      iter++;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void DentryCache::clear() {
+  pthread_mutex_lock(&lock);
+  entries.clear();
+  index.clear();
+  pthread_mutex_unlock(&lock);
+}
+
+unsigned long DentryCache::hits() {
+  return hitCount;
+}
+
+unsigned long DentryCache::misses() {
+  return missCount;
+}
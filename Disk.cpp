@@ -1,8 +1,12 @@
 #include <iostream>
+#include <vector>
 #include <unistd.h>
 
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
 
 #include <sys/types.h>
 #include <sys/uio.h>
@@ -14,26 +18,72 @@
 
 using namespace std;
 
-Disk::Disk(string imageFile, int blockSize) {
+// Checkpoint in the background once this much of the log is in use, or
+// after CHECKPOINT_INTERVAL_SECONDS when there is anything to checkpoint.
+#define CHECKPOINT_HIGH_WATER(logLen) ((logLen) / 2)
+#define CHECKPOINT_INTERVAL_SECONDS (1)
+
+// FNV-1a, used to detect torn or partially written journal records.
+static uint64_t checksum(uint64_t hash, const unsigned char *data, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= data[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+Disk::Disk(string imageFile, int blockSize, bool readOnly) {
   this->imageFile = imageFile;
   this->blockSize = blockSize;
+  this->readOnly = readOnly;
+  this->syscalls = 0;
+  this->syncs = 0;
+  this->durability = DURABILITY_SYNC;
+  this->groupCommitWaitMicros = 0;
+  this->cache = NULL;
+  this->openTransactions = 0;
+  this->issuedTicket = 0;
+  this->syncedTicket = 0;
+  this->syncInProgress = false;
+  this->hasJournal = false;
+  this->journalAddr = 0;
+  this->journalLen = 0;
+  this->logLen = 0;
+  this->headOffset = 0;
+  this->tailOffset = 0;
+  this->usedBlocks = 0;
+  this->reservedBlocks = 0;
+  this->nextSequence = 1;
+  this->tailSequence = 1;
+  this->stopCheckpointer = false;
+  pthread_mutex_init(&this->transactionLock, NULL);
+  pthread_mutex_init(&this->groupLock, NULL);
+  pthread_cond_init(&this->groupCond, NULL);
+  pthread_mutex_init(&this->journalLock, NULL);
+  pthread_mutex_init(&this->pendingLock, NULL);
+  pthread_mutex_init(&this->checkpointLock, NULL);
+  pthread_cond_init(&this->checkpointCond, NULL);
 
-  struct stat stat;
-  int imageFileDescriptor = open(imageFile.c_str(), O_RDONLY);
-  if (imageFileDescriptor < 0) {
+  // The image stays open for the lifetime of the Disk so block I/O is a
+  // single positional syscall instead of open/lseek/read/close.
+  this->imageFileDescriptor = open(imageFile.c_str(), readOnly ? O_RDONLY : O_RDWR);
+  syscalls++;
+  if (this->imageFileDescriptor < 0) {
     cerr << "could not open " << imageFile << endl;
     exit(1);
   }
-  int ret = fstat(imageFileDescriptor, &stat);
+
+  struct stat stat;
+  int ret = fstat(this->imageFileDescriptor, &stat);
+  syscalls++;
   if (ret != 0) {
     cerr << "Could not stat image file" << endl;
     exit(1);
   }
-  close(imageFileDescriptor);
   
   this->imageFileSize = stat.st_size;
 
-  if ((this->imageFileSize % this->blockSize) != 0 || this->blockSize == 0) {
+  if (this->blockSize == 0 || (this->imageFileSize % this->blockSize) != 0) {
     cerr << "Your disk image size must be a multiple of your block size" << endl;
     cerr << "  imageSize: " << this->imageFileSize << endl;
     cerr << "  blockSize: " << this->blockSize << endl;
@@ -43,99 +93,770 @@ Disk::Disk(string imageFile, int blockSize) {
   
 }
 
+Disk::~Disk() {
+  if (hasJournal && !readOnly) {
+    pthread_mutex_lock(&journalLock);
+    stopCheckpointer = true;
+    pthread_cond_signal(&checkpointCond);
+    pthread_mutex_unlock(&journalLock);
+    pthread_join(checkpointer, NULL);
+    checkpoint();
+  }
+
+  map<int, struct PendingBlock>::iterator iter;
+  for (iter = pendingBlocks.begin(); iter != pendingBlocks.end(); iter++) {
+    delete [] iter->second.data;
+  }
+
+  close(this->imageFileDescriptor);
+  pthread_mutex_destroy(&this->transactionLock);
+  pthread_mutex_destroy(&this->groupLock);
+  pthread_cond_destroy(&this->groupCond);
+  pthread_mutex_destroy(&this->journalLock);
+  pthread_mutex_destroy(&this->pendingLock);
+  pthread_mutex_destroy(&this->checkpointLock);
+  pthread_cond_destroy(&this->checkpointCond);
+}
+
 int Disk::numberOfBlocks() {
   return this->imageFileSize / this->blockSize;
 }
 
-void Disk::readBlock(int blockNumber, void *buffer) {
-  if (blockNumber < 0 || blockNumber > this->numberOfBlocks()) {
+void Disk::setDurability(DurabilityMode mode, int groupCommitWaitMicros) {
+  this->durability = mode;
+  this->groupCommitWaitMicros = groupCommitWaitMicros;
+}
+
+void Disk::setCache(BlockCache *cache) {
+  this->cache = cache;
+}
+
+BlockCache *Disk::getCache() {
+  return this->cache;
+}
+
+unsigned long Disk::syscallCount() {
+  return this->syscalls.load();
+}
+
+unsigned long Disk::syncCount() {
+  return this->syncs.load();
+}
+
+int Disk::transactionBlocks() {
+  Transaction *transaction = currentTransaction();
+  return transaction == NULL ? 0 : transaction->writeBuffer.size();
+}
+
+int Disk::maxTransactionBlocks() {
+  if (!hasJournal) {
+    return numberOfBlocks();
+  }
+  int64_t count = logLen - 2;
+  while (count > 0 && descriptorBlocks(count) + count + 1 > logLen) {
+    count--;
+  }
+  return count;
+}
+
+// The home block numbers follow the record header and run on into as many
+// further descriptor blocks as they need.
+int64_t Disk::descriptorBlocks(int64_t count) {
+  int64_t bytes = sizeof(struct JournalRecordHeader) + count * sizeof(int32_t);
+  return (bytes + blockSize - 1) / blockSize;
+}
+
+// Log blocks a record of count blocks can take: the record, and the end of
+// the log it skips if it has to start over at offset 0. A record that
+// could skip most of the log waits for it to be empty, when it starts at 0.
+int64_t Disk::worstCaseRecord(int64_t count) {
+  int64_t recordLen = descriptorBlocks(count) + count + 1;
+  return min(logLen, 2 * recordLen - 1);
+}
+
+void Disk::reserveJournalSpace(int blocks) {
+  Transaction *transaction = currentTransaction();
+  if (!hasJournal || transaction == NULL) {
+    return;
+  }
+  int64_t wanted = worstCaseRecord(blocks);
+  if (wanted <= transaction->reservedBlocks) {
+    return;
+  }
+
+  pthread_mutex_lock(&journalLock);
+  reservedBlocks -= transaction->reservedBlocks;
+  transaction->reservedBlocks = 0;
+  while (usedBlocks + reservedBlocks + wanted > logLen) {
+    pthread_mutex_unlock(&journalLock);
+    checkpoint();
+    pthread_mutex_lock(&journalLock);
+  }
+  reservedBlocks += wanted;
+  transaction->reservedBlocks = wanted;
+  pthread_mutex_unlock(&journalLock);
+}
+
+void Disk::checkBlockNumber(int blockNumber) {
+  if (blockNumber < 0 || blockNumber >= this->numberOfBlocks()) {
     cerr << "Invalid block number " << blockNumber << endl;
     exit(1);
   }
+}
+
+void Disk::preadBlock(int blockNumber, void *buffer) {
+  preadBlocks(blockNumber, 1, buffer);
+}
+
+void Disk::pwriteBlock(int blockNumber, const void *buffer) {
+  pwriteBlocks(blockNumber, 1, buffer);
+}
 
-  int fd = open(this->imageFile.c_str(), O_RDONLY);
-  if (fd < 0) {
-    cerr << "Could not open image file " << this->imageFile << endl;
+void Disk::preadBlocks(int blockNumber, int count, void *buffer) {
+  size_t len = (size_t) count * this->blockSize;
+  off_t offset = (off_t) blockNumber * this->blockSize;
+  ssize_t ret = pread(this->imageFileDescriptor, buffer, len, offset);
+  syscalls++;
+  if (ret != (ssize_t) len) {
+    perror("read::pread");
+    cerr << "Could not read file" << endl;
     exit(1);
   }
+}
 
-  int offset = blockNumber * this->blockSize;
-  int ret = lseek(fd, offset, SEEK_SET);
-  if (ret != offset) {
-    perror("read::lseek");
-    cerr << "Could not seek to file" << endl;
+void Disk::pwriteBlocks(int blockNumber, int count, const void *buffer) {
+  if (readOnly) {
+    cerr << "Could not write block " << blockNumber << ": " << imageFile << " is open read-only" << endl;
     exit(1);
   }
-
-  ret = read(fd, buffer, this->blockSize);
-  if (ret != this->blockSize) {
-    cerr << "Could not read file" << endl;
+  size_t len = (size_t) count * this->blockSize;
+  off_t offset = (off_t) blockNumber * this->blockSize;
+  ssize_t ret = pwrite(this->imageFileDescriptor, buffer, len, offset);
+  syscalls++;
+  if (ret != (ssize_t) len) {
+    perror("write::pwrite");
+    cerr << "Could not write file" << endl;
     exit(1);
   }
+}
 
-  close(fd);
+void Disk::dataSync() {
+  if (readOnly) {
+    return;
+  }
+  fdatasync(this->imageFileDescriptor);
+  syscalls++;
+  syncs++;
 }
 
-void Disk::writeBlock(int blockNumber, void *buffer) {  
-  if (blockNumber < 0 || blockNumber > this->numberOfBlocks()) {
-    cerr << "Invalid block number " << blockNumber << endl;
-    exit(1);
+Transaction *Disk::currentTransaction() {
+  pthread_mutex_lock(&transactionLock);
+  map<thread::id, Transaction *>::iterator iter = transactions.find(this_thread::get_id());
+  Transaction *transaction = iter == transactions.end() ? NULL : iter->second;
+  pthread_mutex_unlock(&transactionLock);
+  return transaction;
+}
+
+Transaction *Disk::detachTransaction() {
+  pthread_mutex_lock(&transactionLock);
+  map<thread::id, Transaction *>::iterator iter = transactions.find(this_thread::get_id());
+  Transaction *transaction = iter == transactions.end() ? NULL : iter->second;
+  if (transaction != NULL) {
+    transactions.erase(iter);
+    openTransactions--;
   }
+  pthread_mutex_unlock(&transactionLock);
+  return transaction;
+}
 
-  if (isInTransaction) {
-    struct UndoRecord undoRecord;
-    undoRecord.blockNumber = blockNumber;
-    undoRecord.blockData = new unsigned char[blockSize];
-    this->readBlock(blockNumber, undoRecord.blockData);
-    undoLog.push_front(undoRecord);
+void Disk::freeTransaction(Transaction *transaction) {
+  if (transaction->reservedBlocks > 0) {
+    pthread_mutex_lock(&journalLock);
+    reservedBlocks -= transaction->reservedBlocks;
+    pthread_mutex_unlock(&journalLock);
   }
-  
-  int fd = open(this->imageFile.c_str(), O_RDWR);
-  if (fd < 0) {
-    cerr << "Could not open image file " << this->imageFile << endl;
-    exit(1);
+  map<int, unsigned char *>::iterator iter;
+  for (iter = transaction->writeBuffer.begin(); iter != transaction->writeBuffer.end(); iter++) {
+    delete [] iter->second;
   }
+  delete transaction;
+}
 
-  int offset = blockNumber * this->blockSize;
-  int ret = lseek(fd, offset, SEEK_SET);
-  if (ret != offset) {
-    perror("write::lseek");
-    cerr << "Could not seek to file" << endl;
-    exit(1);
+void Disk::readBlock(int blockNumber, void *buffer) {
+  checkBlockNumber(blockNumber);
+
+  // Blocks written earlier in this thread's transaction are still buffered.
+  Transaction *transaction = currentTransaction();
+  if (transaction != NULL) {
+    map<int, unsigned char *>::iterator iter = transaction->writeBuffer.find(blockNumber);
+    if (iter != transaction->writeBuffer.end()) {
+      memcpy(buffer, iter->second, this->blockSize);
+      return;
+    }
   }
 
-  ret = write(fd, buffer, this->blockSize);
-  if (ret != this->blockSize) {
-    cerr << "Could not write file" << endl;
-    exit(1);
+  uint64_t token = 0;
+  if (cache != NULL) {
+    if (cache->get(blockNumber, buffer)) {
+      return;
+    }
+    token = cache->fillToken(blockNumber);
+  }
+
+  // Committed blocks that have not been checkpointed yet are newer than
+  // their home location.
+  bool found = false;
+  if (hasJournal) {
+    pthread_mutex_lock(&pendingLock);
+    map<int, struct PendingBlock>::iterator iter = pendingBlocks.find(blockNumber);
+    if (iter != pendingBlocks.end()) {
+      memcpy(buffer, iter->second.data, this->blockSize);
+      found = true;
+    }
+    pthread_mutex_unlock(&pendingLock);
+  }
+
+  if (!found) {
+    preadBlock(blockNumber, buffer);
+  }
+  if (cache != NULL) {
+    cache->fill(blockNumber, buffer, token);
+  }
+}
+
+void Disk::readBlocks(int blockNumber, int count, void *buffer) {
+  checkBlockNumber(blockNumber);
+  checkBlockNumber(blockNumber + count - 1);
+
+  bool buffered = false;
+  Transaction *transaction = currentTransaction();
+  if (transaction != NULL) {
+    map<int, unsigned char *>::iterator iter = transaction->writeBuffer.lower_bound(blockNumber);
+    buffered = iter != transaction->writeBuffer.end() && iter->first < blockNumber + count;
+  }
+  if (!buffered && hasJournal) {
+    pthread_mutex_lock(&pendingLock);
+    map<int, struct PendingBlock>::iterator iter = pendingBlocks.lower_bound(blockNumber);
+    buffered = iter != pendingBlocks.end() && iter->first < blockNumber + count;
+    pthread_mutex_unlock(&pendingLock);
+  }
+
+  if (buffered || count == 1) {
+    for (int idx = 0; idx < count; ++idx) {
+      readBlock(blockNumber + idx, (unsigned char *) buffer + (size_t) idx * blockSize);
+    }
+    return;
+  }
+  preadBlocks(blockNumber, count, buffer);
+}
+
+void Disk::writeBlock(int blockNumber, void *buffer) {  
+  checkBlockNumber(blockNumber);
+
+  // A write outside a transaction commits on its own.
+  Transaction *transaction = currentTransaction();
+  bool implicit = transaction == NULL;
+  if (implicit) {
+    transaction = new Transaction();
+  }
+
+  unsigned char *&blockData = transaction->writeBuffer[blockNumber];
+  if (blockData == NULL) {
+    blockData = new unsigned char[blockSize];
+  }
+  memcpy(blockData, buffer, blockSize);
+
+  if (implicit) {
+    if (hasJournal) {
+      commitToJournal(transaction);
+    } else {
+      commitInPlace(transaction);
+    }
+    freeTransaction(transaction);
+    groupSync();
   }
-  fsync(fd);
-  close(fd);
 }
 
 void Disk::beginTransaction() {
-  if (isInTransaction) {
+  pthread_mutex_lock(&transactionLock);
+  Transaction *&transaction = transactions[this_thread::get_id()];
+  if (transaction != NULL) {
     cerr << "You can't start a new transaction: one already exists" << endl;
     exit(1);
   }
-  isInTransaction = true;
+  transaction = new Transaction();
+  openTransactions++;
+  pthread_mutex_unlock(&transactionLock);
 }
 
 void Disk::commit() {
-  isInTransaction = false;
-  deque<struct UndoRecord>::iterator iter;
-  for (iter = undoLog.begin(); iter != undoLog.end(); iter++) {
-    delete [] iter->blockData;
+  syncOrderedData();
+  if (publish()) {
+    waitForPublished();
+  }
+}
+
+void Disk::syncOrderedData() {
+  Transaction *transaction = currentTransaction();
+  if (transaction != NULL && transaction->orderedData) {
+    dataSync();
+    transaction->orderedData = false;
   }
-  undoLog.clear();
+}
+
+bool Disk::publish() {
+  Transaction *transaction = detachTransaction();
+  if (transaction == NULL) {
+    return false;
+  }
+
+  if (transaction->orderedData) {
+    dataSync();
+  }
+
+  const bool wrote = !transaction->writeBuffer.empty();
+  if (wrote) {
+    if (hasJournal) {
+      commitToJournal(transaction);
+    } else {
+      commitInPlace(transaction);
+    }
+  }
+  freeTransaction(transaction);
+  return wrote;
+}
+
+void Disk::waitForPublished() {
+  groupSync();
 }
 
 void Disk::rollback() {
-  isInTransaction = false;
-  deque<struct UndoRecord>::iterator iter;
-  for (iter = undoLog.begin(); iter != undoLog.end(); iter++) {
-    this->writeBlock(iter->blockNumber, iter->blockData);
-    delete [] iter->blockData;
+  // Nothing reached the image before commit, so dropping the buffered
+  // blocks is all a rollback has to do.
+  Transaction *transaction = detachTransaction();
+  if (transaction != NULL) {
+    freeTransaction(transaction);
+  }
+}
+
+void Disk::writeBlocksOrdered(int blockNumber, int count, const void *buffer) {
+  checkBlockNumber(blockNumber);
+  checkBlockNumber(blockNumber + count - 1);
+
+  Transaction *transaction = currentTransaction();
+  if (transaction == NULL) {
+    cerr << "Ordered writes need an open transaction" << endl;
+    exit(1);
+  }
+
+  // A journaled image of one of these blocks from its previous use would be
+  // written over the new data by the next checkpoint or replay, so retire
+  // the journal before the first ordered write.
+  if (!transaction->orderedData) {
+    checkpoint();
+    transaction->orderedData = true;
+  }
+
+  pthread_mutex_lock(&journalLock);
+  pwriteBlocks(blockNumber, count, buffer);
+  if (cache != NULL) {
+    for (int idx = 0; idx < count; ++idx) {
+      cache->put(blockNumber + idx, (const unsigned char *) buffer + (size_t) idx * blockSize);
+    }
+  }
+  pthread_mutex_unlock(&journalLock);
+}
+
+/**
+ * Write a transaction's blocks straight to their home locations.
+ *
+ * This is what images without a journal do. It is durable once flushed
+ * but not crash-atomic.
+ */
+void Disk::commitInPlace(Transaction *transaction) {
+  // journalLock keeps the image and the cache in the same commit order
+  pthread_mutex_lock(&journalLock);
+  map<int, unsigned char *>::iterator iter;
+  for (iter = transaction->writeBuffer.begin(); iter != transaction->writeBuffer.end(); iter++) {
+    pwriteBlock(iter->first, iter->second);
+  }
+  cacheTransaction(transaction);
+  pthread_mutex_unlock(&journalLock);
+}
+
+void Disk::cacheTransaction(Transaction *transaction) {
+  if (cache == NULL) {
+    return;
+  }
+  map<int, unsigned char *>::iterator iter;
+  for (iter = transaction->writeBuffer.begin(); iter != transaction->writeBuffer.end(); iter++) {
+    cache->put(iter->first, iter->second);
+  }
+}
+
+/**
+ * Append a transaction to the journal as a single sequential write.
+ *
+ * The blocks become visible to readers through pendingBlocks as soon as the
+ * record is written; the caller then waits for a flush to cover it. Home
+ * locations are only updated later by a checkpoint.
+ */
+void Disk::commitToJournal(Transaction *transaction) {
+  int64_t count = transaction->writeBuffer.size();
+  int64_t descriptors = descriptorBlocks(count);
+  int64_t recordLen = descriptors + count + 1;
+
+  // Writing such a transaction in place would not be crash-atomic, so
+  // callers check maxTransactionBlocks before they commit.
+  if (recordLen > logLen) {
+    cerr << "Transaction of " << count << " blocks does not fit in a journal of "
+         << journalLen << " blocks" << endl;
+    exit(1);
+  }
+
+  // descriptors, block images, commit
+  vector<unsigned char> record(recordLen * blockSize, 0);
+  struct JournalRecordHeader descriptor;
+  descriptor.magic = JOURNAL_DESCRIPTOR_MAGIC;
+  descriptor.checksum = 0;
+  descriptor.count = count;
+  int32_t *homeBlocks = (int32_t *) (record.data() + sizeof(struct JournalRecordHeader));
+  int64_t idx = 0;
+  map<int, unsigned char *>::iterator iter;
+  for (iter = transaction->writeBuffer.begin(); iter != transaction->writeBuffer.end(); iter++, idx++) {
+    homeBlocks[idx] = iter->first;
+    memcpy(record.data() + (descriptors + idx) * blockSize, iter->second, blockSize);
+  }
+
+  // A transaction that reserved enough space gives its reservation back
+  // and always fits. Others wait for a checkpoint if the log is full,
+  // leaving the space reserved by others alone.
+  pthread_mutex_lock(&journalLock);
+  const bool reserved = transaction->reservedBlocks >= worstCaseRecord(count);
+  reservedBlocks -= transaction->reservedBlocks;
+  transaction->reservedBlocks = 0;
+  int64_t offset;
+  int64_t wasted;
+  while (true) {
+    // Always append at the head, even to an empty log: the header names
+    // it as the tail, so that is where replay looks first.
+    offset = headOffset;
+    wasted = 0;
+    if (offset + recordLen > logLen) {
+      // an empty log has nothing live past the head to step over
+      wasted = usedBlocks == 0 ? 0 : logLen - offset;
+      offset = 0;
+    }
+    if (usedBlocks + wasted + recordLen + (reserved ? 0 : reservedBlocks) <= logLen) {
+      break;
+    }
+    pthread_mutex_unlock(&journalLock);
+    checkpoint();
+    pthread_mutex_lock(&journalLock);
+  }
+
+  descriptor.sequence = nextSequence++;
+  memcpy(record.data(), &descriptor, sizeof(descriptor));
+
+  struct JournalRecordHeader commitBlock = descriptor;
+  commitBlock.magic = JOURNAL_COMMIT_MAGIC;
+  commitBlock.checksum = checksum(0xcbf29ce484222325ULL, record.data(), (recordLen - 1) * blockSize);
+  memcpy(record.data() + (recordLen - 1) * blockSize, &commitBlock, sizeof(commitBlock));
+
+  pwriteBlocks(journalAddr + 1 + offset, recordLen, record.data());
+
+  struct JournalRecord live;
+  live.sequence = descriptor.sequence;
+  live.endOffset = offset + recordLen;
+  live.usedBlocks = wasted + recordLen;
+  liveRecords.push_back(live);
+  usedBlocks += live.usedBlocks;
+  headOffset = live.endOffset;
+
+  cacheTransaction(transaction);
+
+  // Hand the block images over to the pending set; they stay there until a
+  // checkpoint has written them home.
+  pthread_mutex_lock(&pendingLock);
+  for (iter = transaction->writeBuffer.begin(); iter != transaction->writeBuffer.end(); iter++) {
+    struct PendingBlock &pending = pendingBlocks[iter->first];
+    delete [] pending.data;
+    pending.data = iter->second;
+    pending.sequence = descriptor.sequence;
+  }
+  pthread_mutex_unlock(&pendingLock);
+  transaction->writeBuffer.clear();
+
+  if (usedBlocks > CHECKPOINT_HIGH_WATER(logLen)) {
+    pthread_cond_signal(&checkpointCond);
+  }
+  pthread_mutex_unlock(&journalLock);
+}
+
+/**
+ * Wait until the writes this thread has issued are durable.
+ *
+ * The first committer to find no flush in progress becomes the leader. In
+ * group commit mode, if other transactions are still open it gives them up
+ * to the group commit window to issue their writes. Then one fdatasync
+ * covers every ticket handed out before it started. Followers just wait for
+ * that flush.
+ */
+void Disk::groupSync() {
+  pthread_mutex_lock(&groupLock);
+  unsigned long ticket = ++issuedTicket;
+  pthread_cond_broadcast(&groupCond);
+
+  while (syncedTicket < ticket) {
+    if (syncInProgress) {
+      pthread_cond_wait(&groupCond, &groupLock);
+      continue;
+    }
+
+    syncInProgress = true;
+    if (durability == DURABILITY_GROUP_COMMIT && groupCommitWaitMicros > 0) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      long nanos = deadline.tv_nsec + (long) groupCommitWaitMicros * 1000;
+      deadline.tv_sec += nanos / 1000000000;
+      deadline.tv_nsec = nanos % 1000000000;
+      while (openTransactions > 0) {
+        if (pthread_cond_timedwait(&groupCond, &groupLock, &deadline) != 0) {
+          break;
+        }
+      }
+    }
+
+    unsigned long target = issuedTicket;
+    pthread_mutex_unlock(&groupLock);
+    dataSync();
+    pthread_mutex_lock(&groupLock);
+
+    syncedTicket = target;
+    syncInProgress = false;
+    pthread_cond_broadcast(&groupCond);
+  }
+
+  pthread_mutex_unlock(&groupLock);
+}
+
+int Disk::openJournal(int journalAddr, int journalLen) {
+  if (hasJournal || journalLen < 3) {
+    return 0;
+  }
+  checkBlockNumber(journalAddr + journalLen - 1);
+
+  this->journalAddr = journalAddr;
+  this->journalLen = journalLen;
+  this->logLen = journalLen - 1;
+
+  int replayed = replayJournal();
+  hasJournal = true;
+  if (readOnly) {
+    // Committed records are served from memory; nothing goes to the image.
+    return replayed;
+  }
+  if (replayed > 0) {
+    checkpoint();
+  }
+
+  if (pthread_create(&checkpointer, NULL, Disk::checkpointThread, this) != 0) {
+    cerr << "Could not start journal checkpoint thread" << endl;
+    exit(1);
+  }
+
+  return replayed;
+}
+
+/**
+ * Load every committed record after the tail into pendingBlocks.
+ *
+ * Records are matched by sequence number, so stale records left over from
+ * earlier passes around the log are ignored. Replay stops at the first
+ * record that is missing, torn, or fails its checksum at both places it
+ * could be.
+ */
+int Disk::replayJournal() {
+  vector<unsigned char> block(blockSize);
+  preadBlock(journalAddr, block.data());
+  struct JournalHeader header;
+  memcpy(&header, block.data(), sizeof(header));
+  if (header.magic != JOURNAL_HEADER_MAGIC || header.tailOffset < 0 || header.tailOffset >= logLen) {
+    header.tailSequence = 1;
+    header.tailOffset = 0;
+  }
+
+  tailSequence = header.tailSequence;
+  tailOffset = header.tailOffset;
+  nextSequence = header.tailSequence;
+  headOffset = header.tailOffset;
+
+  int replayed = 0;
+  while (true) {
+    // The next record is at the head or, if it did not fit before the end
+    // of the log, at offset 0. The head may hold a stale or torn record
+    // with the right sequence number, so 0 is tried whenever the head
+    // does not hold a whole record.
+    int64_t offset = headOffset;
+    struct JournalRecordHeader descriptor;
+    vector<unsigned char> record;
+    bool found = loadRecord(offset, &descriptor, record);
+    if (!found && offset != 0) {
+      offset = 0;
+      found = loadRecord(offset, &descriptor, record);
+    }
+    if (!found) {
+      break;
+    }
+
+    int64_t descriptors = descriptorBlocks(descriptor.count);
+    int64_t recordLen = descriptors + descriptor.count + 1;
+    int32_t *homeBlocks = (int32_t *) (record.data() + sizeof(struct JournalRecordHeader));
+    for (int64_t idx = 0; idx < descriptor.count; ++idx) {
+      checkBlockNumber(homeBlocks[idx]);
+      struct PendingBlock &pending = pendingBlocks[homeBlocks[idx]];
+      if (pending.data == NULL) {
+        pending.data = new unsigned char[blockSize];
+      }
+      memcpy(pending.data, record.data() + (descriptors + idx) * blockSize, blockSize);
+      pending.sequence = descriptor.sequence;
+    }
+
+    struct JournalRecord live;
+    live.sequence = descriptor.sequence;
+    live.endOffset = offset + recordLen;
+    live.usedBlocks = (offset < headOffset ? logLen - headOffset : 0) + recordLen;
+    liveRecords.push_back(live);
+    usedBlocks += live.usedBlocks;
+    headOffset = live.endOffset;
+    nextSequence++;
+    replayed++;
   }
-  undoLog.clear();
+
+  return replayed;
+}
+
+/**
+ * Read the record at log offset into record if it is the next one
+ * expected (its sequence is nextSequence) and whole: its descriptor and
+ * commit block agree and the checksum matches.
+ */
+bool Disk::loadRecord(int64_t offset, struct JournalRecordHeader *descriptor, vector<unsigned char> &record) {
+  vector<unsigned char> block(blockSize);
+  preadBlock(journalAddr + 1 + offset, block.data());
+  memcpy(descriptor, block.data(), sizeof(*descriptor));
+  if (descriptor->magic != JOURNAL_DESCRIPTOR_MAGIC || descriptor->sequence != nextSequence ||
+      descriptor->count <= 0 || descriptor->count >= logLen ||
+      offset + descriptorBlocks(descriptor->count) + descriptor->count + 1 > logLen) {
+    return false;
+  }
+
+  int64_t recordLen = descriptorBlocks(descriptor->count) + descriptor->count + 1;
+  record.resize(recordLen * blockSize);
+  preadBlocks(journalAddr + 1 + offset, recordLen, record.data());
+  struct JournalRecordHeader commitBlock;
+  memcpy(&commitBlock, record.data() + (recordLen - 1) * blockSize, sizeof(commitBlock));
+  uint64_t expected = checksum(0xcbf29ce484222325ULL, record.data(), (recordLen - 1) * blockSize);
+  return commitBlock.magic == JOURNAL_COMMIT_MAGIC && commitBlock.sequence == descriptor->sequence &&
+    commitBlock.count == descriptor->count && commitBlock.checksum == expected;
+}
+
+void Disk::writeJournalHeader() {
+  vector<unsigned char> block(blockSize, 0);
+  struct JournalHeader header;
+  header.magic = JOURNAL_HEADER_MAGIC;
+  header.tailSequence = tailSequence;
+  header.tailOffset = tailOffset;
+  memcpy(block.data(), &header, sizeof(header));
+  pwriteBlock(journalAddr, block.data());
+}
+
+void Disk::checkpoint() {
+  if (!hasJournal) {
+    return;
+  }
+  pthread_mutex_lock(&checkpointLock);
+  checkpointLocked();
+  pthread_mutex_unlock(&checkpointLock);
+}
+
+/**
+ * Checkpoint every record written so far. The caller holds checkpointLock.
+ *
+ * The journal is flushed first so no home location ever holds part of a
+ * transaction that could still be lost. The new tail is made durable before
+ * its log space can be reused.
+ */
+void Disk::checkpointLocked() {
+  pthread_mutex_lock(&journalLock);
+  if (liveRecords.empty()) {
+    pthread_mutex_unlock(&journalLock);
+    return;
+  }
+  uint64_t lastSequence = liveRecords.back().sequence;
+  int64_t newTailOffset = headOffset;
+  pthread_mutex_unlock(&journalLock);
+
+  dataSync();
+
+  vector<pair<int, vector<unsigned char> > > blocks;
+  pthread_mutex_lock(&pendingLock);
+  map<int, struct PendingBlock>::iterator iter;
+  for (iter = pendingBlocks.begin(); iter != pendingBlocks.end(); iter++) {
+    if (iter->second.sequence <= lastSequence) {
+      blocks.push_back(make_pair(iter->first, vector<unsigned char>(iter->second.data, iter->second.data + blockSize)));
+    }
+  }
+  pthread_mutex_unlock(&pendingLock);
+
+  for (size_t idx = 0; idx < blocks.size(); ++idx) {
+    pwriteBlock(blocks[idx].first, blocks[idx].second.data());
+  }
+  dataSync();
+
+  tailSequence = lastSequence + 1;
+  tailOffset = newTailOffset;
+  writeJournalHeader();
+  dataSync();
+
+  // Entries rewritten by a newer transaction meanwhile stay pending.
+  pthread_mutex_lock(&pendingLock);
+  for (iter = pendingBlocks.begin(); iter != pendingBlocks.end();) {
+    if (iter->second.sequence <= lastSequence) {
+      delete [] iter->second.data;
+      pendingBlocks.erase(iter++);
+    } else {
+      iter++;
+    }
+  }
+  pthread_mutex_unlock(&pendingLock);
+
+  pthread_mutex_lock(&journalLock);
+  while (!liveRecords.empty() && liveRecords.front().sequence <= lastSequence) {
+    usedBlocks -= liveRecords.front().usedBlocks;
+    liveRecords.pop_front();
+  }
+  pthread_mutex_unlock(&journalLock);
+}
+
+void *Disk::checkpointThread(void *arg) {
+  Disk *disk = (Disk *) arg;
+
+  pthread_mutex_lock(&disk->journalLock);
+  while (!disk->stopCheckpointer) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += CHECKPOINT_INTERVAL_SECONDS;
+    pthread_cond_timedwait(&disk->checkpointCond, &disk->journalLock, &deadline);
+    if (disk->stopCheckpointer || disk->liveRecords.empty()) {
+      continue;
+    }
+
+    pthread_mutex_unlock(&disk->journalLock);
+    disk->checkpoint();
+    pthread_mutex_lock(&disk->journalLock);
+  }
+  pthread_mutex_unlock(&disk->journalLock);
+
+  return NULL;
 }
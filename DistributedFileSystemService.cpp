@@ -7,11 +7,13 @@
 #include <map>
 #include <string>
 #include <algorithm>
+#include <random>
 
 #include "DistributedFileSystemService.h"
 #include "ClientError.h"
 #include "ufs.h"
 #include "WwwFormEncodedDict.h"
+#include "HttpUtils.h"
 
 #include <string.h>
 
@@ -23,77 +25,135 @@ bool cmp(const dir_ent_t a, const dir_ent_t b) {
   return strcmp(a.name, b.name) < 0;
 }
 
-bool parsePath(const string &url, istringstream &paths) {
+// Holds a reader-writer lock until the end of the enclosing scope
+class ScopedLock {
+ public:
+  ScopedLock(pthread_rwlock_t *lock, bool exclusive) : lock(lock) {
+    if (exclusive)
+      pthread_rwlock_wrlock(lock);
+    else
+      pthread_rwlock_rdlock(lock);
+  }
+  ~ScopedLock() {
+    pthread_rwlock_unlock(lock);
+  }
+
+ private:
+  pthread_rwlock_t *lock;
+};
+
+bool parsePath(const string &url, string &allPaths) {
   const string root = "ds3/";
   const int rootIndex = url.find(root);
   if (rootIndex == static_cast<const int>(string::npos))
     return false;
   
-  string allPaths = url.substr(rootIndex + root.size());
-  paths = istringstream(allPaths);
+  allPaths = url.substr(rootIndex + root.size());
   return true;
 }
 
-DistributedFileSystemService::DistributedFileSystemService(string diskFile) : HttpService("/ds3/") {
-  fileSystem = new LocalFileSystem(new Disk(diskFile, UFS_BLOCK_SIZE));
+DistributedFileSystemService::DistributedFileSystemService(Disk *disk) : HttpService("/ds3/") {
+  fileSystem = new LocalFileSystem(disk);
+
+  super_t superBlock;
+  fileSystem->readSuperBlock(&superBlock);
+  pathCache = new PathCache(PATH_CACHE_SIZE, superBlock.num_inodes);
+  pthread_rwlock_init(&lock, NULL);
+}
+
+long DistributedFileSystemService::estimateSize(const string &url) {
+  string allPaths;
+  if (!parsePath(url.substr(0, url.find('?')), allPaths))
+    return -1;
+
+  int inodeNum;
+  if (!pathCache->get(allPaths, &inodeNum))
+    return -1;
+
+  inode_t inode;
+  fileSystem->getInodeCache()->get(inodeNum, &inode);
+  return inode.size;
 }
 
 void DistributedFileSystemService::get(HTTPRequest *request, HTTPResponse *response) {
   const string url = request->getUrl();
-  istringstream paths;
-  if (!parsePath(url, paths)) {
+  string allPaths;
+  if (!parsePath(url, allPaths)) {
     response->setBody("");
     return;
   }
 
+  ScopedLock reading(&lock, false);
   int inodeNum = ROOT_INODE;
-  string entryName;
-  while (getline(paths, entryName, '/')) {
-    const int nextInode = fileSystem->lookup(inodeNum, entryName);
-    if (nextInode == -ENOTFOUND) {
-      response->setStatus(ClientError::notFound().status_code);
-      response->setBody(ClientError::notFound().what());
-      return;
-    } else if (nextInode < 0) {
-      response->setStatus(ClientError::badRequest().status_code);
-      response->setBody(ClientError::badRequest().what());
-      return;
+  if (!pathCache->get(allPaths, &inodeNum)) {
+    istringstream paths(allPaths);
+    vector<int> directories;
+    string entryName;
+    while (getline(paths, entryName, '/')) {
+      directories.push_back(inodeNum);
+      const int nextInode = fileSystem->lookup(inodeNum, entryName);
+      if (nextInode == -ENOTFOUND) {
+        response->setStatus(ClientError::notFound().status_code);
+        response->setBody(ClientError::notFound().what());
+        return;
+      } else if (nextInode < 0) {
+        response->setStatus(ClientError::badRequest().status_code);
+        response->setBody(ClientError::badRequest().what());
+        return;
+      }
+      inodeNum = nextInode;
     }
-    inodeNum = nextInode;
+    pathCache->put(allPaths, inodeNum, directories);
   }
 
   inode_t inode;
   fileSystem->stat(inodeNum, &inode);
 
   if (inode.type == UFS_REGULAR_FILE) {
-    char buffer[inode.size + 1];
-    if (fileSystem->read(inodeNum, buffer, inode.size) < 0) {
+    // A Range header reads only the bytes asked for
+    vector<pair<int, int> > ranges;
+    bool ranged = false;
+    try {
+      ranged = HttpUtils::byteRanges(request->getHeader("Range"), inode.size, ranges);
+    } catch (...) {
+    }
+    if (ranged) {
+      getRanges(inodeNum, inode.size, ranges, response);
+      return;
+    }
+
+    // Files can be far too large for the stack. A write can change the
+    // size between stat and read, so go by what read returns.
+    string buffer(inode.size, '\0');
+    const int bytesRead = fileSystem->read(inodeNum, &buffer[0], inode.size);
+    if (bytesRead < 0) {
       response->setStatus(ClientError::badRequest().status_code);
       response->setBody(ClientError::badRequest().what());
       return;
     }
 
-    buffer[inode.size] = '\0';
+    buffer.resize(bytesRead);
     response->setBody(buffer);
   } else {
-    const int numEntries = inode.size / sizeof(dir_ent_t);
     dir_ent_t entries[inode.size / sizeof(dir_ent_t)];
-    if (fileSystem->read(inodeNum, entries, inode.size) < 0) {
+    const int bytesRead = fileSystem->read(inodeNum, entries, inode.size);
+    if (bytesRead < 0) {
       response->setStatus(ClientError::badRequest().status_code);
       response->setBody(ClientError::badRequest().what());
       return;
     }
+    const int numEntries = bytesRead / sizeof(dir_ent_t);
 
     sort(entries, entries + numEntries, cmp);
     
     string result = "";
-    for (dir_ent_t entry : entries) {
-      string entryName(entry.name);
+    for (int i = 0; i < numEntries; ++i) {
+      string entryName(entries[i].name);
       if (entryName == "." || entryName == "..")
         continue;
 
       inode_t entryInode;
-      fileSystem->stat(entry.inum, &entryInode);
+      fileSystem->stat(entries[i].inum, &entryInode);
 
       if (entryInode.type == UFS_DIRECTORY)
         entryName.push_back('/');
@@ -105,22 +165,147 @@ void DistributedFileSystemService::get(HTTPRequest *request, HTTPResponse *respo
   }
 }
 
+// Answer a GET that carried a Range header: 206 with one range as the
+// body, or a multipart/byteranges body for several, or 416 if none of
+// them overlaps the file. byteRanges has merged the ranges and capped
+// their number, so the body is never much larger than the file.
+void DistributedFileSystemService::getRanges(int inodeNum, int size, vector<pair<int, int> > &ranges,
+                                             HTTPResponse *response) {
+  const string sizeString = to_string(size);
+  if (ranges.empty()) {
+    response->setStatus(ClientError::rangeNotSatisfiable().status_code);
+    response->setHeader("Content-Range", "bytes */" + sizeString);
+    response->setBody(ClientError::rangeNotSatisfiable().what());
+    return;
+  }
+
+  string boundary;
+  string body;
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    const int first = ranges[i].first;
+    const int length = ranges[i].second - first + 1;
+    const string contentRange = "bytes " + to_string(first) + "-" + to_string(ranges[i].second) + "/" + sizeString;
+
+    string data(length, '\0');
+    if (fileSystem->pread(inodeNum, &data[0], length, first) != length) {
+      response->setStatus(ClientError::badRequest().status_code);
+      response->setBody(ClientError::badRequest().what());
+      return;
+    }
+
+    if (ranges.size() == 1) {
+      response->setHeader("Content-Range", contentRange);
+      body = data;
+      break;
+    }
+
+    if (boundary.empty()) {
+      // A fresh source per request, so worker threads share no state
+      random_device source;
+      char hex[17];
+      snprintf(hex, sizeof(hex), "%08x%08x", (unsigned int) source(), (unsigned int) source());
+      boundary = string("ds3-") + hex;
+    }
+    body += "--" + boundary + "\r\nContent-Range: " + contentRange + "\r\n\r\n" + data + "\r\n";
+  }
+
+  if (ranges.size() > 1) {
+    body += "--" + boundary + "--\r\n";
+    response->setContentType("multipart/byteranges; boundary=" + boundary);
+  }
+  response->setStatus(206);
+  response->setBody(body);
+}
+
 void DistributedFileSystemService::put(HTTPRequest *request, HTTPResponse *response) {
+  writeFile(request->getUrl(), request->getBody(), false, response);
+}
+
+// POST path?append adds the body to the end of the file, creating it
+// like PUT if it does not exist yet
+void DistributedFileSystemService::post(HTTPRequest *request, HTTPResponse *response) {
   const string url = request->getUrl();
-  istringstream paths;
-  if (!parsePath(url, paths)) {
+  const size_t query = url.find('?');
+  if (query == string::npos || url.substr(query + 1) != "append") {
+    HttpService::post(request, response);
+    return;
+  }
+
+  writeFile(url.substr(0, query), request->getBody(), true, response);
+}
+
+void DistributedFileSystemService::writeFile(const string &url, const string &content, bool append,
+                                             HTTPResponse *response) {
+  string allPaths;
+  if (!parsePath(url, allPaths)) {
     response->setBody("");
     return;
   }
 
+  istringstream paths(allPaths);
   vector<string> pathVec;
   string entryName;
   while (getline(paths, entryName, '/')) {
     pathVec.push_back(entryName);
   }
 
-  int inodeNum = ROOT_INODE;
-  for (int i = 0; i < (int)pathVec.size(); ++i) {
+  // The file system locks the inodes it changes, so writes only keep
+  // deletes out
+  ScopedLock writing(&lock, false);
+
+  // Turn the request away with 507 before allocating anything: walk the
+  // existing part of the path, then check what the rest will need against
+  // the free counters.
+  int existingInode = ROOT_INODE;
+  int numExisting = 0;
+  vector<int> directories;
+  const bool cached = pathCache->get(allPaths, &existingInode);
+  if (cached)
+    numExisting = pathVec.size();
+  while (numExisting < (int)pathVec.size()) {
+    directories.push_back(existingInode);
+    const int nextInode = fileSystem->lookup(existingInode, pathVec[numExisting]);
+    if (nextInode < 0)
+      break;
+    existingInode = nextInode;
+    ++numExisting;
+  }
+
+  inode_t existing;
+  fileSystem->stat(existingInode, &existing);
+  const int numMissing = pathVec.size() - numExisting;
+  int inodesNeeded = numMissing;
+  int blocksNeeded = 0;
+  long long newSize = content.size();
+  if (numMissing > 0) {
+    // one block per new directory, plus whatever the parent needs to take
+    // the first new entry
+    blocksNeeded = numMissing - 1;
+    if (existing.type == UFS_DIRECTORY)
+      blocksNeeded += fileSystem->blocksToAddEntry(&existing);
+  } else if (existing.type == UFS_REGULAR_FILE) {
+    // the blocks the file already has get reused, and an append keeps
+    // them all
+    blocksNeeded = -fileSystem->blocksForSize(existing.size);
+    if (append)
+      newSize += existing.size;
+  }
+  blocksNeeded += fileSystem->blocksForSize(min(newSize, (long long) MAX_FILE_SIZE));
+
+  super_t superBlock;
+  fileSystem->readSuperBlock(&superBlock);
+  if (!fileSystem->diskHasSpace(&superBlock, inodesNeeded, 0, blocksNeeded)) {
+    response->setStatus(ClientError::insufficientStorage().status_code);
+    response->setBody(ClientError::insufficientStorage().what());
+    return;
+  }
+
+  // Create whatever is missing, starting where the walk above stopped
+  int inodeNum = existingInode;
+  if (numExisting < (int)pathVec.size())
+    directories.pop_back();
+  for (int i = numExisting; i < (int)pathVec.size(); ++i) {
+    directories.push_back(inodeNum);
     const string nextEntry = pathVec[i];
     int nextInode = fileSystem->lookup(inodeNum, nextEntry);
     if (nextInode == -ENOTFOUND) {
@@ -148,8 +333,12 @@ void DistributedFileSystemService::put(HTTPRequest *request, HTTPResponse *respo
     inodeNum = nextInode;
   }
 
-  const string content = request->getBody();
-  const int bytesWritten = fileSystem->write(inodeNum, content.data(), content.size());
+  if (!cached)
+    pathCache->put(allPaths, inodeNum, directories);
+
+  const int bytesWritten = append ?
+    fileSystem->append(inodeNum, content.data(), content.size()) :
+    fileSystem->write(inodeNum, content.data(), content.size());
   if (bytesWritten == -ENOTENOUGHSPACE || bytesWritten == -EINVALIDSIZE) {
     response->setStatus(ClientError::insufficientStorage().status_code);
     response->setBody(ClientError::insufficientStorage().what());
@@ -165,18 +354,21 @@ void DistributedFileSystemService::put(HTTPRequest *request, HTTPResponse *respo
 
 void DistributedFileSystemService::del(HTTPRequest *request, HTTPResponse *response) {
   const string url = request->getUrl();
-  istringstream paths;
-  if (!parsePath(url, paths)) {
+  string allPaths;
+  if (!parsePath(url, allPaths)) {
     response->setBody("");
     return;
   }
 
+  istringstream paths(allPaths);
   vector<string> pathVec;
   string entryName;
   while (getline(paths, entryName, '/')) {
     pathVec.push_back(entryName);
   }
 
+  ScopedLock writing(&lock, true);
+
   super_t superBlock;
   fileSystem->readSuperBlock(&superBlock);
 
@@ -217,5 +409,8 @@ void DistributedFileSystemService::del(HTTPRequest *request, HTTPResponse *respo
     return;
   }
 
+  // Every cached path through the parent is now suspect
+  pathCache->invalidateDirectory(parentInodeNum);
+
   response->setBody("");
 }
@@ -38,6 +38,10 @@ void HTTPResponse::setStatus(int status) {
 string HTTPResponse::statusToString() {
   if (status == 200) {
     return "OK";
+  } else if (status == 206) {
+    return "Partial Content";
+  } else if (status == 416) {
+    return "Range Not Satisfiable";
   } else {
     return "Unknown";
   }
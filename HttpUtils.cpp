@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <algorithm>
 
 #include "HttpUtils.h"
 
@@ -43,6 +44,88 @@ void HttpUtils::writeLastChunk(MySocket *client) {
 }
 
 
+// Non-negative decimal, at most 18 digits so it fits in a long long
+static bool parseByteOffset(const string &s, long long *value) {
+  if (s.empty() || s.size() > 18) {
+    return false;
+  }
+  *value = 0;
+  for (unsigned idx = 0; idx < s.size(); idx++) {
+    if (s[idx] < '0' || s[idx] > '9') {
+      return false;
+    }
+    *value = *value * 10 + (s[idx] - '0');
+  }
+  return true;
+}
+
+bool HttpUtils::byteRanges(const string &header, int size,
+                           vector<pair<int, int> > &ranges) {
+  const string unit = "bytes=";
+  if (header.compare(0, unit.size(), unit) != 0) {
+    return false;
+  }
+
+  vector<string> specs = split(header.substr(unit.size()), ',');
+  if (specs.size() == 0 || specs.size() > MAX_BYTE_RANGES) {
+    return false;
+  }
+
+  for (unsigned idx = 0; idx < specs.size(); idx++) {
+    string spec = specs[idx];
+    spec.erase(0, spec.find_first_not_of(" \t"));
+    spec.erase(spec.find_last_not_of(" \t") + 1);
+
+    const size_t dash = spec.find('-');
+    if (dash == string::npos) {
+      return false;
+    }
+
+    long long first, last;
+    if (dash == 0) {
+      // "-n" is the last n bytes
+      long long length;
+      if (!parseByteOffset(spec.substr(1), &length)) {
+        return false;
+      }
+      if (length == 0 || size == 0) {
+        continue;
+      }
+      first = max(0LL, (long long) size - length);
+      last = size - 1;
+    } else {
+      if (!parseByteOffset(spec.substr(0, dash), &first)) {
+        return false;
+      }
+      if (dash + 1 == spec.size()) {
+        last = size - 1;
+      } else if (!parseByteOffset(spec.substr(dash + 1), &last) || last < first) {
+        return false;
+      }
+      if (first >= size) {
+        continue;
+      }
+      last = min(last, (long long) size - 1);
+    }
+    ranges.push_back(make_pair((int) first, (int) last));
+  }
+
+  // Overlapping ranges would send the same bytes more than once
+  sort(ranges.begin(), ranges.end());
+  size_t merged = 0;
+  for (size_t idx = 1; idx < ranges.size(); idx++) {
+    if ((long long) ranges[idx].first <= (long long) ranges[merged].second + 1) {
+      ranges[merged].second = max(ranges[merged].second, ranges[idx].second);
+    } else {
+      ranges[++merged] = ranges[idx];
+    }
+  }
+  if (!ranges.empty()) {
+    ranges.resize(merged + 1);
+  }
+  return true;
+}
+
 // split lifted from stackoverflow
 // http://stackoverflow.com/questions/236129/split-a-string-in-c
 vector<string> &HttpUtils::split(const string &s,
@@ -0,0 +1,188 @@
+#include <string.h>
+
+#include "InodeCache.h"
+
+using namespace std;
+
+static const int INODES_PER_BLOCK = UFS_BLOCK_SIZE / sizeof(inode_t);
+
+InodeCache::InodeCache(Disk *disk, int inodeRegionAddr, int capacity) {
+  pthread_mutex_init(&lock, NULL);
+  this->disk = disk;
+  this->inodeRegionAddr = inodeRegionAddr;
+  this->capacity = capacity;
+  this->hitCount = 0;
+  this->missCount = 0;
+  this->generation = 0;
+}
+
+InodeCache::~InodeCache() {
+  unordered_map<int, Entry *>::iterator iter;
+  for (iter = entries.begin(); iter != entries.end(); iter++) {
+    delete iter->second;
+  }
+  pthread_mutex_destroy(&lock);
+}
+
+void InodeCache::readInode(int inodeNumber, inode_t *inode) {
+  inode_t block[INODES_PER_BLOCK];
+  disk->readBlock(inodeRegionAddr + inodeNumber / INODES_PER_BLOCK, block);
+  *inode = block[inodeNumber % INODES_PER_BLOCK];
+}
+
+// Find a cached inode and mark it recently used, or return NULL.
+InodeCache::Entry *InodeCache::lookupLocked(int inodeNumber) {
+  unordered_map<int, Entry *>::iterator found = entries.find(inodeNumber);
+  if (found == entries.end()) {
+    return NULL;
+  }
+  Entry *entry = found->second;
+  recency.splice(recency.begin(), recency, entry->position);
+  return entry;
+}
+
+// Add an entry for an inode that is not cached. The caller fills it in.
+InodeCache::Entry *InodeCache::insertLocked(int inodeNumber) {
+  evictLocked();
+  Entry *entry = new Entry();
+  entry->references = 0;
+  entry->dirty = false;
+  recency.push_front(inodeNumber);
+  entry->position = recency.begin();
+  entries[inodeNumber] = entry;
+  return entry;
+}
+
+// Find an inode, reading it from disk if it is not cached. The lock is
+// dropped for the read, so another thread may have cached the inode by
+// the time it is taken again; a put in the meantime means the inode just
+// read may be stale, so it is read again.
+InodeCache::Entry *InodeCache::loadLocked(int inodeNumber) {
+  Entry *entry = lookupLocked(inodeNumber);
+  if (entry != NULL) {
+    hitCount++;
+    return entry;
+  }
+
+  missCount++;
+  while (true) {
+    uint64_t token = generation;
+    inode_t inode;
+    pthread_mutex_unlock(&lock);
+    readInode(inodeNumber, &inode);
+    pthread_mutex_lock(&lock);
+
+    entry = lookupLocked(inodeNumber);
+    if (entry != NULL) {
+      return entry;
+    }
+    if (generation == token) {
+      entry = insertLocked(inodeNumber);
+      entry->inode = inode;
+      return entry;
+    }
+  }
+}
+
+// Make room for one more entry. Pinned and dirty inodes stay, so the cache
+// can briefly exceed its capacity while an operation is in flight.
+void InodeCache::evictLocked() {
+  list<int>::reverse_iterator iter = recency.rbegin();
+  while ((int) entries.size() >= capacity && iter != recency.rend()) {
+    Entry *entry = entries[*iter];
+    if (entry->references > 0 || entry->dirty) {
+      iter++;
+      continue;
+    }
+    entries.erase(*iter);
+    iter = list<int>::reverse_iterator(recency.erase(next(iter).base()));
+    delete entry;
+  }
+}
+
+inode_t *InodeCache::acquire(int inodeNumber) {
+  pthread_mutex_lock(&lock);
+  Entry *entry = loadLocked(inodeNumber);
+  entry->references++;
+  pthread_mutex_unlock(&lock);
+  return &entry->inode;
+}
+
+void InodeCache::release(int inodeNumber) {
+  pthread_mutex_lock(&lock);
+  entries[inodeNumber]->references--;
+  pthread_mutex_unlock(&lock);
+}
+
+void InodeCache::get(int inodeNumber, inode_t *inode) {
+  pthread_mutex_lock(&lock);
+  *inode = loadLocked(inodeNumber)->inode;
+  pthread_mutex_unlock(&lock);
+}
+
+void InodeCache::put(int inodeNumber, const inode_t *inode) {
+  pthread_mutex_lock(&lock);
+  Entry *entry = lookupLocked(inodeNumber);
+  if (entry == NULL) {
+    entry = insertLocked(inodeNumber);
+  }
+  entry->inode = *inode;
+  entry->dirty = true;
+  dirtyInodes.insert(inodeNumber);
+  generation++;
+  pthread_mutex_unlock(&lock);
+}
+
+void InodeCache::flush() {
+  pthread_mutex_lock(&lock);
+  set<int>::iterator iter = dirtyInodes.begin();
+  while (iter != dirtyInodes.end()) {
+    // dirtyInodes is sorted, so inodes sharing a block are adjacent
+    int blockIndex = *iter / INODES_PER_BLOCK;
+    inode_t block[INODES_PER_BLOCK];
+    disk->readBlock(inodeRegionAddr + blockIndex, block);
+    for (; iter != dirtyInodes.end() && *iter / INODES_PER_BLOCK == blockIndex; iter++) {
+      block[*iter % INODES_PER_BLOCK] = entries[*iter]->inode;
+      flushedInodes.insert(*iter);
+    }
+    disk->writeBlock(inodeRegionAddr + blockIndex, block);
+  }
+  dirtyInodes.clear();
+  pthread_mutex_unlock(&lock);
+}
+
+// Until now the inode-table blocks flush wrote were only in the caller's
+// transaction, so a clean copy evicted and read back would have been old.
+// Inodes put again since the flush stay dirty.
+void InodeCache::published() {
+  pthread_mutex_lock(&lock);
+  set<int>::iterator iter;
+  for (iter = flushedInodes.begin(); iter != flushedInodes.end(); iter++) {
+    if (dirtyInodes.find(*iter) == dirtyInodes.end()) {
+      entries[*iter]->dirty = false;
+    }
+  }
+  flushedInodes.clear();
+  pthread_mutex_unlock(&lock);
+}
+
+void InodeCache::refresh() {
+  pthread_mutex_lock(&lock);
+  unordered_map<int, Entry *>::iterator iter;
+  for (iter = entries.begin(); iter != entries.end(); iter++) {
+    readInode(iter->first, &iter->second->inode);
+    iter->second->dirty = false;
+  }
+  dirtyInodes.clear();
+  flushedInodes.clear();
+  generation++;
+  pthread_mutex_unlock(&lock);
+}
+
+unsigned long InodeCache::hits() {
+  return hitCount;
+}
+
+unsigned long InodeCache::misses() {
+  return missCount;
+}
@@ -1,6 +1,10 @@
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <string>
 #include <vector>
+#include <map>
+#include <set>
 #include <assert.h>
 
 #include "LocalFileSystem.h"
@@ -33,70 +37,329 @@ inline int bit2Block(const super_t &super, const int bit) {
   return bit + super.data_region_addr;
 }
 
-bool findBit(const unsigned char *bitmap, const int bit) {
-  int byteIdx = bit / 8;
-  int bitOffset = bit % 8;
-  unsigned char byte = bitmap[byteIdx];
+int divide(const int a, const int b) {
+  return (a+b-1) / b;
+}
+
+// Regular files this small keep their data in the inode
+inline bool fitsInline(const super_t &super, const int size) {
+  return super.version >= UFS_VERSION_INLINE && size <= (int) MAX_INLINE_SIZE;
+}
+
+// 16-bit FNV-1a hash of an entry name, for the directory hash index
+unsigned short nameHash(const char *name) {
+  unsigned int hash = 2166136261u;
+  for (; *name != '\0'; ++name) {
+    hash ^= (unsigned char) *name;
+    hash *= 16777619u;
+  }
+  return (unsigned short) (hash ^ (hash >> 16));
+}
+
+// ==================================
+// !!
+// LOOK AT FILESYSTEM.H FOR FUNCTIONS
+// !!
+// ==================================
+
+// done
+LocalFileSystem::LocalFileSystem(Disk *disk) : dentries(DENTRY_CACHE_SIZE) {
+  this->disk = disk;
+  this->superBlockReadCount = 0;
+  for (int i = 0; i < INODE_LOCK_STRIPES; ++i)
+    pthread_rwlock_init(&inodeLocks[i], NULL);
+  pthread_mutex_init(&allocationLock, NULL);
+  pthread_mutex_init(&changesLock, NULL);
+  static atomic<unsigned long> instances(0);
+  this->instance = ++instances;
+  loadSuperBlock();
+
+  // Replay anything a crash left in the journal before using the image.
+  if (superBlock.journal_len > 0 &&
+      disk->openJournal(superBlock.journal_addr, superBlock.journal_len) > 0) {
+    loadSuperBlock();
+  }
+
+  inodeBitmap.load(disk, superBlock.inode_bitmap_addr, superBlock.inode_bitmap_len, superBlock.num_inodes);
+  dataBitmap.load(disk, superBlock.data_bitmap_addr, superBlock.data_bitmap_len, superBlock.num_data);
+
+  // The bitmaps are authoritative. Images made before the free counters
+  // existed get them written with the first change.
+  freeInodes = inodeBitmap.countFree();
+  freeData = dataBitmap.countFree();
+  countersWritten = superBlock.counters_magic == UFS_COUNTERS_MAGIC;
+
+  // The root directory is on every path, so keep it pinned
+  inodeCache = new InodeCache(disk, superBlock.inode_region_addr, INODE_CACHE_SIZE);
+  inodeCache->acquire(UFS_ROOT_DIRECTORY_INODE_NUMBER);
+}
 
-  return byte & (1 << bitOffset);
+// Reserved bits were never written to disk, so handing them back only
+// matters to the bitmaps in memory, but it keeps every bit accounted for
+// until the file system goes away.
+LocalFileSystem::~LocalFileSystem() {
+  returnReservations();
+  map<thread::id, ThreadState *>::iterator iter;
+  for (iter = threads.begin(); iter != threads.end(); iter++) {
+    pthread_mutex_destroy(&iter->second->pool.lock);
+    delete iter->second;
+  }
+  delete inodeCache;
+  for (int i = 0; i < INODE_LOCK_STRIPES; ++i)
+    pthread_rwlock_destroy(&inodeLocks[i]);
+  pthread_mutex_destroy(&allocationLock);
+  pthread_mutex_destroy(&changesLock);
 }
 
-void createBit(unsigned char *bitmap, const int bit) {
-  int byteIdx = bit / 8;
-  int bitOffset = bit % 8;
-  unsigned char byte = bitmap[byteIdx];
+void LocalFileSystem::loadSuperBlock() {
+  char buffer[UFS_BLOCK_SIZE];
+  disk->readBlock(0, buffer);
+  memcpy(&superBlock, buffer, sizeof(super_t));
+  superBlockReadCount++;
+}
 
-  bitmap[byteIdx] = byte | (1 << bitOffset);
+// done
+void LocalFileSystem::readSuperBlock(super_t *super) {
+  // The layout never changes under a running operation, so only the free
+  // counters need care, and they are atomic
+  *super = superBlock;
+  super->free_inodes = freeInodes;
+  super->free_data = freeData;
 }
 
-void delBit(unsigned char *bitmap, const int bit) {
-  int byteIdx = bit / 8;
-  int bitOffset = bit % 8;
-  unsigned char byte = bitmap[byteIdx];
+void LocalFileSystem::invalidateSuperBlock() {
+  pthread_mutex_lock(&allocationLock);
+  loadSuperBlock();
+  freeInodes = inodeBitmap.countFree() + inodeBitmap.countReserved();
+  freeData = dataBitmap.countFree() + dataBitmap.countReserved();
+  countersWritten = superBlock.counters_magic == UFS_COUNTERS_MAGIC;
+  pthread_mutex_unlock(&allocationLock);
+  dentries.clear();
+}
 
-  bitmap[byteIdx] = byte & ~(1 << bitOffset);
+unsigned long LocalFileSystem::superBlockReads() {
+  return superBlockReadCount;
 }
 
-int countBits(const unsigned char *bitmap, const int size) {
-  int availableBits = 0;
-  
-  for (int i = 0; i < size; ++i)
-    if (!findBit(bitmap, i))
-      ++availableBits;
+DentryCache *LocalFileSystem::getDentryCache() {
+  return &dentries;
+}
 
-  return availableBits;
+InodeCache *LocalFileSystem::getInodeCache() {
+  return inodeCache;
 }
 
-int divide(const int a, const int b) {
-  return (a+b-1) / b;
+// "." and ".." are not cached, so a removed directory leaves behind only
+// negative entries.
+inline bool cacheableName(const string &name) {
+  return name != "." && name != "..";
 }
 
-int findFirstBit(const unsigned char *bitmap, const int len) {
-  for (int i = 0; i < len * 8; ++i) {
-    if (!findBit(bitmap, i)) {
-      return i;
+LocalFileSystem::InodeLocks::InodeLocks(LocalFileSystem *fileSystem) {
+  this->fileSystem = fileSystem;
+  this->count = 0;
+}
+
+LocalFileSystem::InodeLocks::InodeLocks(LocalFileSystem *fileSystem, int inodeNumber, bool exclusive) {
+  this->fileSystem = fileSystem;
+  this->count = 0;
+  acquire(inodeNumber, -1, exclusive);
+}
+
+LocalFileSystem::InodeLocks::~InodeLocks() {
+  release();
+}
+
+// second may be -1 to lock just first
+void LocalFileSystem::InodeLocks::acquire(int first, int second, bool exclusive) {
+  int stripes[2] = {first % INODE_LOCK_STRIPES, second % INODE_LOCK_STRIPES};
+  count = second < 0 || stripes[0] == stripes[1] ? 1 : 2;
+  if (count == 2 && stripes[1] < stripes[0])
+    swap(stripes[0], stripes[1]);
+
+  for (int i = 0; i < count; ++i) {
+    locks[i] = &fileSystem->inodeLocks[stripes[i]];
+    if (exclusive)
+      pthread_rwlock_wrlock(locks[i]);
+    else
+      pthread_rwlock_rdlock(locks[i]);
+  }
+}
+
+void LocalFileSystem::InodeLocks::release() {
+  while (count > 0)
+    pthread_rwlock_unlock(locks[--count]);
+}
+
+// The calling thread's state, remembered per thread so the map and its
+// lock are skipped after the first call
+LocalFileSystem::ThreadState *LocalFileSystem::threadState() {
+  static thread_local unsigned long cachedInstance = 0;
+  static thread_local ThreadState *cachedState = NULL;
+  if (cachedInstance == instance)
+    return cachedState;
+
+  pthread_mutex_lock(&changesLock);
+  ThreadState *&state = threads[this_thread::get_id()];
+  if (state == NULL) {
+    state = new ThreadState();
+    pthread_mutex_init(&state->pool.lock, NULL);
+  }
+  pthread_mutex_unlock(&changesLock);
+
+  cachedInstance = instance;
+  cachedState = state;
+  return state;
+}
+
+LocalFileSystem::PendingChanges &LocalFileSystem::pendingChanges() {
+  return threadState()->pending;
+}
+
+// Give back what the failed operation allocated and forget what it meant
+// to free. Its allocations are still only reserved, so they go back to
+// the thread's pool for the next operation, up to a batch of each; the
+// rest is returned to the bitmaps.
+void LocalFileSystem::abandonChanges() {
+  ThreadState *state = threadState();
+  PendingChanges &pending = state->pending;
+  AllocationPool &pool = state->pool;
+  pthread_mutex_lock(&pool.lock);
+  pool.inodes.insert(pool.inodes.begin(), pending.allocatedInodes.begin(), pending.allocatedInodes.end());
+  pool.data.insert(pool.data.begin(), pending.allocatedData.begin(), pending.allocatedData.end());
+  if ((int) pool.inodes.size() > INODE_POOL_BATCH || (int) pool.data.size() > DATA_POOL_BATCH) {
+    pthread_mutex_lock(&allocationLock);
+    while ((int) pool.inodes.size() > INODE_POOL_BATCH) {
+      inodeBitmap.unreserve(pool.inodes.back());
+      pool.inodes.pop_back();
     }
+    while ((int) pool.data.size() > DATA_POOL_BATCH) {
+      dataBitmap.unreserve(pool.data.back());
+      pool.data.pop_back();
+    }
+    pthread_mutex_unlock(&allocationLock);
   }
+  pthread_mutex_unlock(&pool.lock);
+  pending = PendingChanges();
+}
 
-  return -1;
+// Take count bits from the thread's pool, first reserving at least batch
+// more in the bitmap if the pool is short. Data bits come from free runs
+// so a thread's blocks tend to be adjacent. Returns false, taking nothing,
+// if the bitmap cannot make up the difference.
+bool LocalFileSystem::takeReserved(bool inodes, int batch, int count, vector<int> &bits) {
+  ThreadState *state = threadState();
+  Bitmap &bitmap = inodes ? inodeBitmap : dataBitmap;
+  deque<int> &reserved = inodes ? state->pool.inodes : state->pool.data;
+
+  pthread_mutex_lock(&state->pool.lock);
+  if ((int) reserved.size() < count) {
+    int wanted = max(batch, count) - reserved.size();
+    pthread_mutex_lock(&allocationLock);
+    while (wanted > 0) {
+      int length = 0;
+      const int start = bitmap.findFreeRun(1, wanted, &length);
+      if (start < 0)
+        break;
+      for (int bit = start; bit < start + length; ++bit) {
+        bitmap.reserve(bit);
+        reserved.push_back(bit);
+      }
+      wanted -= length;
+    }
+    pthread_mutex_unlock(&allocationLock);
+  }
+
+  const bool enough = (int) reserved.size() >= count;
+  if (enough) {
+    bits.insert(bits.end(), reserved.begin(), reserved.begin() + count);
+    reserved.erase(reserved.begin(), reserved.begin() + count);
+  }
+  pthread_mutex_unlock(&state->pool.lock);
+  return enough;
 }
 
-// ==================================
-// !!
-// LOOK AT FILESYSTEM.H FOR FUNCTIONS
-// !!
-// ==================================
+void LocalFileSystem::returnReservations() {
+  pthread_mutex_lock(&changesLock);
+  map<thread::id, ThreadState *>::iterator iter;
+  for (iter = threads.begin(); iter != threads.end(); iter++) {
+    AllocationPool &pool = iter->second->pool;
+    pthread_mutex_lock(&pool.lock);
+    pthread_mutex_lock(&allocationLock);
+    for (size_t i = 0; i < pool.inodes.size(); ++i)
+      inodeBitmap.unreserve(pool.inodes[i]);
+    for (size_t i = 0; i < pool.data.size(); ++i)
+      dataBitmap.unreserve(pool.data[i]);
+    pthread_mutex_unlock(&allocationLock);
+    pool.inodes.clear();
+    pool.data.clear();
+    pthread_mutex_unlock(&pool.lock);
+  }
+  pthread_mutex_unlock(&changesLock);
+}
 
-// done
-LocalFileSystem::LocalFileSystem(Disk *disk) {
-  this->disk = disk;
+// Returns the new inode number, or -1 if there are none left
+int LocalFileSystem::allocateInode() {
+  vector<int> bits;
+  if (!takeReserved(true, INODE_POOL_BATCH, 1, bits)) {
+    returnReservations();
+    if (!takeReserved(true, 1, 1, bits))
+      return -1;
+  }
+  pendingChanges().allocatedInodes.push_back(bits[0]);
+  return bits[0];
 }
 
-// done
-void LocalFileSystem::readSuperBlock(super_t *super) {
+// Returns the new block number, or -1 if the disk is full
+int LocalFileSystem::allocateDataBlock(super_t &super) {
+  vector<int> bits;
+  if (!takeReserved(false, DATA_POOL_BATCH, 1, bits)) {
+    returnReservations();
+    if (!takeReserved(false, 1, 1, bits))
+      return -1;
+  }
+  pendingChanges().allocatedData.push_back(bits[0]);
+  return bit2Block(super, bits[0]);
+}
+
+// The block is released when the operation commits
+void LocalFileSystem::freeDataBlock(super_t &super, int block) {
+  pendingChanges().freedData.push_back(block2Bit(super, block));
+}
+
+// Blocks reserved by any thread count as free, since they can be returned
+int LocalFileSystem::freeDataBlocks() {
+  pthread_mutex_lock(&allocationLock);
+  const int free = dataBitmap.countFree() + dataBitmap.countReserved();
+  pthread_mutex_unlock(&allocationLock);
+  return free;
+}
+
+// Bring the free counters in the superblock up to date with the bitmaps as
+// written to disk, where reserved bits are clear, writing block 0 only if
+// they changed. Call inside the transaction that flushes the bitmaps so
+// both reach disk together, holding allocationLock.
+void LocalFileSystem::writeFreeCounts() {
+  const int inodes = inodeBitmap.countFree() + inodeBitmap.countReserved();
+  const int data = dataBitmap.countFree() + dataBitmap.countReserved();
+  if (countersWritten && freeInodes == inodes && freeData == data) {
+    return;
+  }
+
+  freeInodes = inodes;
+  freeData = data;
+  countersWritten = true;
+
+  // superBlock itself is read without a lock, so the counters go into a copy
+  super_t written = superBlock;
+  written.free_inodes = inodes;
+  written.free_data = data;
+  written.counters_magic = UFS_COUNTERS_MAGIC;
+
   char buffer[UFS_BLOCK_SIZE];
-  disk->readBlock(0, buffer);
-  memcpy(super, buffer, sizeof(super_t));
+  memset(buffer, 0, UFS_BLOCK_SIZE);
+  memcpy(buffer, &written, sizeof(super_t));
+  disk->writeBlock(0, buffer);
 }
 
 // done
@@ -110,7 +373,14 @@ int LocalFileSystem::lookup(int parentInodeNumber, string name) {
     return -EINVALIDINODE;
   }
 
+  // Answer from the dentry cache if we have seen this name before
+  int cachedInode;
+  if (dentries.get(parentInodeNumber, name, &cachedInode)) {
+    return cachedInode == DENTRY_NEGATIVE ? -ENOTFOUND : cachedInode;
+  }
+
   // Get inode information
+  InodeLocks locked(this, parentInodeNumber, false);
   inode_t parentInode;
   stat(parentInodeNumber, &parentInode);
 
@@ -119,35 +389,289 @@ int LocalFileSystem::lookup(int parentInodeNumber, string name) {
     return -EINVALIDINODE;
   }
 
-  // Go through all direct pointers
-  for (int i = 0; i < DIRECT_PTRS; ++i) {
-    int blockNumber = parentInode.direct[i];
+  // Find the entry
+  dir_ent_t entry;
+  if (findEntry(&parentInode, name, &entry) < 0) {
+    if (cacheableName(name))
+      dentries.put(parentInodeNumber, name, DENTRY_NEGATIVE);
+    return -ENOTFOUND; // ERROR, name not found
+  }
+
+  if (cacheableName(name))
+    dentries.put(parentInodeNumber, name, entry.inum);
+  return entry.inum;
+}
+
+// Returns the index of `name` in the directory and copies its entry, or
+// returns -1. Hashed directories compare the 16-bit hashes first and read
+// only the blocks whose hash matched; others are scanned block by block.
+int LocalFileSystem::findEntry(inode_t *directory, const string &name, dir_ent_t *found) {
+  const int numEntries = directory->size / sizeof(dir_ent_t);
+  dir_ent_t entries[ENTRIES_IN_BLOCK];
+  int loadedBlock = -1;
+
+  if (directory->flags & UFS_FLAG_HASHED_DIR) {
+    const unsigned short hash = nameHash(name.c_str());
+    unsigned short hashes[DIR_HASHES_PER_BLOCK];
+
+    for (int first = 0; first < numEntries; first += DIR_HASHES_PER_BLOCK) {
+      disk->readBlock(directory->direct[DIR_DATA_PTRS + first / DIR_HASHES_PER_BLOCK], hashes);
+
+      const int last = min(numEntries, first + (int) DIR_HASHES_PER_BLOCK);
+      for (int i = first; i < last; ++i) {
+        if (hashes[i - first] != hash)
+          continue;
+
+        const int block = i / ENTRIES_IN_BLOCK;
+        if (block != loadedBlock) {
+          disk->readBlock(directory->direct[block], entries);
+          loadedBlock = block;
+        }
+        if (string(entries[i % ENTRIES_IN_BLOCK].name) == name) {
+          *found = entries[i % ENTRIES_IN_BLOCK];
+          return i;
+        }
+      }
+    }
+    return -1;
+  }
+
+  for (int i = 0; i < numEntries; ++i) {
+    const int block = i / ENTRIES_IN_BLOCK;
+    if (block != loadedBlock) {
+      disk->readBlock(directory->direct[block], entries);
+      loadedBlock = block;
+    }
+    if (string(entries[i % ENTRIES_IN_BLOCK].name) == name) {
+      *found = entries[i % ENTRIES_IN_BLOCK];
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Number of pointer blocks an indirect file of numBlocks blocks needs
+int pointerBlocksFor(int numBlocks) {
+  const int mapped = numBlocks - INDIRECT_DATA_PTRS;
+  if (mapped <= 0)
+    return 0;
+  if (mapped <= (int) PTRS_PER_BLOCK)
+    return 1;
+  return 2 + divide(mapped - PTRS_PER_BLOCK, PTRS_PER_BLOCK);
+}
+
+// Collects the data blocks of a file in file order and, if pointerBlocks is
+// given, the blocks that map them: the indirect block, the double-indirect
+// block and then its second-level blocks.
+void LocalFileSystem::fileBlocks(inode_t *inode, vector<int> &dataBlocks, vector<int> *pointerBlocks) {
+  if (inode->flags & UFS_FLAG_INLINE)
+    return;
+
+  const int numBlocks = divide(inode->size, UFS_BLOCK_SIZE);
+  if (inode->flags & UFS_FLAG_EXTENTS) {
+    const extent_t *extents = (const extent_t *) inode->direct;
+    for (int i = 0; i < MAX_EXTENTS && (int) dataBlocks.size() < numBlocks; ++i) {
+      for (unsigned int j = 0; j < extents[i].length; ++j)
+        dataBlocks.push_back(extents[i].start + j);
+    }
+    return;
+  }
+
+  if (!(inode->flags & UFS_FLAG_INDIRECT)) {
+    for (int i = 0; i < numBlocks; ++i)
+      dataBlocks.push_back(inode->direct[i]);
+    return;
+  }
+
+  for (int i = 0; i < min(numBlocks, INDIRECT_DATA_PTRS); ++i)
+    dataBlocks.push_back(inode->direct[i]);
+
+  int remaining = numBlocks - INDIRECT_DATA_PTRS;
+  unsigned int pointers[PTRS_PER_BLOCK];
+  if (remaining > 0) {
+    if (pointerBlocks != NULL)
+      pointerBlocks->push_back(inode->direct[INDIRECT_PTR]);
+    disk->readBlock(inode->direct[INDIRECT_PTR], pointers);
+    for (int i = 0; i < min(remaining, (int) PTRS_PER_BLOCK); ++i)
+      dataBlocks.push_back(pointers[i]);
+    remaining -= PTRS_PER_BLOCK;
+  }
 
-    // ERROR
-    if (blockNumber == -1) {
-      return -ENOTFOUND;
+  if (remaining > 0) {
+    unsigned int secondLevel[PTRS_PER_BLOCK];
+    if (pointerBlocks != NULL)
+      pointerBlocks->push_back(inode->direct[DOUBLE_INDIRECT_PTR]);
+    disk->readBlock(inode->direct[DOUBLE_INDIRECT_PTR], secondLevel);
+    for (int j = 0; remaining > 0; ++j) {
+      if (pointerBlocks != NULL)
+        pointerBlocks->push_back(secondLevel[j]);
+      disk->readBlock(secondLevel[j], pointers);
+      for (int i = 0; i < min(remaining, (int) PTRS_PER_BLOCK); ++i)
+        dataBlocks.push_back(pointers[i]);
+      remaining -= PTRS_PER_BLOCK;
     }
+  }
+}
 
-    // Read directory entries from block
-    dir_ent_t directoryEntries[ENTRIES_IN_BLOCK];
-    disk->readBlock(parentInode.direct[i], directoryEntries);
+// Like fileBlocks, but only blocks first..first+count-1, reading just the
+// pointer blocks that map them.
+void LocalFileSystem::fileBlockRange(inode_t *inode, int first, int count, vector<int> &dataBlocks) {
+  if (inode->flags & UFS_FLAG_INLINE)
+    return;
+
+  if (inode->flags & UFS_FLAG_EXTENTS) {
+    const extent_t *extents = (const extent_t *) inode->direct;
+    int extentFirst = 0;
+    for (int i = 0; i < MAX_EXTENTS && count > 0; ++i) {
+      const int extentEnd = extentFirst + extents[i].length;
+      for (; first < extentEnd && count > 0; ++first, --count)
+        dataBlocks.push_back(extents[i].start + (first - extentFirst));
+      extentFirst = extentEnd;
+    }
+    return;
+  }
 
-    // Go through each entry
-    for (dir_ent_t entry : directoryEntries) {
-      // ERROR
-      if (entry.inum == -1) {
-        return -ENOTFOUND;
+  if (!(inode->flags & UFS_FLAG_INDIRECT)) {
+    for (int i = first; i < first + count; ++i)
+      dataBlocks.push_back(inode->direct[i]);
+    return;
+  }
+
+  unsigned int pointers[PTRS_PER_BLOCK];
+  unsigned int secondLevel[PTRS_PER_BLOCK];
+  int loadedPointers = -1;
+  bool loadedSecondLevel = false;
+  for (int i = first; i < first + count; ++i) {
+    if (i < INDIRECT_DATA_PTRS) {
+      dataBlocks.push_back(inode->direct[i]);
+      continue;
+    }
+
+    const int idx = i - INDIRECT_DATA_PTRS;
+    int pointerBlock;
+    if (idx < (int) PTRS_PER_BLOCK) {
+      pointerBlock = inode->direct[INDIRECT_PTR];
+    } else {
+      if (!loadedSecondLevel) {
+        disk->readBlock(inode->direct[DOUBLE_INDIRECT_PTR], secondLevel);
+        loadedSecondLevel = true;
       }
+      pointerBlock = secondLevel[(idx - PTRS_PER_BLOCK) / PTRS_PER_BLOCK];
+    }
+    if (pointerBlock != loadedPointers) {
+      disk->readBlock(pointerBlock, pointers);
+      loadedPointers = pointerBlock;
+    }
+    dataBlocks.push_back(pointers[idx % PTRS_PER_BLOCK]);
+  }
+}
+
+int LocalFileSystem::blocksForSize(int size) {
+  if (fitsInline(superBlock, size))
+    return 0;
+  const int numBlocks = divide(size, UFS_BLOCK_SIZE);
+  return numBlocks + (numBlocks > DIRECT_PTRS ? pointerBlocksFor(numBlocks) : 0);
+}
 
-      // RETURN inode number
-      if (string(entry.name) == name) {
-        return entry.inum;
+// Number of runs of adjacent blocks in a block list
+int countExtents(const vector<int> &blocks) {
+  int extents = 0;
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    if (i == 0 || blocks[i] != blocks[i - 1] + 1)
+      extents++;
+  }
+  return extents;
+}
+
+// Grow a file's block list to count blocks, keeping new blocks adjacent.
+// A new file small enough is served from the thread's pool. Otherwise
+// first extend the last run in place, then take the first free run long
+// enough for the rest, and only then settle for shorter runs, handing the
+// pools back once before giving up.
+bool LocalFileSystem::growContiguous(super_t &super, vector<int> &blocks, int count) {
+  PendingChanges &pending = pendingChanges();
+  if (blocks.empty() && count <= DATA_POOL_BATCH) {
+    vector<int> bits;
+    if (takeReserved(false, DATA_POOL_BATCH, count, bits)) {
+      for (size_t i = 0; i < bits.size(); ++i) {
+        pending.allocatedData.push_back(bits[i]);
+        blocks.push_back(bit2Block(super, bits[i]));
       }
+      return true;
     }
   }
 
-  // ERROR, name not found
-  return -ENOTFOUND;
+  bool returned = false;
+  pthread_mutex_lock(&allocationLock);
+  while ((int) blocks.size() < count) {
+    const int wanted = count - blocks.size();
+    int start = -1;
+    int length = 0;
+
+    if (!blocks.empty()) {
+      const int nextBit = block2Bit(super, blocks.back()) + 1;
+      length = dataBitmap.freeRunAt(nextBit, wanted);
+      if (length > 0)
+        start = nextBit;
+    }
+    if (start < 0)
+      start = dataBitmap.findFreeRun(wanted, wanted, &length);
+    if (start < 0)
+      start = dataBitmap.findFreeRun(1, wanted, &length);
+    if (start < 0 && !returned) {
+      pthread_mutex_unlock(&allocationLock);
+      returnReservations();
+      returned = true;
+      pthread_mutex_lock(&allocationLock);
+      continue;
+    }
+    if (start < 0) {
+      pthread_mutex_unlock(&allocationLock);
+      return false;
+    }
+
+    for (int bit = start; bit < start + length; ++bit) {
+      dataBitmap.reserve(bit);
+      pending.allocatedData.push_back(bit);
+      blocks.push_back(bit2Block(super, bit));
+    }
+  }
+  pthread_mutex_unlock(&allocationLock);
+  return true;
+}
+
+// Grow or shrink a list of blocks to count, taking new blocks from the data
+// bitmap and returning the ones dropped from the end.
+bool LocalFileSystem::resizeBlocks(super_t &super, vector<int> &blocks, int count) {
+  while ((int) blocks.size() > count) {
+    freeDataBlock(super, blocks.back());
+    blocks.pop_back();
+  }
+  while ((int) blocks.size() < count) {
+    const int block = allocateDataBlock(super);
+    if (block < 0)
+      return false;
+    blocks.push_back(block);
+  }
+  return true;
+}
+
+// A directory gets its hash index when it grows past its first block, as
+// long as the index still fits in one hash block.
+bool needsHashIndex(const inode_t &directory) {
+  const int numEntries = directory.size / sizeof(dir_ent_t);
+  return !(directory.flags & UFS_FLAG_HASHED_DIR) && numEntries % ENTRIES_IN_BLOCK == 0 &&
+    numEntries > 0 && numEntries < (int) DIR_HASHES_PER_BLOCK;
+}
+
+int LocalFileSystem::blocksToAddEntry(inode_t *directory) {
+  const int numEntries = directory->size / sizeof(dir_ent_t);
+  int blocks = numEntries % ENTRIES_IN_BLOCK == 0 ? 1 : 0;
+  if (needsHashIndex(*directory))
+    blocks++;
+  if ((directory->flags & UFS_FLAG_HASHED_DIR) && numEntries % DIR_HASHES_PER_BLOCK == 0)
+    blocks++;
+  return blocks;
 }
 
 // done
@@ -161,23 +685,18 @@ int LocalFileSystem::stat(int inodeNumber, inode_t *inode) {
     return -EINVALIDINODE;
   }
 
-  // Find block number and offset
-  int inodePosition = inodeNumber * sizeof(inode_t);
-  int blockNumber = superBlock.inode_region_addr + inodePosition / UFS_BLOCK_SIZE;
-  int inodeOffset = inodePosition % UFS_BLOCK_SIZE;
-
-  // Buffer
-  char blockBuffer[UFS_BLOCK_SIZE];
-  disk->readBlock(blockNumber, blockBuffer);
-
-  // COPY
-  memcpy(inode, blockBuffer + inodeOffset, sizeof(inode_t));
+  // COPY from the inode cache
+  inodeCache->get(inodeNumber, inode);
 
   return 0;
 }
 
 // done
 int LocalFileSystem::read(int inodeNumber, void *buffer, int size) {
+  return pread(inodeNumber, buffer, size, 0);
+}
+
+int LocalFileSystem::pread(int inodeNumber, void *buffer, int size, int offset) {
   // Read super block
   super_t superBlock;
   readSuperBlock(&superBlock);
@@ -187,12 +706,13 @@ int LocalFileSystem::read(int inodeNumber, void *buffer, int size) {
     return -EINVALIDINODE;
   }
 
-  // CHECK if valid file size
-  if (size > MAX_FILE_SIZE || size<0) {
+  // CHECK if valid size and offset
+  if (size > MAX_FILE_SIZE || size < 0 || offset < 0) {
     return -EINVALIDSIZE;
   }
 
   // Get inode information
+  InodeLocks locked(this, inodeNumber, false);
   inode_t inode;
   stat(inodeNumber, &inode);
 
@@ -200,31 +720,55 @@ int LocalFileSystem::read(int inodeNumber, void *buffer, int size) {
   if (inode.type != UFS_REGULAR_FILE && inode.type != UFS_DIRECTORY) {
     return -EINVALIDTYPE; // ERROR: invalid inode type
   }
-  
-  // Find size to read and the number of blocks
-  int readSize = min(size, inode.size);
-  int numBlocks = (readSize + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
-  int lastBlockSize = readSize % UFS_BLOCK_SIZE;
-  if (lastBlockSize == 0) {
-    lastBlockSize = UFS_BLOCK_SIZE;
-  }
 
-  // Read data from the blocks
-  for (int idx = 0; idx < numBlocks; ++idx) {
-    int currentBlock = inode.direct[idx];
-    unsigned char blockBuffer[UFS_BLOCK_SIZE];
-    disk->readBlock(currentBlock, blockBuffer);
+  return readData(&inode, buffer, size, offset);
+}
 
-    int bufferOffset = idx * UFS_BLOCK_SIZE;
-    int bytes = UFS_BLOCK_SIZE;
+// pread for callers that already hold the inode's lock
+int LocalFileSystem::readData(inode_t *inode, void *buffer, int size, int offset) {
+  // Find size to read and the blocks it covers
+  if (offset >= inode->size) {
+    return 0;
+  }
+  const int readSize = min(size, inode->size - offset);
+  if (readSize == 0) {
+    return 0;
+  }
+  if (inode->flags & UFS_FLAG_INLINE) {
+    memcpy(buffer, (const unsigned char *) inode->direct + offset, readSize);
+    return readSize;
+  }
 
-    // Checking if the current block is the last one
-    if (idx == numBlocks - 1) {
-      bytes = lastBlockSize;
+  const int firstBlock = offset / UFS_BLOCK_SIZE;
+  const int lastBlock = (offset + readSize - 1) / UFS_BLOCK_SIZE;
+  const long long end = (long long) offset + readSize;
+
+  vector<int> blocks;
+  fileBlockRange(inode, firstBlock, lastBlock - firstBlock + 1, blocks);
+
+  // Whole blocks go straight into the caller's buffer, a run of adjacent
+  // blocks per read. Partial blocks at either end are copied.
+  unsigned char *out = (unsigned char *) buffer;
+  int idx = 0;
+  while (idx < (int) blocks.size()) {
+    const long long blockStart = (long long) (firstBlock + idx) * UFS_BLOCK_SIZE;
+    if (blockStart >= offset && blockStart + UFS_BLOCK_SIZE <= end) {
+      int run = 1;
+      while (idx + run < (int) blocks.size() && run < MAX_RUN_BLOCKS &&
+             blocks[idx + run] == blocks[idx] + run &&
+             blockStart + (long long) (run + 1) * UFS_BLOCK_SIZE <= end)
+        run++;
+      disk->readBlocks(blocks[idx], run, out + (blockStart - offset));
+      idx += run;
+      continue;
     }
 
-    // Copy the bytes
-    memcpy((unsigned char*)(buffer) + bufferOffset, blockBuffer, bytes);
+    unsigned char blockBuffer[UFS_BLOCK_SIZE];
+    disk->readBlock(blocks[idx], blockBuffer);
+    const long long copyStart = max(blockStart, (long long) offset);
+    const long long copyEnd = min(blockStart + UFS_BLOCK_SIZE, end);
+    memcpy(out + (copyStart - offset), blockBuffer + (copyStart - blockStart), copyEnd - copyStart);
+    idx++;
   }
 
   return readSize;
@@ -244,60 +788,46 @@ int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
   if (type != UFS_DIRECTORY && type != UFS_REGULAR_FILE) // Validate the file type
     return -EINVALIDTYPE;
 
-  const int inodeBitmapSize = superBlock.data_bitmap_len * UFS_BLOCK_SIZE;
-  unsigned char inodeBitmap[inodeBitmapSize];
-  this->readInodeBitmap(&superBlock, inodeBitmap); // Read the inode bitmap
-
-  const int numInodes = superBlock.num_inodes;
-  inode_t inodes[numInodes];
-  readInodeRegion(&superBlock, inodes); // Read the inode region
-
-  const int dataBitmapSize = superBlock.data_bitmap_len * UFS_BLOCK_SIZE;
-  unsigned char dataBitmap[dataBitmapSize];
-  this->readDataBitmap(&superBlock, dataBitmap); // Read the data bitmap
-
-  inode_t &parentInode = inodes[parentInodeNumber];
+  InodeLocks locked(this, parentInodeNumber, true);
+  inode_t parentInode;
+  stat(parentInodeNumber, &parentInode); // Read only the parent's inode
   if (parentInode.type != UFS_DIRECTORY) // Ensure the parent inode is a directory
     return -EINVALIDINODE;
 
-  if (parentInode.size == UFS_BLOCK_SIZE * DIRECT_PTRS) // Check for available space
+  const bool hashed = parentInode.flags & UFS_FLAG_HASHED_DIR;
+  const int maxBlocks = hashed ? DIR_DATA_PTRS : DIRECT_PTRS;
+  if (parentInode.size == UFS_BLOCK_SIZE * maxBlocks) // Check for available space
     return -ENOTENOUGHSPACE;
 
-  const int numParentEntries = parentInode.size / sizeof(dir_ent_t);
-  dir_ent_t parentEntries[numParentEntries];
-  read(parentInodeNumber, parentEntries, numParentEntries * sizeof(dir_ent_t)); // Read parent directory entries
-
-  for (int i = 0; i < numParentEntries; ++i) {
-    dir_ent_t entry = parentEntries[i];
-    string entryName(entry.name);
-
-    if (entryName == name) { // Check if the name already exists
-      inode_t inode = inodes[entry.inum];
-      if (inode.type == type) {
-        return 0;
-      } else {
-        return -EINVALIDTYPE;
-      }
+  dir_ent_t existingEntry;
+  if (findEntry(&parentInode, name, &existingEntry) >= 0) { // Check if the name already exists
+    inode_t inode;
+    stat(existingEntry.inum, &inode);
+    if (inode.type == type) {
+      return existingEntry.inum;
+    } else {
+      return -EINVALIDTYPE;
     }
   }
 
-  const int availableInode = findFirstBit(inodeBitmap, inodeBitmapSize); // Find an available inode
-  if (availableInode < 0 || availableInode >= superBlock.num_inodes)
+  const int availableInode = allocateInode(); // Find an available inode and mark it used
+  if (availableInode < 0)
     return -ENOTENOUGHSPACE;
 
-  createBit(inodeBitmap, availableInode); // Mark the inode as used
-
   int newBlock = -1;
   dir_ent_t newEntries[ENTRIES_IN_BLOCK];
-  inodes[availableInode].type = type; // Set the inode type
+  inode_t newInode;
+  newInode.type = type; // Set the inode type
+  newInode.flags = 0;
+  for (int i = 0; i < DIRECT_PTRS; ++i)
+    newInode.direct[i] = -1;
 
   if (type == UFS_DIRECTORY) {
-    const int availableDataBit = findFirstBit(dataBitmap, dataBitmapSize); // Find an available data block
-    if (availableDataBit < 0 || availableDataBit >= superBlock.num_data)
+    newBlock = allocateDataBlock(superBlock); // Find an available data block
+    if (newBlock < 0) {
+      abandonChanges();
       return -ENOTENOUGHSPACE;
-
-    createBit(dataBitmap, availableDataBit); // Mark the data block as used
-    newBlock = bit2Block(superBlock, availableDataBit);
+    }
     
     newEntries[0].inum = availableInode;
     strcpy(newEntries[0].name, ".");
@@ -307,10 +837,10 @@ int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
     for (int i = 2; i < ENTRIES_IN_BLOCK; ++i)
       newEntries[i].inum = -1;
 
-    inodes[availableInode].size = 2 * sizeof(dir_ent_t); // Set the size of the new directory
-    inodes[availableInode].direct[0] = newBlock; // Assign the data block to the inode
+    newInode.size = 2 * sizeof(dir_ent_t); // Set the size of the new directory
+    newInode.direct[0] = newBlock; // Assign the data block to the inode
   } else {
-    inodes[availableInode].size = 0; // Set the size for a regular file
+    newInode.size = 0; // Set the size for a regular file
   }
 
   int entryBlock = -1;
@@ -323,12 +853,11 @@ int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
     for (int i = 1; i < ENTRIES_IN_BLOCK; ++i)
       entries[i].inum = -1;
 
-    const int entryBlockBit = findFirstBit(dataBitmap, dataBitmapSize); // Find an available entry block
-    if (entryBlockBit < -1 || entryBlockBit >= superBlock.num_data)
+    entryBlock = allocateDataBlock(superBlock); // Find an available entry block
+    if (entryBlock < 0) {
+      abandonChanges();
       return -ENOTENOUGHSPACE;
-    
-    createBit(dataBitmap, entryBlockBit); // Mark the entry block as used
-    entryBlock = bit2Block(superBlock, entryBlockBit);
+    }
 
     const int parentBlockIndex = parentInode.size / UFS_BLOCK_SIZE;
     parentInode.direct[parentBlockIndex] = entryBlock; // Assign the entry block to the parent inode
@@ -344,23 +873,251 @@ int LocalFileSystem::create(int parentInodeNumber, int type, string name) {
     strcpy(entries[entryIndex].name, name.c_str()); // Add the new entry
   }
 
+  // Record the new entry's hash, building the index if the directory just
+  // grew past its first block
+  const int newEntryIndex = parentInode.size / sizeof(dir_ent_t);
+  int hashBlock = -1;
+  unsigned short hashes[DIR_HASHES_PER_BLOCK];
+  const bool buildIndex = needsHashIndex(parentInode);
+  if (buildIndex || (hashed && newEntryIndex % DIR_HASHES_PER_BLOCK == 0)) {
+    hashBlock = allocateDataBlock(superBlock); // Find an available hash block
+    if (hashBlock < 0) {
+      abandonChanges();
+      return -ENOTENOUGHSPACE;
+    }
+    parentInode.direct[DIR_DATA_PTRS + newEntryIndex / DIR_HASHES_PER_BLOCK] = hashBlock;
+    memset(hashes, 0, sizeof(hashes));
+  } else if (hashed) {
+    hashBlock = parentInode.direct[DIR_DATA_PTRS + newEntryIndex / DIR_HASHES_PER_BLOCK];
+    disk->readBlock(hashBlock, hashes);
+  }
+
+  if (buildIndex) {
+    vector<dir_ent_t> parentEntries(newEntryIndex);
+    readData(&parentInode, parentEntries.data(), parentInode.size, 0); // Read parent directory entries
+    for (int i = 0; i < newEntryIndex; ++i)
+      hashes[i] = nameHash(parentEntries[i].name);
+    parentInode.flags |= UFS_FLAG_HASHED_DIR;
+  }
+  if (hashBlock != -1)
+    hashes[newEntryIndex % DIR_HASHES_PER_BLOCK] = nameHash(name.c_str());
+
   parentInode.size += sizeof(dir_ent_t); // Update the size of the parent inode
 
   this->disk->beginTransaction();
-  this->writeInodeBitmap(&superBlock, inodeBitmap); // Write the updated inode bitmap
-  this->writeDataBitmap(&superBlock, dataBitmap); // Write the updated data bitmap
-  this->writeInodeRegion(&superBlock, inodes); // Write the updated inode region
+  this->writeInode(&superBlock, availableInode, &newInode); // Write the new inode
+  this->writeInode(&superBlock, parentInodeNumber, &parentInode); // Write the updated parent inode
   this->disk->writeBlock(entryBlock, entries); // Write the updated entries
   
   if (newBlock != -1)
     this->disk->writeBlock(newBlock, newEntries); // Write the new entries if needed
 
-  this->disk->commit();
+  if (hashBlock != -1)
+    this->disk->writeBlock(hashBlock, hashes); // Write the hash index block
+
+  if (!this->commitTransaction())
+    return -ENOTENOUGHSPACE;
+  dentries.put(parentInodeNumber, name, availableInode); // Replace any negative entry
 
   return availableInode;
 }
 
 
+// Pick how a file made of dataBlocks is mapped, size pointerBlocks for
+// that and fill in the inode's pointers and the pointer block contents.
+// Large files are a list of extents if the blocks fall into few enough
+// runs, and use indirect blocks otherwise.
+bool LocalFileSystem::mapBlocks(super_t &super, inode_t *inode, const vector<int> &dataBlocks,
+                                vector<int> &pointerBlocks, vector<vector<unsigned int> > &pointers) {
+  const int numBlocks = dataBlocks.size();
+  const bool large = numBlocks > DIRECT_PTRS;
+  const bool extents = large && super.version >= UFS_VERSION_EXTENTS &&
+    countExtents(dataBlocks) <= MAX_EXTENTS;
+  const bool indirect = large && !extents;
+  const int requiredPointers = indirect ? pointerBlocksFor(numBlocks) : 0;
+  if (!resizeBlocks(super, pointerBlocks, requiredPointers))
+    return false;
+
+  pointers.assign(requiredPointers, vector<unsigned int>(PTRS_PER_BLOCK, -1));
+  for (int i = 0; i < DIRECT_PTRS; ++i)
+    inode->direct[i] = -1;
+
+  inode->flags &= ~(UFS_FLAG_INDIRECT | UFS_FLAG_EXTENTS | UFS_FLAG_INLINE);
+  if (extents) {
+    inode->flags |= UFS_FLAG_EXTENTS;
+    extent_t *extentList = (extent_t *) inode->direct;
+    int extent = -1;
+    for (int i = 0; i < numBlocks; ++i) {
+      if (i == 0 || dataBlocks[i] != dataBlocks[i - 1] + 1) {
+        extent++;
+        extentList[extent].start = dataBlocks[i];
+        extentList[extent].length = 0;
+      }
+      extentList[extent].length++;
+    }
+  } else if (!indirect) {
+    for (int i = 0; i < numBlocks; ++i)
+      inode->direct[i] = dataBlocks[i];
+  } else {
+    inode->flags |= UFS_FLAG_INDIRECT;
+    for (int i = 0; i < INDIRECT_DATA_PTRS; ++i)
+      inode->direct[i] = dataBlocks[i];
+
+    inode->direct[INDIRECT_PTR] = pointerBlocks[0];
+    if (requiredPointers > 1)
+      inode->direct[DOUBLE_INDIRECT_PTR] = pointerBlocks[1];
+
+    for (int i = INDIRECT_DATA_PTRS; i < numBlocks; ++i) {
+      const int idx = i - INDIRECT_DATA_PTRS;
+      if (idx < (int) PTRS_PER_BLOCK) {
+        pointers[0][idx] = dataBlocks[i];
+      } else {
+        const int second = (idx - PTRS_PER_BLOCK) / PTRS_PER_BLOCK;
+        pointers[1][second] = pointerBlocks[2 + second];
+        pointers[2 + second][(idx - PTRS_PER_BLOCK) % PTRS_PER_BLOCK] = dataBlocks[i];
+      }
+    }
+  }
+  return true;
+}
+
+// Add blocks to the end of a file's mapping without walking the ones it
+// already has: a direct file takes them while it stays small, an extent
+// list while it still fits, and an indirect file in its pointer blocks,
+// allocating new pointer blocks as needed. The pointer blocks to write go
+// to pointerWrites. Returns 1, changing nothing, if the file has to be
+// mapped again in another format.
+int LocalFileSystem::extendMapping(super_t &super, inode_t *inode, int numBlocks, const vector<int> &added,
+                                   map<int, vector<unsigned int> > &pointerWrites) {
+  const int newBlocks = numBlocks + added.size();
+  if (inode->flags & UFS_FLAG_EXTENTS) {
+    extent_t extentList[MAX_EXTENTS];
+    memcpy(extentList, inode->direct, sizeof(extentList));
+    int extent = 0;
+    for (int covered = 0; covered < numBlocks; ++extent)
+      covered += extentList[extent].length;
+    extent--;
+
+    for (size_t i = 0; i < added.size(); ++i) {
+      if (extent < 0 || added[i] != (int) (extentList[extent].start + extentList[extent].length)) {
+        if (++extent == MAX_EXTENTS)
+          return 1;
+        extentList[extent].start = added[i];
+        extentList[extent].length = 0;
+      }
+      extentList[extent].length++;
+    }
+    memcpy(inode->direct, extentList, sizeof(extentList));
+    return 0;
+  }
+
+  if (!(inode->flags & UFS_FLAG_INDIRECT)) {
+    if (newBlocks > DIRECT_PTRS)
+      return 1;
+    for (size_t i = 0; i < added.size(); ++i)
+      inode->direct[numBlocks + i] = added[i];
+    return 0;
+  }
+
+  // Pointer block contents, loaded or made empty the first time they are
+  // changed
+  vector<int> allocated;
+  for (size_t i = 0; i < added.size(); ++i) {
+    const int idx = numBlocks + i - INDIRECT_DATA_PTRS;
+    int pointerBlock = inode->direct[INDIRECT_PTR];
+    if (idx >= (int) PTRS_PER_BLOCK) {
+      const int second = (idx - PTRS_PER_BLOCK) / PTRS_PER_BLOCK;
+      const bool newRoot = idx == (int) PTRS_PER_BLOCK;
+      const bool newSecond = (idx - PTRS_PER_BLOCK) % PTRS_PER_BLOCK == 0;
+      if (!resizeBlocks(super, allocated, allocated.size() + newRoot + newSecond))
+        return -ENOTENOUGHSPACE;
+      if (newRoot) {
+        inode->direct[DOUBLE_INDIRECT_PTR] = allocated[allocated.size() - 2];
+        pointerWrites[inode->direct[DOUBLE_INDIRECT_PTR]].assign(PTRS_PER_BLOCK, -1);
+      }
+
+      vector<unsigned int> &root = pointerWrites[inode->direct[DOUBLE_INDIRECT_PTR]];
+      if (root.empty()) {
+        root.resize(PTRS_PER_BLOCK);
+        disk->readBlock(inode->direct[DOUBLE_INDIRECT_PTR], root.data());
+      }
+      if (newSecond) {
+        root[second] = allocated.back();
+        pointerWrites[root[second]].assign(PTRS_PER_BLOCK, -1);
+      }
+      pointerBlock = root[second];
+    }
+
+    vector<unsigned int> &pointers = pointerWrites[pointerBlock];
+    if (pointers.empty()) {
+      pointers.resize(PTRS_PER_BLOCK);
+      disk->readBlock(pointerBlock, pointers.data());
+    }
+    pointers[idx % PTRS_PER_BLOCK] = added[i];
+  }
+  return 0;
+}
+
+// Write bytes [offset, offset + size) of a file into `blocks`, its blocks
+// from file block `first` on. Bytes of those blocks outside the range keep
+// their old contents below oldSize and are zeroed above it. A file moving
+// out of its inode passes its old bytes as inlineData, and a write that
+// copies the range to new blocks passes the ones it replaces as previous.
+// Must be called inside a transaction.
+void LocalFileSystem::writeRange(const vector<int> &blocks, int first, int oldSize,
+                                 const void *buffer, int size, int offset, const void *inlineData,
+                                 const vector<int> *previous) {
+  const unsigned char *data = (const unsigned char *) buffer;
+  const long long end = (long long) offset + size;
+  const bool journaled = (int) blocks.size() <= JOURNALED_DATA_BLOCKS;
+
+  size_t i = 0;
+  while (i < blocks.size()) {
+    const long long blockStart = (long long) (first + i) * UFS_BLOCK_SIZE;
+
+    // Blocks wholly inside the range come straight from the caller's
+    // buffer, a run of adjacent blocks per call when they bypass the journal
+    if (blockStart >= offset && blockStart + UFS_BLOCK_SIZE <= end) {
+      size_t run = 1;
+      while (!journaled && i + run < blocks.size() && run < MAX_RUN_BLOCKS &&
+             blocks[i + run] == blocks[i] + (int) run &&
+             blockStart + (long long) (run + 1) * UFS_BLOCK_SIZE <= end)
+        run++;
+      const unsigned char *src = data + (blockStart - offset);
+      if (journaled)
+        disk->writeBlock(blocks[i], (void *) src);
+      else
+        disk->writeBlocksOrdered(blocks[i], run, src);
+      i += run;
+      continue;
+    }
+
+    // Partial blocks merge the new bytes into what the block holds
+    unsigned char blockContent[UFS_BLOCK_SIZE];
+    memset(blockContent, 0, UFS_BLOCK_SIZE);
+    if (blockStart < oldSize) {
+      if (inlineData != NULL)
+        memcpy(blockContent, inlineData, oldSize);
+      else if (previous != NULL && i < previous->size())
+        disk->readBlock((*previous)[i], blockContent);
+      else
+        disk->readBlock(blocks[i], blockContent);
+      if (oldSize < blockStart + UFS_BLOCK_SIZE)
+        memset(blockContent + (oldSize - blockStart), 0, blockStart + UFS_BLOCK_SIZE - oldSize);
+    }
+    const long long copyStart = max(blockStart, (long long) offset);
+    const long long copyEnd = min(blockStart + UFS_BLOCK_SIZE, end);
+    if (copyStart < copyEnd)
+      memcpy(blockContent + (copyStart - blockStart), data + (copyStart - offset), copyEnd - copyStart);
+
+    if (journaled)
+      disk->writeBlock(blocks[i], blockContent);
+    else
+      disk->writeBlocksOrdered(blocks[i], 1, blockContent);
+    i++;
+  }
+}
+
 // done
 int LocalFileSystem::write(int inodeNumber, const void *buffer, int size) {
   super_t superBlock;
@@ -373,80 +1130,250 @@ int LocalFileSystem::write(int inodeNumber, const void *buffer, int size) {
   if (size < 0 || size > MAX_FILE_SIZE)
     return -EINVALIDSIZE;
 
-  // Get the inode region
-  inode_t inodeRegion[superBlock.num_inodes];
-  readInodeRegion(&superBlock, inodeRegion);
+  // Older images cannot hold indirect inodes
+  if (superBlock.version < UFS_VERSION_INDIRECT && size > MAX_DIRECT_FILE_SIZE)
+    return -EINVALIDSIZE;
 
   // Get the specific inode to write
-  inode_t &inodeWrite = inodeRegion[inodeNumber];
+  InodeLocks locked(this, inodeNumber, true);
+  inode_t inodeWrite;
+  stat(inodeNumber, &inodeWrite);
   if (inodeWrite.type != UFS_REGULAR_FILE)
     return -EINVALIDTYPE;
 
-  // Read the data bitmap
-  const int dataBitmapSize = superBlock.data_bitmap_len * UFS_BLOCK_SIZE;
-  unsigned char dataBitmap[dataBitmapSize];
-  readDataBitmap(&superBlock, dataBitmap);
-
-  // Determine the number of blocks to allocate or deallocate
-  int curBlocks = divide(inodeWrite.size, UFS_BLOCK_SIZE);
-  int requiredBlocks = divide(size, UFS_BLOCK_SIZE);
-  int blocksToAllocate = max(0, requiredBlocks - curBlocks);
-  int blocksToDeallocate = max(0, curBlocks - requiredBlocks);
-
-  if (requiredBlocks > DIRECT_PTRS)
-    return -ENOTENOUGHSPACE;
-
-  // Allocate new blocks if needed
-  for (int i = 0; i < blocksToAllocate; ++i) {
-    int idx = curBlocks + i; // Append at the end
-    
-    // Get the first available data block number, and set that bit
-    const int availableBit = findFirstBit(dataBitmap, dataBitmapSize);
-    if (availableBit < 0 || availableBit >= superBlock.num_data)
+  // The blocks the file has now
+  vector<int> dataBlocks;
+  vector<int> pointerBlocks;
+  fileBlocks(&inodeWrite, dataBlocks, &pointerBlocks);
+
+  // Tiny files live in the inode and give back any blocks they had
+  if (fitsInline(superBlock, size)) {
+    resizeBlocks(superBlock, dataBlocks, 0);
+    resizeBlocks(superBlock, pointerBlocks, 0);
+    inodeWrite.flags = (inodeWrite.flags & ~(UFS_FLAG_INDIRECT | UFS_FLAG_EXTENTS)) | UFS_FLAG_INLINE;
+    memset(inodeWrite.direct, 0, sizeof(inodeWrite.direct));
+    memcpy(inodeWrite.direct, buffer, size);
+    inodeWrite.size = size;
+
+    disk->beginTransaction();
+    writeInode(&superBlock, inodeNumber, &inodeWrite);
+    if (!commitTransaction())
       return -ENOTENOUGHSPACE;
-    createBit(dataBitmap, availableBit);
-
-    // Set the available block number in inode
-    inodeWrite.direct[idx] = bit2Block(superBlock, availableBit);
+    return size;
   }
 
-  // Deallocate blocks if needed
-  for (int i = 1; i <= blocksToDeallocate; ++i) {
-    const int idx = curBlocks - i;
-    const int blockToFree = inodeWrite.direct[idx];
-    const int bitToFree = block2Bit(superBlock, blockToFree);
+  // Data too large to journal goes to new blocks, so the old contents
+  // survive until the commit frees them
+  const int requiredBlocks = divide(size, UFS_BLOCK_SIZE);
+  const bool replace = requiredBlocks > JOURNALED_DATA_BLOCKS;
+  const int keptBlocks = replace ? 0 : min(requiredBlocks, (int)dataBlocks.size());
 
-    // Clear the bit to deallocate
-    delBit(dataBitmap, bitToFree);
+  // Fail before allocating anything if the data blocks are not there
+  if (requiredBlocks - keptBlocks > freeDataBlocks())
+    return -ENOTENOUGHSPACE;
+
+  // Keep the existing blocks in order, freeing at the end or allocating
+  // new blocks next to the last ones
+  vector<vector<unsigned int> > pointers;
+  if (!resizeBlocks(superBlock, dataBlocks, keptBlocks) ||
+      !growContiguous(superBlock, dataBlocks, requiredBlocks) ||
+      !mapBlocks(superBlock, &inodeWrite, dataBlocks, pointerBlocks, pointers)) {
+    abandonChanges();
+    return -ENOTENOUGHSPACE;
   }
 
   // Update inode size
   inodeWrite.size = size;
 
-  // Get the size of the last block
-  const int lastBlockSize = (inodeWrite.size - 1) % UFS_BLOCK_SIZE + 1;
-
   // Perform the write operation
   disk->beginTransaction();
   
-  writeInodeRegion(&superBlock, inodeRegion);
-  writeDataBitmap(&superBlock, dataBitmap);
+  writeInode(&superBlock, inodeNumber, &inodeWrite);
 
-  // Write to all the blocks
-  for (int i = 0; i < requiredBlocks; ++i) {
-    const bool isLastBlock = i == requiredBlocks - 1;
-    const int bytesToCopy = isLastBlock ? lastBlockSize : UFS_BLOCK_SIZE;
-    
-    const int bufferOffset = i * UFS_BLOCK_SIZE;
-    const int blockNumber = inodeWrite.direct[i];
+  for (size_t i = 0; i < pointers.size(); ++i)
+    disk->writeBlock(pointerBlocks[i], pointers[i].data());
 
-    unsigned char blockContent[UFS_BLOCK_SIZE];
-    memcpy(blockContent, (unsigned char *)buffer + bufferOffset, bytesToCopy);
+  // Small files go through the journal with their metadata, large files
+  // write their data to the new blocks first and journal only the metadata
+  writeRange(dataBlocks, 0, 0, buffer, size, 0);
+
+  if (!commitTransaction())
+    return -ENOTENOUGHSPACE;
 
-    disk->writeBlock(blockNumber, blockContent);
+  return size;
+}
+
+int LocalFileSystem::pwrite(int inodeNumber, const void *buffer, int size, int offset) {
+  super_t superBlock;
+  readSuperBlock(&superBlock);
+  if (checkInode(superBlock, inodeNumber) == false)
+    return -EINVALIDINODE;
+
+  InodeLocks locked(this, inodeNumber, true);
+  return pwriteLocked(inodeNumber, buffer, size, offset);
+}
+
+int LocalFileSystem::append(int inodeNumber, const void *buffer, int size) {
+  super_t superBlock;
+  readSuperBlock(&superBlock);
+  if (checkInode(superBlock, inodeNumber) == false)
+    return -EINVALIDINODE;
+
+  // The end of the file must not move before the write lands there
+  InodeLocks locked(this, inodeNumber, true);
+  inode_t inode;
+  stat(inodeNumber, &inode);
+  return pwriteLocked(inodeNumber, buffer, size, inode.size);
+}
+
+// pwrite for callers that hold the inode's lock
+int LocalFileSystem::pwriteLocked(int inodeNumber, const void *buffer, int size, int offset) {
+  super_t superBlock;
+  readSuperBlock(&superBlock);
+
+  // Validate input
+  if (checkInode(superBlock, inodeNumber) == false)
+    return -EINVALIDINODE;
+
+  if (size < 0 || offset < 0 || (long long) offset + size > MAX_FILE_SIZE)
+    return -EINVALIDSIZE;
+
+  inode_t inode;
+  stat(inodeNumber, &inode);
+  if (inode.type != UFS_REGULAR_FILE)
+    return -EINVALIDTYPE;
+
+  const int oldSize = inode.size;
+  const int newSize = max(oldSize, offset + size);
+  if (superBlock.version < UFS_VERSION_INDIRECT && newSize > MAX_DIRECT_FILE_SIZE)
+    return -EINVALIDSIZE;
+
+  if (size == 0)
+    return 0;
+
+  // Files that stay tiny are changed in the inode alone
+  const bool wasInline = inode.flags & UFS_FLAG_INLINE;
+  if (fitsInline(superBlock, newSize) && (wasInline || oldSize == 0)) {
+    if (!wasInline)
+      memset(inode.direct, 0, sizeof(inode.direct));
+    inode.flags |= UFS_FLAG_INLINE;
+    memcpy((unsigned char *) inode.direct + offset, buffer, size);
+    inode.size = newSize;
+
+    disk->beginTransaction();
+    writeInode(&superBlock, inodeNumber, &inode);
+    if (!commitTransaction())
+      return -ENOTENOUGHSPACE;
+    return size;
+  }
+
+  // A file outgrowing its inode starts over with no blocks, and its old
+  // bytes go to the first one
+  unsigned char inlineData[MAX_INLINE_SIZE];
+  if (wasInline) {
+    memcpy(inlineData, inode.direct, MAX_INLINE_SIZE);
+    inode.flags &= ~UFS_FLAG_INLINE;
+    inode.size = 0;
+    for (int i = 0; i < DIRECT_PTRS; ++i)
+      inode.direct[i] = -1;
+  }
+
+  // Blocks written: from the one holding the old end of file when the
+  // write starts past it, so the gap reads back as zeros
+  const int oldBlocks = wasInline ? 0 : divide(oldSize, UFS_BLOCK_SIZE);
+  const int newBlocks = divide(newSize, UFS_BLOCK_SIZE);
+  const int firstBlock = min(offset, oldSize) / UFS_BLOCK_SIZE;
+  const int lastBlock = (offset + size - 1) / UFS_BLOCK_SIZE;
+
+  // The blocks the file already has in the range
+  vector<int> blocks;
+  fileBlockRange(&inode, firstBlock, min(oldBlocks, lastBlock + 1) - firstBlock, blocks);
+
+  // A range too large to journal is written to new blocks, which replace
+  // the old ones when the operation commits, so a failed commit leaves the
+  // old contents in place
+  const bool replace = lastBlock + 1 - firstBlock > JOURNALED_DATA_BLOCKS && !blocks.empty();
+  vector<int> replaced;
+
+  // Pointer blocks to write, by block number
+  map<int, vector<unsigned int> > pointerWrites;
+  const bool remap = newBlocks > oldBlocks || replace;
+  if (remap) {
+    if (newBlocks - oldBlocks + (replace ? (int) blocks.size() : 0) > freeDataBlocks())
+      return -ENOTENOUGHSPACE;
+
+    if (replace) {
+      replaced.swap(blocks);
+      if (!growContiguous(superBlock, blocks, replaced.size())) {
+        abandonChanges();
+        return -ENOTENOUGHSPACE;
+      }
+    }
+
+    // Allocate only the new blocks, next to the file's last one
+    vector<int> added;
+    if (replace)
+      added.push_back(blocks.back());
+    else if (oldBlocks > 0)
+      fileBlockRange(&inode, oldBlocks - 1, 1, added);
+    const int seeded = added.size();
+    if (!growContiguous(superBlock, added, seeded + newBlocks - oldBlocks)) {
+      abandonChanges();
+      return -ENOTENOUGHSPACE;
+    }
+    added.erase(added.begin(), added.begin() + seeded);
+
+    int rc = replace ? 1 : extendMapping(superBlock, &inode, oldBlocks, added, pointerWrites);
+    if (rc > 0) {
+      // The file changes shape, so map it again from the full block list
+      vector<int> dataBlocks;
+      vector<int> pointerBlocks;
+      vector<vector<unsigned int> > pointers;
+      fileBlocks(&inode, dataBlocks, &pointerBlocks);
+      const vector<int> oldPointerBlocks = (inode.flags & UFS_FLAG_INDIRECT) ? pointerBlocks : vector<int>();
+      for (size_t i = 0; i < replaced.size(); ++i) {
+        freeDataBlock(superBlock, replaced[i]);
+        dataBlocks[firstBlock + i] = blocks[i];
+      }
+      dataBlocks.insert(dataBlocks.end(), added.begin(), added.end());
+      rc = mapBlocks(superBlock, &inode, dataBlocks, pointerBlocks, pointers) ? 0 : -ENOTENOUGHSPACE;
+
+      // Pointer blocks that kept their place are written only if their
+      // contents changed
+      for (size_t i = 0; rc == 0 && i < pointers.size(); ++i) {
+        if (i < oldPointerBlocks.size() && oldPointerBlocks[i] == pointerBlocks[i]) {
+          unsigned int current[PTRS_PER_BLOCK];
+          disk->readBlock(pointerBlocks[i], current);
+          if (memcmp(current, pointers[i].data(), UFS_BLOCK_SIZE) == 0)
+            continue;
+        }
+        pointerWrites[pointerBlocks[i]].swap(pointers[i]);
+      }
+    }
+    if (rc < 0) {
+      abandonChanges();
+      return rc;
+    }
+    blocks.insert(blocks.end(), added.begin(), added.end());
   }
 
-  disk->commit();
+  disk->beginTransaction();
+
+  if (newSize != oldSize || remap) {
+    inode.size = newSize;
+    writeInode(&superBlock, inodeNumber, &inode);
+  }
+
+  if (remap) {
+    for (map<int, vector<unsigned int> >::iterator it = pointerWrites.begin(); it != pointerWrites.end(); ++it)
+      disk->writeBlock(it->first, it->second.data());
+  }
+
+  writeRange(blocks, firstBlock, oldSize, buffer, size, offset, wasInline ? inlineData : NULL,
+             replace ? &replaced : NULL);
+
+  if (!commitTransaction())
+    return -ENOTENOUGHSPACE;
 
   return size;
 }
@@ -469,92 +1396,126 @@ int LocalFileSystem::unlink(int parentInodeNumber, string name) {
     return -EUNLINKNOTALLOWED;
   }
 
-  // Read inodes
-  const int numInodes = superBlock.num_inodes;
-  inode_t inodes[numInodes];
-  readInodeRegion(&superBlock, inodes);
-
-  // Get parent inode
-  inode_t &parentInode = inodes[parentInodeNumber];
-  if (parentInode.type != UFS_DIRECTORY)
-    return -EINVALIDINODE;
-
-  // Read data bitmap
-  const int dataBitmapSize = superBlock.data_bitmap_len * UFS_BLOCK_SIZE;
-  unsigned char dataBitmap[dataBitmapSize];
-  readDataBitmap(&superBlock, dataBitmap);
-
-  // Read inode bitmap
-  const int inodeBitmapSize = superBlock.inode_bitmap_len * UFS_BLOCK_SIZE;
-  unsigned char inodeBitmap[inodeBitmapSize];
-  readInodeBitmap(&superBlock, inodeBitmap);
-
-  // Load directory entries
-  const int numEntries = parentInode.size / sizeof(dir_ent_t);
-  vector<dir_ent_t> entries(numEntries);
-  read(parentInodeNumber, entries.data(), parentInode.size);
-
-  // Find the entry to delete
-  int entryIndex = -1;
-  for (int i = 0; i < numEntries; ++i) {
-    if (string(entries[i].name) == name) {
-      entryIndex = i;
+  // Lock the parent and the entry's inode in order, which means finding
+  // the entry before holding either lock and checking it again after
+  InodeLocks locked(this);
+  inode_t parentInode;
+  dir_ent_t entry;
+  int entryIndex;
+  while (true) {
+    const int child = lookup(parentInodeNumber, name);
+    if (child == -ENOTFOUND)
+      return 0;
+    if (child < 0)
+      return child;
+
+    locked.acquire(parentInodeNumber, child, true);
+    stat(parentInodeNumber, &parentInode);
+    entryIndex = findEntry(&parentInode, name, &entry);
+    if (entryIndex < 0)
+      return 0;
+    if (entry.inum == child)
       break;
-    }
+    locked.release();
   }
-  if (entryIndex < 0)
-    return 0;
 
   // Delete inode contents
-  const int inodeToDelete = entries[entryIndex].inum;
-  inode_t inode = inodes[inodeToDelete];
+  const int inodeToDelete = entry.inum;
+  inode_t inode;
+  stat(inodeToDelete, &inode);
   if (inode.type == UFS_DIRECTORY && inode.size > (int)sizeof(dir_ent_t) * 2)
     return -EDIRNOTEMPTY;
 
-  int blocksToDelete = divide(inode.size, UFS_BLOCK_SIZE);
-  for (int i = 0; i < blocksToDelete; ++i) {
-    const int blockNum = inode.direct[i];
-    const int bitToClear = block2Bit(superBlock, blockNum);
-    delBit(dataBitmap, bitToClear);
+  vector<int> blocksToDelete;
+  vector<int> pointerBlocks;
+  fileBlocks(&inode, blocksToDelete, &pointerBlocks);
+  blocksToDelete.insert(blocksToDelete.end(), pointerBlocks.begin(), pointerBlocks.end());
+  for (size_t i = 0; i < blocksToDelete.size(); ++i)
+    freeDataBlock(superBlock, blocksToDelete[i]);
+
+  if (inode.flags & UFS_FLAG_HASHED_DIR) {
+    for (int i = DIR_DATA_PTRS; i < DIRECT_PTRS; ++i) {
+      if ((int) inode.direct[i] != -1)
+        freeDataBlock(superBlock, inode.direct[i]);
+    }
   }
 
   // Clear inode bit
-  delBit(inodeBitmap, inodeToDelete);
+  pendingChanges().freedInodes.push_back(inodeToDelete);
+
+  // Move the last entry into the hole so the entries stay contiguous
+  const int lastIndex = parentInode.size / sizeof(dir_ent_t) - 1;
+  const int holeBlock = entryIndex / ENTRIES_IN_BLOCK;
+  const int lastBlock = lastIndex / ENTRIES_IN_BLOCK;
+
+  dir_ent_t lastEntries[ENTRIES_IN_BLOCK];
+  dir_ent_t holeEntries[ENTRIES_IN_BLOCK];
+  disk->readBlock(parentInode.direct[lastBlock], lastEntries);
+  dir_ent_t *hole = lastEntries;
+  if (holeBlock != lastBlock) {
+    disk->readBlock(parentInode.direct[holeBlock], holeEntries);
+    hole = holeEntries;
+  }
+  hole[entryIndex % ENTRIES_IN_BLOCK] = lastEntries[lastIndex % ENTRIES_IN_BLOCK];
+  lastEntries[lastIndex % ENTRIES_IN_BLOCK].inum = -1;
+
+  // Same for the hash index
+  const bool hashed = parentInode.flags & UFS_FLAG_HASHED_DIR;
+  const int holeHashPtr = DIR_DATA_PTRS + entryIndex / DIR_HASHES_PER_BLOCK;
+  const int lastHashPtr = DIR_DATA_PTRS + lastIndex / DIR_HASHES_PER_BLOCK;
+  unsigned short lastHashes[DIR_HASHES_PER_BLOCK];
+  unsigned short holeHashes[DIR_HASHES_PER_BLOCK];
+  unsigned short *holeHash = lastHashes;
+  bool freeLastHashBlock = false;
+  if (hashed) {
+    disk->readBlock(parentInode.direct[lastHashPtr], lastHashes);
+    if (holeHashPtr != lastHashPtr) {
+      disk->readBlock(parentInode.direct[holeHashPtr], holeHashes);
+      holeHash = holeHashes;
+    }
+    holeHash[entryIndex % DIR_HASHES_PER_BLOCK] = lastHashes[lastIndex % DIR_HASHES_PER_BLOCK];
+
+    // Release the second hash block once it holds no entries
+    if (lastIndex % DIR_HASHES_PER_BLOCK == 0) {
+      freeLastHashBlock = true;
+      freeDataBlock(superBlock, parentInode.direct[lastHashPtr]);
+    }
+  }
 
-  // Remove directory entry
-  entries.erase(entries.begin() + entryIndex);
   parentInode.size -= sizeof(dir_ent_t);
 
   // Delete last block if not needed
+  bool freeLastBlock = false;
   if (parentInode.size % UFS_BLOCK_SIZE == 0) {
-    const int blocksNeeded = parentInode.size / UFS_BLOCK_SIZE;
-    if (blocksNeeded < DIRECT_PTRS) {
-      const int blockNum = parentInode.direct[blocksNeeded];
-      const int bitToClear = block2Bit(superBlock, blockNum);
-      delBit(dataBitmap, bitToClear);
-      parentInode.direct[blocksNeeded] = -1;
-    }
-  }
-
-  // Pad directory entries to block size
-  while (entries.size() * sizeof(dir_ent_t) % UFS_BLOCK_SIZE != 0) {
-    dir_ent_t emptyEntry;
-    emptyEntry.inum = -1;
-    entries.push_back(emptyEntry);
+    freeLastBlock = true;
+    freeDataBlock(superBlock, parentInode.direct[lastBlock]);
   }
 
   // Write changes
   disk->beginTransaction();
-  writeInodeRegion(&superBlock, inodes);
-  writeDataBitmap(&superBlock, dataBitmap);
-  writeInodeBitmap(&superBlock, inodeBitmap);
 
-  for (int i = 0; i < divide(parentInode.size, UFS_BLOCK_SIZE); ++i) {
-    const int offset = i * ENTRIES_IN_BLOCK;
-    disk->writeBlock(parentInode.direct[i], entries.data() + offset);
+  if (holeBlock != lastBlock)
+    disk->writeBlock(parentInode.direct[holeBlock], holeEntries);
+  if (!freeLastBlock)
+    disk->writeBlock(parentInode.direct[lastBlock], lastEntries);
+  if (hashed) {
+    if (holeHashPtr != lastHashPtr)
+      disk->writeBlock(parentInode.direct[holeHashPtr], holeHashes);
+    if (!freeLastHashBlock)
+      disk->writeBlock(parentInode.direct[lastHashPtr], lastHashes);
   }
 
-  disk->commit();
+  if (freeLastBlock)
+    parentInode.direct[lastBlock] = -1;
+  if (freeLastHashBlock)
+    parentInode.direct[lastHashPtr] = -1;
+  writeInode(&superBlock, parentInodeNumber, &parentInode);
+
+  if (!commitTransaction())
+    return -ENOTENOUGHSPACE;
+  dentries.put(parentInodeNumber, name, DENTRY_NEGATIVE);
+  if (inode.type == UFS_DIRECTORY)
+    dentries.forgetDirectory(inodeToDelete);
 
   return 0;
 }
@@ -566,13 +1527,10 @@ int LocalFileSystem::unlink(int parentInodeNumber, string name) {
 
 // DISK HAS SPACE
 
+// Answered from the free counters, so no bitmap is read or scanned.
 bool LocalFileSystem::diskHasSpace(super_t *super, int numInodesNeeded, int numDataBytesNeeded, int numDataBlocksNeeded) {
-  // CHECK inode space available
-  int inodeBitmapSize = super->inode_bitmap_len * UFS_BLOCK_SIZE;
-  unsigned char inodeBitmap[inodeBitmapSize];
-  this->readInodeBitmap(super, inodeBitmap);
-
-  int availableInodes = countBits(inodeBitmap, inodeBitmapSize);
+  const int availableInodes = freeInodes;
+  const int availableDataBlocks = freeData;
 
   // CHECK available inodes
   if (availableInodes < numInodesNeeded) {
@@ -580,31 +1538,21 @@ bool LocalFileSystem::diskHasSpace(super_t *super, int numInodesNeeded, int numD
   }
 
   // CHECK data space available
-  int dataBitmapSize = super->data_bitmap_len * UFS_BLOCK_SIZE;
-  unsigned char dataBitmap[dataBitmapSize];
-  this->readDataBitmap(super, dataBitmap);
-
-  int availableDataBlocks = countBits(dataBitmap, dataBitmapSize);
 
   return availableDataBlocks >= numDataBlocksNeeded + ((numDataBytesNeeded + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE);
 }
 
 // READ FUNCTIONS
 
-void LocalFileSystem::readInodeBitmap(super_t *super, unsigned char *inodeBitmap) {    
-  for (int i = 0; i < super->inode_bitmap_len; ++i) {
-    int block = super->inode_bitmap_addr + i;
-    auto buff = inodeBitmap + i * UFS_BLOCK_SIZE;
-    disk->readBlock(block, buff);
-  }
+// The bitmaps are resident, so these copy to and from memory. The write
+// helpers mark every block dirty and write the whole bitmap.
+
+void LocalFileSystem::readInodeBitmap(super_t *super, unsigned char *buffer) {
+  inodeBitmap.copyTo(buffer);
 }
 
-void LocalFileSystem::readDataBitmap(super_t *super, unsigned char *dataBitmap) {
-  for (int i = 0; i < super->data_bitmap_len; ++i) {
-    int block = super->data_bitmap_addr + i;
-    auto buff = dataBitmap + i * UFS_BLOCK_SIZE;
-    disk->readBlock(block, buff);
-  }
+void LocalFileSystem::readDataBitmap(super_t *super, unsigned char *buffer) {
+  dataBitmap.copyTo(buffer);
 }
 
 void LocalFileSystem::readInodeRegion(super_t *super, inode_t *inodes) {
@@ -615,20 +1563,106 @@ void LocalFileSystem::readInodeRegion(super_t *super, inode_t *inodes) {
   }
 }
 
-void LocalFileSystem::writeInodeBitmap(super_t *super, unsigned char *inodeBitmap) {  
-  for (int i = 0; i < super->inode_bitmap_len; ++i) {
-    int block = super->inode_bitmap_addr + i;
-    auto buff = inodeBitmap + i * UFS_BLOCK_SIZE;
-    disk->writeBlock(block, buff);
-  }
+void LocalFileSystem::writeInodeBitmap(super_t *super, unsigned char *buffer) {
+  returnReservations();
+  inodeBitmap.copyFrom(buffer);
+  inodeBitmap.flush(disk);
+  writeFreeCounts();
 }
 
-void LocalFileSystem::writeDataBitmap(super_t *super, unsigned char *dataBitmap) {
-  for (int i = 0; i < super->data_bitmap_len; ++i) {
-    int block = super->data_bitmap_addr + i;
-    auto buff = dataBitmap + i * UFS_BLOCK_SIZE;
-    disk->writeBlock(block, buff);
+void LocalFileSystem::writeDataBitmap(super_t *super, unsigned char *buffer) {
+  returnReservations();
+  dataBitmap.copyFrom(buffer);
+  dataBitmap.flush(disk);
+  writeFreeCounts();
+}
+
+// Update one inode. Other threads see the change, and it reaches the
+// inode-table block that holds it, when the operation commits.
+void LocalFileSystem::writeInode(super_t *super, int inodeNumber, inode_t *inode) {
+  pendingChanges().inodes[inodeNumber] = *inode;
+}
+
+void LocalFileSystem::flushInodes() {
+  inodeCache->flush();
+  inodeCache->published();
+}
+
+// Number of blocks commitTransaction adds to the disk transaction: the
+// bitmap and inode-table blocks holding what the operation changed, and
+// the superblock.
+int LocalFileSystem::commitBlocks() {
+  PendingChanges &pending = pendingChanges();
+  set<int> inodeBitmapBlocks;
+  set<int> dataBitmapBlocks;
+  set<int> inodeBlocks;
+  for (size_t i = 0; i < pending.allocatedInodes.size(); ++i)
+    inodeBitmapBlocks.insert(pending.allocatedInodes[i] / (UFS_BLOCK_SIZE * 8));
+  for (size_t i = 0; i < pending.freedInodes.size(); ++i)
+    inodeBitmapBlocks.insert(pending.freedInodes[i] / (UFS_BLOCK_SIZE * 8));
+  for (size_t i = 0; i < pending.allocatedData.size(); ++i)
+    dataBitmapBlocks.insert(pending.allocatedData[i] / (UFS_BLOCK_SIZE * 8));
+  for (size_t i = 0; i < pending.freedData.size(); ++i)
+    dataBitmapBlocks.insert(pending.freedData[i] / (UFS_BLOCK_SIZE * 8));
+  map<int, inode_t>::iterator iter;
+  for (iter = pending.inodes.begin(); iter != pending.inodes.end(); iter++)
+    inodeBlocks.insert(iter->first / INODES_IN_BLOCK);
+  return inodeBitmapBlocks.size() + dataBitmapBlocks.size() + inodeBlocks.size() + 1;
+}
+
+// Make the operation's reserved bits real allocations, release what it
+// freed, write the bitmaps, counters and inodes it changed into its
+// transaction, and commit it. Everything up to
+// the point where the transaction has its place in the commit order
+// happens under allocationLock, so the shared bitmap, superblock and
+// inode-table blocks reach the journal in the same order they were
+// changed in memory. Ordered data is flushed, and room is made in the
+// journal for the whole transaction, before taking the lock, and the
+// commit is waited for after it, so the lock is never held across disk
+// I/O other than the journal append itself.
+//
+// A transaction too large for the journal cannot commit atomically, so it
+// is rolled back and this returns false; the caller fails with
+// -ENOTENOUGHSPACE.
+bool LocalFileSystem::commitTransaction() {
+  const int blocks = disk->transactionBlocks() + commitBlocks();
+  if (blocks > disk->maxTransactionBlocks()) {
+    disk->rollback();
+    abandonChanges();
+    return false;
   }
+
+  PendingChanges &pending = pendingChanges();
+  disk->syncOrderedData();
+  disk->reserveJournalSpace(blocks);
+  pthread_mutex_lock(&allocationLock);
+  for (size_t i = 0; i < pending.allocatedInodes.size(); ++i)
+    inodeBitmap.claim(pending.allocatedInodes[i]);
+  for (size_t i = 0; i < pending.allocatedData.size(); ++i)
+    dataBitmap.claim(pending.allocatedData[i]);
+  for (size_t i = 0; i < pending.freedInodes.size(); ++i)
+    inodeBitmap.clear(pending.freedInodes[i]);
+  for (size_t i = 0; i < pending.freedData.size(); ++i)
+    dataBitmap.clear(pending.freedData[i]);
+  if (!pending.allocatedInodes.empty() || !pending.allocatedData.empty() ||
+      !pending.freedInodes.empty() || !pending.freedData.empty()) {
+    inodeBitmap.flush(disk);
+    dataBitmap.flush(disk);
+    writeFreeCounts();
+  }
+
+  map<int, inode_t>::iterator iter;
+  for (iter = pending.inodes.begin(); iter != pending.inodes.end(); iter++)
+    inodeCache->put(iter->first, &iter->second);
+  inodeCache->flush();
+  const bool published = disk->publish();
+  inodeCache->published();
+  pthread_mutex_unlock(&allocationLock);
+  pending = PendingChanges();
+
+  if (published)
+    disk->waitForPublished();
+  return true;
 }
 
 void LocalFileSystem::writeInodeRegion(super_t *super, inode_t *inodes) {
@@ -637,4 +1671,5 @@ void LocalFileSystem::writeInodeRegion(super_t *super, inode_t *inodes) {
     auto buff = inodes + i * INODES_IN_BLOCK;
     disk->writeBlock(block, buff);
   }
+  inodeCache->refresh();
 }
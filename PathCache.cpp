@@ -0,0 +1,89 @@
+#include "PathCache.h"
+
+using namespace std;
+
+PathCache::PathCache(int capacity, int numInodes) : generations(numInodes, 0) {
+  pthread_mutex_init(&lock, NULL);
+  this->capacity = capacity;
+  this->hitCount = 0;
+  this->missCount = 0;
+}
+
+PathCache::~PathCache() {
+  pthread_mutex_destroy(&lock);
+}
+
+bool PathCache::validLocked(const Entry &entry) {
+  for (size_t idx = 0; idx < entry.directories.size(); ++idx) {
+    if (generations[entry.directories[idx]] != entry.generations[idx]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool PathCache::get(const string &path, int *inodeNumber) {
+  pthread_mutex_lock(&lock);
+  unordered_map<string, EntryList::iterator>::iterator found = index.find(path);
+  if (found == index.end()) {
+    pthread_mutex_unlock(&lock);
+    missCount++;
+    return false;
+  }
+
+  if (!validLocked(*found->second)) {
+    entries.erase(found->second);
+    index.erase(found);
+    pthread_mutex_unlock(&lock);
+    missCount++;
+    return false;
+  }
+
+  entries.splice(entries.begin(), entries, found->second);
+  *inodeNumber = found->second->inodeNumber;
+  pthread_mutex_unlock(&lock);
+  hitCount++;
+  return true;
+}
+
+void PathCache::put(const string &path, int inodeNumber, const vector<int> &directories) {
+  if (capacity <= 0) {
+    return;
+  }
+
+  Entry entry;
+  entry.path = path;
+  entry.inodeNumber = inodeNumber;
+  entry.directories = directories;
+
+  pthread_mutex_lock(&lock);
+  for (size_t idx = 0; idx < directories.size(); ++idx) {
+    entry.generations.push_back(generations[directories[idx]]);
+  }
+
+  unordered_map<string, EntryList::iterator>::iterator found = index.find(path);
+  if (found != index.end()) {
+    entries.erase(found->second);
+    index.erase(found);
+  } else if ((int) index.size() >= capacity) {
+    index.erase(entries.back().path);
+    entries.pop_back();
+  }
+  entries.push_front(entry);
+  index[path] = entries.begin();
+  pthread_mutex_unlock(&lock);
+}
+
+void PathCache::invalidateDirectory(int inodeNumber) {
+  pthread_mutex_lock(&lock);
+  generations[inodeNumber]++;
+  pthread_mutex_unlock(&lock);
+}
+
+unsigned long PathCache::hits() {
+  return hitCount;
+}
+
+unsigned long PathCache::misses() {
+  return missCount;
+}
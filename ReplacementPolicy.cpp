@@ -0,0 +1,226 @@
+#include <algorithm>
+
+#include "ReplacementPolicy.h"
+
+using namespace std;
+
+ReplacementPolicy *ReplacementPolicy::create(ReplacementPolicyType type, int capacity) {
+  if (type == REPLACEMENT_2Q) {
+    return new TwoQueuePolicy(capacity);
+  } else if (type == REPLACEMENT_ARC) {
+    return new ArcPolicy(capacity);
+  }
+  return new LruPolicy(capacity);
+}
+
+bool ReplacementPolicy::parse(string name, ReplacementPolicyType *type) {
+  transform(name.begin(), name.end(), name.begin(), ::tolower);
+  if (name == "lru") {
+    *type = REPLACEMENT_LRU;
+  } else if (name == "2q") {
+    *type = REPLACEMENT_2Q;
+  } else if (name == "arc") {
+    *type = REPLACEMENT_ARC;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// LRU
+
+LruPolicy::LruPolicy(int capacity) {
+  this->capacity = capacity;
+}
+
+void LruPolicy::hit(int blockNumber) {
+  unordered_map<int, list<int>::iterator>::iterator found = index.find(blockNumber);
+  if (found != index.end()) {
+    lru.splice(lru.begin(), lru, found->second);
+  }
+}
+
+int LruPolicy::admit(int blockNumber) {
+  int victim = -1;
+  if ((int) lru.size() >= capacity) {
+    victim = lru.back();
+    index.erase(victim);
+    lru.pop_back();
+  }
+  lru.push_front(blockNumber);
+  index[blockNumber] = lru.begin();
+  return victim;
+}
+
+// 2Q, with the A1in and A1out sizes suggested in the paper
+
+TwoQueuePolicy::TwoQueuePolicy(int capacity) {
+  this->capacity = capacity;
+  this->maxIn = max(1, capacity / 4);
+  this->maxOut = max(1, capacity / 2);
+}
+
+void TwoQueuePolicy::hit(int blockNumber) {
+  // Re-references while still in A1in are treated as correlated and
+  // do not promote the block.
+  unordered_map<int, struct Slot>::iterator found = slots.find(blockNumber);
+  if (found != slots.end() && found->second.queue == AM) {
+    am.splice(am.begin(), am, found->second.position);
+  }
+}
+
+int TwoQueuePolicy::admit(int blockNumber) {
+  int victim = -1;
+  if ((int) (a1in.size() + am.size()) >= capacity) {
+    victim = reclaim();
+  }
+
+  unordered_map<int, struct Slot>::iterator found = slots.find(blockNumber);
+  if (found != slots.end() && found->second.queue == A1OUT) {
+    a1out.erase(found->second.position);
+    am.push_front(blockNumber);
+    found->second.queue = AM;
+    found->second.position = am.begin();
+  } else {
+    a1in.push_front(blockNumber);
+    struct Slot slot;
+    slot.queue = A1IN;
+    slot.position = a1in.begin();
+    slots[blockNumber] = slot;
+  }
+  return victim;
+}
+
+int TwoQueuePolicy::reclaim() {
+  if ((int) a1in.size() > maxIn || am.empty()) {
+    int victim = a1in.back();
+    a1in.pop_back();
+    remember(victim);
+    return victim;
+  }
+
+  int victim = am.back();
+  am.pop_back();
+  slots.erase(victim);
+  return victim;
+}
+
+void TwoQueuePolicy::remember(int blockNumber) {
+  a1out.push_front(blockNumber);
+  slots[blockNumber].queue = A1OUT;
+  slots[blockNumber].position = a1out.begin();
+  if ((int) a1out.size() > maxOut) {
+    slots.erase(a1out.back());
+    a1out.pop_back();
+  }
+}
+
+// ARC
+
+ArcPolicy::ArcPolicy(int capacity) {
+  this->capacity = capacity;
+  this->target = 0;
+}
+
+list<int> &ArcPolicy::listFor(Queue queue) {
+  switch (queue) {
+  case T1:
+    return t1;
+  case T2:
+    return t2;
+  case B1:
+    return b1;
+  default:
+    return b2;
+  }
+}
+
+void ArcPolicy::moveTo(int blockNumber, Queue queue) {
+  unordered_map<int, struct Slot>::iterator found = slots.find(blockNumber);
+  list<int> &to = listFor(queue);
+  if (found == slots.end()) {
+    to.push_front(blockNumber);
+    struct Slot slot;
+    slot.queue = queue;
+    slot.position = to.begin();
+    slots[blockNumber] = slot;
+    return;
+  }
+  list<int> &from = listFor(found->second.queue);
+  to.splice(to.begin(), from, found->second.position);
+  found->second.queue = queue;
+  found->second.position = to.begin();
+}
+
+void ArcPolicy::drop(list<int> &from) {
+  slots.erase(from.back());
+  from.pop_back();
+}
+
+// Evict the LRU block of T1 or T2 into its ghost list.
+int ArcPolicy::replace(bool inB2) {
+  int victim;
+  if (!t1.empty() && ((int) t1.size() > target || (inB2 && (int) t1.size() == target) || t2.empty())) {
+    victim = t1.back();
+    moveTo(victim, B1);
+  } else {
+    victim = t2.back();
+    moveTo(victim, B2);
+  }
+  return victim;
+}
+
+void ArcPolicy::hit(int blockNumber) {
+  unordered_map<int, struct Slot>::iterator found = slots.find(blockNumber);
+  if (found != slots.end() && (found->second.queue == T1 || found->second.queue == T2)) {
+    moveTo(blockNumber, T2);
+  }
+}
+
+int ArcPolicy::admit(int blockNumber) {
+  int victim = -1;
+  bool full = (int) (t1.size() + t2.size()) >= capacity;
+  unordered_map<int, struct Slot>::iterator found = slots.find(blockNumber);
+
+  if (found != slots.end() && found->second.queue == B1) {
+    target = min(capacity, target + max((int) (b2.size() / b1.size()), 1));
+    if (full) {
+      victim = replace(false);
+    }
+    moveTo(blockNumber, T2);
+    return victim;
+  }
+
+  if (found != slots.end() && found->second.queue == B2) {
+    target = max(0, target - max((int) (b1.size() / b2.size()), 1));
+    if (full) {
+      victim = replace(true);
+    }
+    moveTo(blockNumber, T2);
+    return victim;
+  }
+
+  int l1 = t1.size() + b1.size();
+  int total = l1 + t2.size() + b2.size();
+  if (l1 >= capacity) {
+    if ((int) t1.size() < capacity) {
+      drop(b1);
+      if (full) {
+        victim = replace(false);
+      }
+    } else {
+      victim = t1.back();
+      drop(t1);
+    }
+  } else if (total >= capacity) {
+    if (total >= 2 * capacity) {
+      drop(b2);
+    }
+    if (full) {
+      victim = replace(false);
+    }
+  }
+
+  moveTo(blockNumber, T1);
+  return victim;
+}
@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <climits>
+#include <vector>
+
+#include "RequestScheduler.h"
+#include "dthread.h"
+
+using namespace std;
+
+RequestScheduler::RequestScheduler(int capacity, SchedulingPolicy policy, CostFunction costOf) {
+  this->capacity = capacity;
+  this->count = 0;
+  this->policy = policy;
+  this->costOf = costOf;
+  this->arrivals = 0;
+  this->served = 0;
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&notEmpty, NULL);
+  pthread_cond_init(&notFull, NULL);
+}
+
+RequestScheduler::~RequestScheduler() {
+  pthread_mutex_destroy(&lock);
+  pthread_cond_destroy(&notEmpty);
+  pthread_cond_destroy(&notFull);
+}
+
+bool RequestScheduler::parse(string name, SchedulingPolicy *policy) {
+  transform(name.begin(), name.end(), name.begin(), ::toupper);
+  if (name == "FIFO") {
+    *policy = SCHEDULE_FIFO;
+  } else if (name == "SFF") {
+    *policy = SCHEDULE_SFF;
+  } else if (name == "DRR") {
+    *policy = SCHEDULE_DRR;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Cost a request from whatever has arrived, or -1 if its header is not
+// complete. A connection the client already closed costs nothing, so it
+// gets cleared out quickly.
+long RequestScheduler::estimate(MySocket *client) {
+  char head[SCHEDULER_PEEK_BYTES];
+  const int len = client->peek(head, sizeof(head));
+  if (len == 0) {
+    return 0;
+  } else if (len > 0) {
+    return costOf(string(head, len));
+  }
+  return -1;
+}
+
+void RequestScheduler::push(MySocket *client) {
+  // Peeking and parsing the header happen before taking the lock, so
+  // workers popping requests never wait on them
+  Request request;
+  request.client = client;
+  request.cost = policy == SCHEDULE_FIFO ? -1 : estimate(client);
+  const string address = policy == SCHEDULE_DRR ? client->peerAddress() : "";
+
+  dthread_mutex_lock(&lock);
+  while (count == capacity) {
+    dthread_cond_wait(&notFull, &lock);
+  }
+
+  request.served = served;
+  if (policy == SCHEDULE_SFF) {
+    const SizeKey key(request.cost < 0 ? LONG_MAX : request.cost, arrivals++);
+    bySize[key] = request;
+    byArrival[key.second] = key;
+  } else if (policy == SCHEDULE_DRR) {
+    Flow &flow = flows[address];
+    if (flow.requests.empty()) {
+      flow.deficit = 0;
+      flow.turnStarted = false;
+      activeFlows.push_back(address);
+    }
+    flow.requests.push_back(request);
+  } else {
+    requests.push_back(request);
+  }
+  count++;
+
+  dthread_cond_signal(&notEmpty);
+  dthread_mutex_unlock(&lock);
+}
+
+MySocket *RequestScheduler::pop() {
+  dthread_mutex_lock(&lock);
+  bool recosted = false;
+  while (true) {
+    // Under SFF a request can be counted but out of the queue being costed
+    while (count == 0 || (policy == SCHEDULE_SFF && bySize.empty())) {
+      dthread_cond_wait(&notEmpty, &lock);
+    }
+    if (policy != SCHEDULE_SFF || recosted) {
+      break;
+    }
+    recostIncomplete();
+    recosted = true;
+  }
+
+  MySocket *client;
+  if (policy == SCHEDULE_SFF) {
+    client = popSmallest();
+  } else if (policy == SCHEDULE_DRR) {
+    client = popFair();
+  } else {
+    client = requests.front().client;
+    requests.pop_front();
+  }
+  count--;
+
+  dthread_cond_signal(&notFull);
+  dthread_mutex_unlock(&lock);
+  return client;
+}
+
+// Cost again the requests whose header was incomplete when they were
+// pushed. They leave the queue while this thread peeks at them without the
+// lock, so no other worker can take and close them meanwhile, and go back
+// in under their original arrival numbers. Called with the lock held.
+void RequestScheduler::recostIncomplete() {
+  map<SizeKey, Request>::iterator first = bySize.lower_bound(SizeKey(LONG_MAX, 0));
+  if (first == bySize.end()) {
+    return;
+  }
+
+  vector<pair<unsigned long, Request> > incomplete;
+  for (map<SizeKey, Request>::iterator iter = first; iter != bySize.end(); iter++) {
+    incomplete.push_back(make_pair(iter->first.second, iter->second));
+    byArrival.erase(iter->first.second);
+  }
+  bySize.erase(first, bySize.end());
+
+  dthread_mutex_unlock(&lock);
+  for (size_t idx = 0; idx < incomplete.size(); idx++) {
+    incomplete[idx].second.cost = estimate(incomplete[idx].second.client);
+  }
+  dthread_mutex_lock(&lock);
+
+  for (size_t idx = 0; idx < incomplete.size(); idx++) {
+    const Request &request = incomplete[idx].second;
+    const SizeKey key(request.cost < 0 ? LONG_MAX : request.cost, incomplete[idx].first);
+    bySize[key] = request;
+    byArrival[key.second] = key;
+  }
+  dthread_cond_broadcast(&notEmpty);
+}
+
+MySocket *RequestScheduler::popSmallest() {
+  // Only the oldest request can have waited through SFF_MAX_BYPASS others
+  map<SizeKey, Request>::iterator chosen = bySize.begin();
+  map<SizeKey, Request>::iterator oldest = bySize.find(byArrival.begin()->second);
+  if (served - oldest->second.served >= SFF_MAX_BYPASS) {
+    chosen = oldest;
+  }
+
+  MySocket *client = chosen->second.client;
+  byArrival.erase(chosen->first.second);
+  bySize.erase(chosen);
+  served++;
+  return client;
+}
+
+MySocket *RequestScheduler::popFair() {
+  while (true) {
+    Flow &flow = flows[activeFlows.front()];
+    if (!flow.turnStarted) {
+      flow.deficit += DRR_QUANTUM;
+      flow.turnStarted = true;
+    }
+
+    Request &request = flow.requests.front();
+    if (request.cost < 0) {
+      request.cost = estimate(request.client);
+    }
+    const long cost = max(request.cost, 0L) + DRR_REQUEST_COST;
+    if (flow.deficit >= cost) {
+      // The client keeps its turn while its deficit covers the next request
+      MySocket *client = request.client;
+      flow.deficit -= cost;
+      flow.requests.pop_front();
+      if (flow.requests.empty()) {
+        flows.erase(activeFlows.front());
+        activeFlows.pop_front();
+      }
+      return client;
+    }
+
+    flow.turnStarted = false;
+    activeFlows.push_back(activeFlows.front());
+    activeFlows.pop_front();
+  }
+}
@@ -0,0 +1,76 @@
+/*
+ * Appends per second as the file being appended to grows.
+ *
+ * Each run starts from a file of the given size and appends 100-byte
+ * records to it with LocalFileSystem::append, which touches only the last
+ * block, any new block and the inode. For comparison it also times the
+ * GET plus PUT that appending took before: reading the whole file and
+ * writing it back one record longer.
+ */
+
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Bench.h"
+#include "LocalFileSystem.h"
+#include "ufs.h"
+
+using namespace std;
+
+#define KB (1024)
+#define RECORD_SIZE (100)
+#define APPENDS (1000)
+#define REWRITES (20)
+
+void run(int size) {
+  const string image = benchImage("append");
+  const int blocks = size / UFS_BLOCK_SIZE;
+  makeImage(image, 64, 2 * blocks + 2 * blocks / 512 + 256);
+  Disk disk(image, UFS_BLOCK_SIZE);
+  LocalFileSystem fileSystem(&disk);
+  vector<char> content(size + (APPENDS + REWRITES) * RECORD_SIZE, 'x');
+  const char *record = content.data();
+
+  int logFile = fileSystem.create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_REGULAR_FILE, "log");
+  fileSystem.write(logFile, content.data(), size);
+  unsigned long syscalls = disk.syscallCount();
+  double start = now();
+  for (int i = 0; i < APPENDS; ++i) {
+    if (fileSystem.append(logFile, record, RECORD_SIZE) != RECORD_SIZE) {
+      cerr << "append failed" << endl;
+      exit(1);
+    }
+  }
+  const double appendSeconds = now() - start;
+  const double appendSyscalls = (double) (disk.syscallCount() - syscalls) / APPENDS;
+
+  int rewrittenFile = fileSystem.create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_REGULAR_FILE, "rewritten");
+  fileSystem.write(rewrittenFile, content.data(), size);
+  int length = size;
+  start = now();
+  for (int i = 0; i < REWRITES; ++i) {
+    fileSystem.read(rewrittenFile, content.data(), length);
+    length += RECORD_SIZE;
+    if (fileSystem.write(rewrittenFile, content.data(), length) != length) {
+      cerr << "rewrite failed" << endl;
+      exit(1);
+    }
+  }
+  const double rewriteSeconds = now() - start;
+
+  cout << size / KB << "\t" << (int) (APPENDS / appendSeconds) << "\t" << appendSyscalls << "\t"
+       << (int) (REWRITES / rewriteSeconds) << endl;
+}
+
+int main() {
+  cout << "KB\tappends/s\tsyscalls/append\tGET+PUT/s" << endl;
+  const int sizes[] = {1 * KB, 64 * KB, 1024 * KB, 16384 * KB, 262144 * KB};
+  for (int size : sizes) {
+    run(size);
+  }
+  unlink(benchImage("append").c_str());
+  return 0;
+}
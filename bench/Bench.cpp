@@ -0,0 +1,155 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include "Bench.h"
+
+using namespace std;
+
+string benchImage(const string &name) {
+  const char *dir = getenv("BENCH_DIR");
+  return string(dir != NULL ? dir : "/tmp") + "/ds3-bench-" + name + ".img";
+}
+
+void makeImage(const string &path, int numInodes, int numData, int journalBlocks) {
+  stringstream command;
+  command << "./mkfs -f " << path << " -i " << numInodes << " -d " << numData;
+  if (journalBlocks >= 0) {
+    command << " -j " << journalBlocks;
+  }
+  command << " > /dev/null";
+  if (system(command.str().c_str()) != 0) {
+    cerr << "could not run " << command.str() << " (run benchmarks from the repository root)" << endl;
+    exit(1);
+  }
+}
+
+double now() {
+  return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double percentile(vector<double> &samples, double p) {
+  if (samples.empty()) {
+    return 0;
+  }
+  sort(samples.begin(), samples.end());
+  size_t index = (size_t) (p / 100 * (samples.size() - 1) + 0.5);
+  return samples[min(index, samples.size() - 1)];
+}
+
+void runThreads(int threads, function<void(int)> body) {
+  vector<thread> running;
+  for (int i = 0; i < threads; ++i) {
+    running.push_back(thread(body, i));
+  }
+  for (size_t i = 0; i < running.size(); ++i) {
+    running[i].join();
+  }
+}
+
+int benchPort() {
+  const char *port = getenv("BENCH_PORT");
+  return port != NULL ? atoi(port) : 18090;
+}
+
+int startServer(const vector<string> &args) {
+  const int pid = fork();
+  if (pid == 0) {
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    dup2(devNull, STDERR_FILENO);
+    vector<char *> argv;
+    argv.push_back((char *) "./server_web");
+    const string port = to_string(benchPort());
+    argv.push_back((char *) "-p");
+    argv.push_back((char *) port.c_str());
+    for (size_t i = 0; i < args.size(); ++i) {
+      argv.push_back((char *) args[i].c_str());
+    }
+    argv.push_back(NULL);
+    execv(argv[0], argv.data());
+    _exit(127);
+  }
+
+  // a GET of the root only succeeds once the server is accepting
+  for (int attempt = 0; attempt < 500; ++attempt) {
+    if (httpRequest("127.0.0.1", "GET", "/ds3/", "") > 0) {
+      return pid;
+    }
+    if (waitpid(pid, NULL, WNOHANG) == pid) {
+      break;
+    }
+    usleep(10000);
+  }
+  cerr << "server_web did not start on port " << benchPort() << " (run benchmarks from the repository root)" << endl;
+  exit(1);
+}
+
+void stopServer(int pid) {
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+}
+
+int httpRequest(const string &source, const string &method, const string &path,
+                const string &content, string *body) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  struct sockaddr_in local = {};
+  local.sin_family = AF_INET;
+  inet_pton(AF_INET, source.c_str(), &local.sin_addr);
+  struct sockaddr_in server = {};
+  server.sin_family = AF_INET;
+  server.sin_port = htons(benchPort());
+  inet_pton(AF_INET, "127.0.0.1", &server.sin_addr);
+  if (bind(fd, (struct sockaddr *) &local, sizeof(local)) != 0 ||
+      connect(fd, (struct sockaddr *) &server, sizeof(server)) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  stringstream request;
+  request << method << " " << path << " HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n"
+          << "Content-Length: " << content.size() << "\r\n\r\n" << content;
+  const string data = request.str();
+  for (size_t sent = 0; sent < data.size();) {
+    ssize_t written = write(fd, data.data() + sent, data.size() - sent);
+    if (written <= 0) {
+      close(fd);
+      return -1;
+    }
+    sent += written;
+  }
+
+  // the server closes the connection after each reply
+  string reply;
+  char buffer[65536];
+  ssize_t got;
+  while ((got = read(fd, buffer, sizeof(buffer))) > 0) {
+    reply.append(buffer, got);
+  }
+  close(fd);
+
+  int status = -1;
+  if (sscanf(reply.c_str(), "HTTP/%*s %d", &status) != 1) {
+    return -1;
+  }
+  if (body != NULL) {
+    size_t headerEnd = reply.find("\r\n\r\n");
+    *body = headerEnd == string::npos ? "" : reply.substr(headerEnd + 4);
+  }
+  return status;
+}
@@ -0,0 +1,47 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * Helpers shared by the benchmarks in bench/.
+ *
+ * Each benchmark formats its own scratch images with the mkfs built next
+ * to it, so run them from the repository root after `make bench`. Images
+ * go to /tmp unless BENCH_DIR names another directory; put it on the
+ * device you want to measure, since fsync cost dominates most results.
+ */
+
+// Path of a scratch image called name.
+std::string benchImage(const std::string &name);
+
+// Format path with mkfs. journalBlocks < 0 keeps mkfs's default journal.
+void makeImage(const std::string &path, int numInodes, int numData, int journalBlocks = -1);
+
+// Seconds on a monotonic clock.
+double now();
+
+// The p-th percentile (0 to 100) of samples, which are sorted in place.
+double percentile(std::vector<double> &samples, double p);
+
+// Run body(0) to body(threads - 1) on their own threads and wait for all.
+void runThreads(int threads, std::function<void(int)> body);
+
+// Port the HTTP benchmarks start server_web on: BENCH_PORT, or 18090.
+int benchPort();
+
+// Start ./server_web with args on benchPort() and wait until it accepts
+// connections. Its output is discarded.
+int startServer(const std::vector<std::string> &args);
+void stopServer(int pid);
+
+// Send one request to 127.0.0.1:benchPort() from the local address
+// source (any address in 127.0.0.0/8, so the server sees different
+// clients) and read the reply. Returns the status code, or -1 if the
+// connection failed; the reply's body is stored in body if not NULL.
+int httpRequest(const std::string &source, const std::string &method, const std::string &path,
+                const std::string &content, std::string *body = NULL);
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ * Allocation and counting on a 1M-bit bitmap at several fill levels.
+ *
+ * "alloc" finds and reserves up to 1,000 free bits one at a time with
+ * findFreeRun, as LocalFileSystem refills its allocation pools, and
+ * "count" loads the whole bitmap, rebuilding the summary tree and
+ * recounting the free bits. Both are
+ * compared with the bit-at-a-time loops they replaced. The last level
+ * leaves only the final bit clear, which is the worst case for a scan.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Bench.h"
+#include "Bitmap.h"
+#include "ufs.h"
+
+using namespace std;
+
+#define NUM_BITS (1 << 20)
+#define BITMAP_BLOCKS (NUM_BITS / (UFS_BLOCK_SIZE * 8))
+#define ALLOCATIONS (1000)
+
+static bool bitSet(const vector<unsigned char> &bits, int bit) {
+  return (bits[bit / 8] >> (bit % 8)) & 1;
+}
+
+static int naiveFindFree(const vector<unsigned char> &bits) {
+  for (int bit = 0; bit < NUM_BITS; ++bit) {
+    if (!bitSet(bits, bit)) {
+      return bit;
+    }
+  }
+  return -1;
+}
+
+static int naiveCountFree(const vector<unsigned char> &bits) {
+  int free = 0;
+  for (int bit = 0; bit < NUM_BITS; ++bit) {
+    free += !bitSet(bits, bit);
+  }
+  return free;
+}
+
+void run(Bitmap &bitmap, double fill, const char *label) {
+  mt19937 random(7);
+  vector<unsigned char> bits(NUM_BITS / 8, 0);
+  for (int bit = 0; bit < NUM_BITS; ++bit) {
+    if (fill >= 1 ? bit != NUM_BITS - 1 : random() < fill * random.max()) {
+      bits[bit / 8] |= 1 << (bit % 8);
+    }
+  }
+
+  double start = now();
+  bitmap.copyFrom(bits.data());
+  const double countSeconds = now() - start;
+  start = now();
+  const int naiveFree = naiveCountFree(bits);
+  const double naiveCountSeconds = now() - start;
+  if (naiveFree != bitmap.countFree()) {
+    cerr << "free counts differ: " << naiveFree << " and " << bitmap.countFree() << endl;
+    exit(1);
+  }
+
+  const int allocations = min(ALLOCATIONS, naiveFree);
+  start = now();
+  for (int i = 0; i < allocations; ++i) {
+    int length;
+    bitmap.reserve(bitmap.findFreeRun(1, 1, &length));
+  }
+  const double allocSeconds = now() - start;
+
+  start = now();
+  for (int i = 0; i < allocations; ++i) {
+    int bit = naiveFindFree(bits);
+    bits[bit / 8] |= 1 << (bit % 8);
+  }
+  const double naiveAllocSeconds = now() - start;
+
+  cout << label << "\t" << (int) (allocSeconds / allocations * 1e9) << "\t"
+       << (int) (naiveAllocSeconds / allocations * 1e9) << "\t"
+       << (int) (countSeconds * 1e6) << "\t" << (int) (naiveCountSeconds * 1e6) << endl;
+}
+
+int main() {
+  // The bitmap only needs blocks to load from; no file system is involved.
+  const string image = benchImage("bitmap");
+  int fd = open(image.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, (off_t) (BITMAP_BLOCKS + 1) * UFS_BLOCK_SIZE) != 0) {
+    cerr << "could not create " << image << endl;
+    exit(1);
+  }
+  close(fd);
+  Disk disk(image, UFS_BLOCK_SIZE);
+  Bitmap bitmap;
+  bitmap.load(&disk, 1, BITMAP_BLOCKS, NUM_BITS);
+
+  cout << "fill\talloc ns\tnaive ns\tcount us\tnaive us" << endl;
+  struct {
+    double fill;
+    const char *label;
+  } levels[] = {
+    {0, "0%"}, {0.5, "50%"}, {0.9, "90%"}, {0.99, "99%"}, {0.999, "99.9%"}, {1, "last bit"},
+  };
+  for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); ++i) {
+    run(bitmap, levels[i].fill, levels[i].label);
+  }
+  return 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * Repeated GETs on a warm tree, with and without the block cache.
+ *
+ * The tree is built first, then the image is opened again so every run
+ * starts cold. One untimed pass warms the caches, then each timed pass
+ * GETs every file: a lookup of each path component, a stat and a read.
+ * Reported per GET: read syscalls that reached the image, and the block
+ * cache's hits, misses and evictions.
+ *
+ * Files are one block each: reads of longer contiguous runs are single
+ * preads that do not go through the cache.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Bench.h"
+#include "BlockCache.h"
+#include "LocalFileSystem.h"
+#include "ufs.h"
+
+using namespace std;
+
+#define NUM_INODES (4096)
+#define NUM_DATA (16384)
+#define DIRECTORIES (16)
+#define FILES_PER_DIRECTORY (64)
+#define FILE_SIZE (UFS_BLOCK_SIZE)
+#define PASSES (5)
+
+void buildTree(const string &image) {
+  makeImage(image, NUM_INODES, NUM_DATA);
+  Disk disk(image, UFS_BLOCK_SIZE);
+  LocalFileSystem fileSystem(&disk);
+  vector<char> content(FILE_SIZE, 'x');
+  for (int d = 0; d < DIRECTORIES; ++d) {
+    int directory = fileSystem.create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_DIRECTORY, "d" + to_string(d));
+    for (int f = 0; f < FILES_PER_DIRECTORY; ++f) {
+      int file = fileSystem.create(directory, UFS_REGULAR_FILE, "f" + to_string(f));
+      fileSystem.write(file, content.data(), content.size());
+    }
+  }
+}
+
+void get(LocalFileSystem &fileSystem, int d, int f, char *buffer) {
+  int directory = fileSystem.lookup(UFS_ROOT_DIRECTORY_INODE_NUMBER, "d" + to_string(d));
+  int file = fileSystem.lookup(directory, "f" + to_string(f));
+  inode_t inode;
+  if (file < 0 || fileSystem.stat(file, &inode) != 0 || fileSystem.read(file, buffer, inode.size) != FILE_SIZE) {
+    cerr << "GET failed" << endl;
+    exit(1);
+  }
+}
+
+void run(const string &image, int cacheBlocks, ReplacementPolicyType policy, const char *name) {
+  Disk disk(image, UFS_BLOCK_SIZE);
+  BlockCache *cache = NULL;
+  if (cacheBlocks > 0) {
+    cache = new BlockCache(cacheBlocks, UFS_BLOCK_SIZE, policy);
+    disk.setCache(cache);
+  }
+  LocalFileSystem fileSystem(&disk);
+  vector<char> buffer(FILE_SIZE);
+
+  for (int d = 0; d < DIRECTORIES; ++d) {
+    for (int f = 0; f < FILES_PER_DIRECTORY; ++f) {
+      get(fileSystem, d, f, buffer.data());
+    }
+  }
+
+  const unsigned long syscallsBefore = disk.syscallCount();
+  const unsigned long hitsBefore = cache != NULL ? cache->hits() : 0;
+  const unsigned long missesBefore = cache != NULL ? cache->misses() : 0;
+  const unsigned long evictionsBefore = cache != NULL ? cache->evictions() : 0;
+  const double start = now();
+  for (int pass = 0; pass < PASSES; ++pass) {
+    for (int d = 0; d < DIRECTORIES; ++d) {
+      for (int f = 0; f < FILES_PER_DIRECTORY; ++f) {
+        get(fileSystem, d, f, buffer.data());
+      }
+    }
+  }
+  const double elapsed = now() - start;
+  const double gets = PASSES * DIRECTORIES * FILES_PER_DIRECTORY;
+
+  cout << name << "\t" << cacheBlocks << "\t" << (int) (gets / elapsed) << "\t"
+       << (disk.syscallCount() - syscallsBefore) / gets;
+  if (cache != NULL) {
+    cout << "\t" << (cache->hits() - hitsBefore) / gets << "\t" << (cache->misses() - missesBefore) / gets
+         << "\t" << (cache->evictions() - evictionsBefore) / gets;
+  } else {
+    cout << "\t-\t-\t-";
+  }
+  cout << endl;
+  disk.setCache(NULL);
+  delete cache;
+}
+
+int main() {
+  const string image = benchImage("block-cache");
+  buildTree(image);
+
+  cout << "policy\tblocks\tGETs/s\tsyscalls/GET\thits/GET\tmisses/GET\tevictions/GET" << endl;
+  run(image, 0, REPLACEMENT_LRU, "none");
+  // the tree's data is 1024 blocks: a cache that holds it, and one that does not
+  run(image, 2048, REPLACEMENT_LRU, "lru");
+  run(image, 512, REPLACEMENT_LRU, "lru");
+  return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * Lookup, create and unlink in directories of 10 to 3,582 entries.
+ *
+ * Each directory is filled and checkpointed first, then the dentry cache
+ * is cleared before each timed phase so every operation reads the
+ * directory from the image. The block cache is off, so read syscalls per operation show how many
+ * directory blocks it touched: with the hash index a lookup reads a hash
+ * block and the matching entry block however large the directory grows.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Bench.h"
+#include "DentryCache.h"
+#include "LocalFileSystem.h"
+#include "ufs.h"
+
+using namespace std;
+
+#define NUM_INODES (8192)
+#define NUM_DATA (8192)
+#define CHANGED_ENTRIES (100)
+
+struct Phase {
+  double seconds;
+  unsigned long syscalls;
+  int operations;
+};
+
+void report(struct Phase &phase) {
+  cout << "\t" << (int) (phase.seconds / phase.operations * 1e6) << "\t"
+       << (double) phase.syscalls / phase.operations;
+}
+
+void run(int entries) {
+  const string image = benchImage("directory");
+  makeImage(image, NUM_INODES, NUM_DATA);
+  Disk disk(image, UFS_BLOCK_SIZE);
+  LocalFileSystem fileSystem(&disk);
+
+  int directory = fileSystem.create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_DIRECTORY, "dir");
+  for (int entry = 0; entry < entries; ++entry) {
+    if (fileSystem.create(directory, UFS_REGULAR_FILE, "entry-" + to_string(entry)) < 0) {
+      cerr << "could not create entry " << entry << endl;
+      exit(1);
+    }
+  }
+  disk.checkpoint();
+
+  // lookups of every entry, then unlink and create the last ones again
+  const int changed = min(CHANGED_ENTRIES, entries);
+  struct Phase lookups = {0, 0, entries};
+  struct Phase unlinks = {0, 0, changed};
+  struct Phase creates = {0, 0, changed};
+
+  fileSystem.getDentryCache()->clear();
+  unsigned long syscalls = disk.syscallCount();
+  double start = now();
+  for (int entry = 0; entry < entries; ++entry) {
+    if (fileSystem.lookup(directory, "entry-" + to_string(entry)) < 0) {
+      cerr << "lookup failed" << endl;
+      exit(1);
+    }
+  }
+  lookups.seconds = now() - start;
+  lookups.syscalls = disk.syscallCount() - syscalls;
+
+  fileSystem.getDentryCache()->clear();
+  syscalls = disk.syscallCount();
+  start = now();
+  for (int entry = entries - changed; entry < entries; ++entry) {
+    fileSystem.unlink(directory, "entry-" + to_string(entry));
+  }
+  unlinks.seconds = now() - start;
+  unlinks.syscalls = disk.syscallCount() - syscalls;
+
+  fileSystem.getDentryCache()->clear();
+  syscalls = disk.syscallCount();
+  start = now();
+  for (int entry = entries - changed; entry < entries; ++entry) {
+    fileSystem.create(directory, UFS_REGULAR_FILE, "entry-" + to_string(entry));
+  }
+  creates.seconds = now() - start;
+  creates.syscalls = disk.syscallCount() - syscalls;
+
+  cout << entries;
+  report(lookups);
+  report(creates);
+  report(unlinks);
+  cout << endl;
+}
+
+int main() {
+  cout << "entries\tlookup us\tsyscalls\tcreate us\tsyscalls\tunlink us\tsyscalls" << endl;
+  // a hashed directory holds 3,584 entries, two of which are . and ..
+  const int sizes[] = {10, 100, 1000, 3582};
+  for (int entries : sizes) {
+    run(entries);
+  }
+  return 0;
+}
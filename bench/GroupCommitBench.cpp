@@ -0,0 +1,70 @@
+/*
+ * PUTs per second and fsyncs per PUT with 1, 8 and 64 concurrent writers,
+ * with each commit synced on its own and with group commit.
+ *
+ * A PUT here is what DistributedFileSystemService does for a new file:
+ * create it in the writer's directory and write its contents, two
+ * journaled transactions. The HTTP layer is left out so the numbers show
+ * the cost of durability alone.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Bench.h"
+#include "LocalFileSystem.h"
+#include "ufs.h"
+
+using namespace std;
+
+#define NUM_INODES (4096)
+#define NUM_DATA (16384)
+#define FILE_SIZE (4 * UFS_BLOCK_SIZE)
+#define PUTS_PER_RUN (512)
+#define GROUP_COMMIT_WAIT_MICROS (200)
+
+void run(bool groupCommit, int writers) {
+  const string image = benchImage("group-commit");
+  makeImage(image, NUM_INODES, NUM_DATA);
+  Disk disk(image, UFS_BLOCK_SIZE);
+  if (groupCommit) {
+    disk.setDurability(DURABILITY_GROUP_COMMIT, GROUP_COMMIT_WAIT_MICROS);
+  }
+  LocalFileSystem fileSystem(&disk);
+
+  vector<int> directories;
+  for (int writer = 0; writer < writers; ++writer) {
+    directories.push_back(fileSystem.create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_DIRECTORY, "w" + to_string(writer)));
+  }
+
+  const int putsPerWriter = PUTS_PER_RUN / writers;
+  const unsigned long syncsBefore = disk.syncCount();
+  const double start = now();
+  runThreads(writers, [&](int writer) {
+    vector<char> content(FILE_SIZE, 'a' + writer % 26);
+    for (int put = 0; put < putsPerWriter; ++put) {
+      int inodeNumber = fileSystem.create(directories[writer], UFS_REGULAR_FILE, "f" + to_string(put));
+      if (inodeNumber < 0 || fileSystem.write(inodeNumber, content.data(), content.size()) != FILE_SIZE) {
+        cerr << "PUT failed" << endl;
+        exit(1);
+      }
+    }
+  });
+  const double elapsed = now() - start;
+  const int puts = putsPerWriter * writers;
+
+  cout << (groupCommit ? "group" : "sync") << "\t" << writers << "\t"
+       << (int) (puts / elapsed) << "\t" << (double) (disk.syncCount() - syncsBefore) / puts << endl;
+}
+
+int main() {
+  cout << "mode\twriters\tPUTs/s\tfsyncs/PUT" << endl;
+  const int writerCounts[] = {1, 8, 64};
+  for (int groupCommit = 0; groupCommit < 2; ++groupCommit) {
+    for (int writers : writerCounts) {
+      run(groupCommit, writers);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * PUT latency as the number of inodes in the image grows.
+ *
+ * A PUT creates a file in the root directory and writes a block to it.
+ * With per-block inode tracking only the inode-table blocks holding the
+ * new inode and the root directory are read and written, so latency and
+ * syscalls per PUT should stay flat from a thousand inodes to half a
+ * million.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Bench.h"
+#include "LocalFileSystem.h"
+#include "ufs.h"
+
+using namespace std;
+
+#define NUM_DATA (8192)
+#define PUTS (1000)
+
+void run(int numInodes) {
+  const string image = benchImage("inode-scale");
+  makeImage(image, numInodes, NUM_DATA);
+  Disk disk(image, UFS_BLOCK_SIZE);
+  LocalFileSystem fileSystem(&disk);
+  vector<char> content(UFS_BLOCK_SIZE, 'x');
+
+  vector<double> latencies;
+  const unsigned long syscallsBefore = disk.syscallCount();
+  for (int put = 0; put < PUTS; ++put) {
+    const double start = now();
+    int inodeNumber = fileSystem.create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_REGULAR_FILE, "f" + to_string(put));
+    if (inodeNumber < 0 || fileSystem.write(inodeNumber, content.data(), content.size()) != UFS_BLOCK_SIZE) {
+      cerr << "PUT failed" << endl;
+      exit(1);
+    }
+    latencies.push_back((now() - start) * 1e6);
+  }
+  const double syscalls = (double) (disk.syscallCount() - syscallsBefore) / PUTS;
+
+  cout << numInodes << "\t" << (int) percentile(latencies, 50) << "\t" << (int) percentile(latencies, 99)
+       << "\t" << syscalls << endl;
+}
+
+int main() {
+  cout << "inodes\tp50 us\tp99 us\tsyscalls/PUT" << endl;
+  const int inodeCounts[] = {1024, 16384, 131072, 524288};
+  for (int numInodes : inodeCounts) {
+    run(numInodes);
+  }
+  return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * PUT and GET throughput for 1 MB, 64 MB and 1 GB files.
+ *
+ * Each size gets a fresh image just large enough for it. The PUT is one
+ * LocalFileSystem::write of the whole file, including its commit; the GET
+ * reopens the image and reads the file back after asking the kernel to
+ * drop the image from its page cache, so it is read from the device.
+ * Needs about twice the largest size in free memory and in BENCH_DIR;
+ * pass a smaller largest size in MB, such as 64, to skip the 1 GB run.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Bench.h"
+#include "LocalFileSystem.h"
+#include "ufs.h"
+
+using namespace std;
+
+#define MB (1024 * 1024)
+
+void dropPageCache(const string &image) {
+  int fd = open(image.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+}
+
+void run(int megabytes) {
+  const string image = benchImage("large-file");
+  const int size = megabytes * MB;
+  // data blocks plus room for the pointer blocks
+  const int blocks = size / UFS_BLOCK_SIZE;
+  makeImage(image, 64, blocks + blocks / 512 + 64);
+  vector<char> content(size);
+  for (int i = 0; i < size; i += UFS_BLOCK_SIZE) {
+    content[i] = (char) (i / UFS_BLOCK_SIZE);
+  }
+
+  double putSeconds;
+  {
+    Disk disk(image, UFS_BLOCK_SIZE);
+    LocalFileSystem fileSystem(&disk);
+    int inodeNumber = fileSystem.create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_REGULAR_FILE, "large");
+    const double start = now();
+    if (fileSystem.write(inodeNumber, content.data(), size) != size) {
+      cerr << "PUT of " << megabytes << " MB failed" << endl;
+      exit(1);
+    }
+    putSeconds = now() - start;
+  }
+
+  dropPageCache(image);
+  Disk disk(image, UFS_BLOCK_SIZE);
+  LocalFileSystem fileSystem(&disk);
+  vector<char> readBack(size);
+  const double start = now();
+  int inodeNumber = fileSystem.lookup(UFS_ROOT_DIRECTORY_INODE_NUMBER, "large");
+  if (fileSystem.read(inodeNumber, readBack.data(), size) != size) {
+    cerr << "GET of " << megabytes << " MB failed" << endl;
+    exit(1);
+  }
+  const double getSeconds = now() - start;
+  if (readBack != content) {
+    cerr << "GET of " << megabytes << " MB returned different data" << endl;
+    exit(1);
+  }
+
+  cout << megabytes << "\t" << (int) (megabytes / putSeconds) << "\t" << (int) (megabytes / getSeconds) << endl;
+}
+
+int main(int argc, char *argv[]) {
+  const int largest = argc > 1 ? atoi(argv[1]) : 1024;
+  cout << "MB\tPUT MB/s\tGET MB/s" << endl;
+  const int sizes[] = {1, 64, 1024};
+  for (int megabytes : sizes) {
+    if (megabytes <= largest) {
+      run(megabytes);
+    }
+  }
+  // the largest image is too big to leave lying around
+  unlink(benchImage("large-file").c_str());
+  return 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * PUTs per second with 1, 2, 4 and 8 writers, each in its own directory,
+ * with LocalFileSystem's per-inode locks and behind one global mutex.
+ *
+ * A PUT is a create in the writer's directory followed by a write, as in
+ * GroupCommitBench. The global run takes a mutex around each PUT, as the
+ * service's lock did before the file system locked inodes itself; the
+ * per-inode run lets writers in different directories overlap, so their
+ * commits can share a group commit flush.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Bench.h"
+#include "LocalFileSystem.h"
+#include "ufs.h"
+
+using namespace std;
+
+#define NUM_INODES (4096)
+#define NUM_DATA (16384)
+#define FILE_SIZE (2 * UFS_BLOCK_SIZE)
+#define PUTS_PER_RUN (512)
+#define GROUP_COMMIT_WAIT_MICROS (200)
+
+double run(bool globalLock, int writers) {
+  const string image = benchImage("lock-scaling");
+  makeImage(image, NUM_INODES, NUM_DATA);
+  Disk disk(image, UFS_BLOCK_SIZE);
+  disk.setDurability(DURABILITY_GROUP_COMMIT, GROUP_COMMIT_WAIT_MICROS);
+  LocalFileSystem fileSystem(&disk);
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+  vector<int> directories;
+  for (int writer = 0; writer < writers; ++writer) {
+    directories.push_back(fileSystem.create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_DIRECTORY, "w" + to_string(writer)));
+  }
+
+  const int putsPerWriter = PUTS_PER_RUN / writers;
+  const double start = now();
+  runThreads(writers, [&](int writer) {
+    vector<char> content(FILE_SIZE, 'a' + writer % 26);
+    for (int put = 0; put < putsPerWriter; ++put) {
+      if (globalLock) {
+        pthread_mutex_lock(&lock);
+      }
+      int inodeNumber = fileSystem.create(directories[writer], UFS_REGULAR_FILE, "f" + to_string(put));
+      const bool written = inodeNumber >= 0 &&
+        fileSystem.write(inodeNumber, content.data(), content.size()) == FILE_SIZE;
+      if (globalLock) {
+        pthread_mutex_unlock(&lock);
+      }
+      if (!written) {
+        cerr << "PUT failed" << endl;
+        exit(1);
+      }
+    }
+  });
+  return putsPerWriter * writers / (now() - start);
+}
+
+int main() {
+  cout << "writers\tper-inode PUTs/s\tglobal PUTs/s" << endl;
+  const int writerCounts[] = {1, 2, 4, 8};
+  for (int writers : writerCounts) {
+    const double perInode = run(false, writers);
+    const double global = run(true, writers);
+    cout << writers << "\t" << (int) perInode << "\t" << (int) global << endl;
+  }
+  unlink(benchImage("lock-scaling").c_str());
+  return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * Block cache hit ratios of LRU, 2Q and ARC on synthetic traces.
+ *
+ * Block numbers follow mkfs's layout: metadata (superblock, bitmaps and
+ * inode table) first, file data after it. The traces are
+ *   metadata   GETs of small files: each touches metadata and a block of
+ *              a file picked from a Zipf distribution
+ *   mixed      the same, with a sequential sweep of a large file every
+ *              32,000 accesses, like ds3cat or a big GET; -short sweeps
+ *              half the cache's size, -long twice it
+ *   streaming  repeated sweeps over a file larger than the cache
+ *   loop       a working set slightly larger than the cache, read in order
+ * Every policy replays the same trace, generated from a fixed seed. For
+ * the mixed traces the hit ratio of the small-file GETs alone is reported
+ * too, since sweeping blocks can never hit under any policy.
+ */
+
+#include <math.h>
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "BlockCache.h"
+
+using namespace std;
+
+#define CACHE_BLOCKS (4096)
+#define BLOCK_SIZE (64)
+#define TRACE_LENGTH (400000)
+
+#define METADATA_BLOCKS (64)
+#define SMALL_FILES (16384)
+#define ZIPF_EXPONENT (0.9)
+#define SWEEP_EVERY (32000)
+
+// Picks 0 to count - 1, rank r with probability proportional to 1 / r^s
+class Zipf {
+ public:
+  Zipf(int count, double exponent) : cdf(count) {
+    double total = 0;
+    for (int rank = 0; rank < count; ++rank) {
+      total += 1 / pow(rank + 1, exponent);
+      cdf[rank] = total;
+    }
+    for (int rank = 0; rank < count; ++rank) {
+      cdf[rank] /= total;
+    }
+  }
+
+  int next(mt19937 &random) {
+    double u = uniform_real_distribution<double>(0, 1)(random);
+    return min((int) (lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin()), (int) cdf.size() - 1);
+  }
+
+ private:
+  vector<double> cdf;
+};
+
+struct Access {
+  int block;
+  bool sweep;
+};
+
+void smallFileGet(vector<struct Access> &trace, mt19937 &random, Zipf &files) {
+  // superblock, an inode bitmap block and the file's inode table block
+  int file = files.next(random);
+  const int blocks[] = {0, (int) (1 + random() % 2), 8 + file % (METADATA_BLOCKS - 8), METADATA_BLOCKS + file};
+  for (int block : blocks) {
+    trace.push_back({block, false});
+  }
+}
+
+vector<struct Access> makeTrace(const string &name) {
+  mt19937 random(42);
+  Zipf files(SMALL_FILES, ZIPF_EXPONENT);
+  vector<struct Access> trace;
+  int sweepStart = METADATA_BLOCKS + SMALL_FILES;
+
+  while (trace.size() < TRACE_LENGTH) {
+    if (name == "metadata") {
+      smallFileGet(trace, random, files);
+    } else if (name.compare(0, 5, "mixed") == 0) {
+      for (int i = 0; i < SWEEP_EVERY / 4; ++i) {
+        smallFileGet(trace, random, files);
+      }
+      // each sweep reads a different large file once
+      const int sweepBlocks = name == "mixed-short" ? CACHE_BLOCKS / 2 : 2 * CACHE_BLOCKS;
+      for (int block = 0; block < sweepBlocks; ++block) {
+        trace.push_back({sweepStart + block, true});
+      }
+      sweepStart += sweepBlocks;
+    } else if (name == "streaming") {
+      for (int block = 0; block < 4 * CACHE_BLOCKS; ++block) {
+        trace.push_back({METADATA_BLOCKS + block, true});
+      }
+    } else {
+      for (int block = 0; block < CACHE_BLOCKS + CACHE_BLOCKS / 8; ++block) {
+        trace.push_back({METADATA_BLOCKS + block, true});
+      }
+    }
+  }
+  trace.resize(TRACE_LENGTH);
+  return trace;
+}
+
+// Hit ratio over every access, or over the accesses that are not sweeps
+void hitRatios(const vector<struct Access> &trace, ReplacementPolicyType policy, double *all, double *gets) {
+  BlockCache cache(CACHE_BLOCKS, BLOCK_SIZE, policy);
+  unsigned char buffer[BLOCK_SIZE] = {0};
+  long getAccesses = 0;
+  long getHits = 0;
+  for (size_t i = 0; i < trace.size(); ++i) {
+    const bool hit = cache.get(trace[i].block, buffer);
+    if (!hit) {
+      cache.fill(trace[i].block, buffer, cache.fillToken(trace[i].block));
+    }
+    if (!trace[i].sweep) {
+      getAccesses++;
+      getHits += hit;
+    }
+  }
+  *all = (double) cache.hits() / (cache.hits() + cache.misses());
+  *gets = getAccesses > 0 ? (double) getHits / getAccesses : 0;
+}
+
+int main() {
+  const char *traces[] = {"metadata", "mixed-short", "mixed-long", "streaming", "loop"};
+  const ReplacementPolicyType policies[] = {REPLACEMENT_LRU, REPLACEMENT_2Q, REPLACEMENT_ARC};
+
+  cout << "trace\tlru\t2q\tarc" << endl;
+  for (const char *name : traces) {
+    vector<struct Access> trace = makeTrace(name);
+    double all[3];
+    double gets[3];
+    for (int i = 0; i < 3; ++i) {
+      hitRatios(trace, policies[i], &all[i], &gets[i]);
+    }
+    cout << name << "\t" << all[0] << "\t" << all[1] << "\t" << all[2] << endl;
+    if (string(name).compare(0, 5, "mixed") == 0) {
+      cout << "  GETs\t" << gets[0] << "\t" << gets[1] << "\t" << gets[2] << endl;
+    }
+  }
+  return 0;
+}
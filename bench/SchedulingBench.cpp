@@ -0,0 +1,74 @@
+/*
+ * Latency of small and large requests under each scheduling policy.
+ *
+ * server_web runs with two workers, so connections queue. Four bulk
+ * clients, all from 127.0.0.10, keep uploading 4 MB files, while eight
+ * clients, each on its own address (127.0.0.2 to 127.0.0.9), GET a
+ * 100-byte file. Both classes run for a fixed time; p50 and p99 latency
+ * are reported for each under -s FIFO, SFF and DRR.
+ */
+
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Bench.h"
+
+using namespace std;
+
+#define WORKERS (2)
+#define BULK_CLIENTS (4)
+#define SMALL_CLIENTS (8)
+#define UPLOAD_SIZE (4 * 1024 * 1024)
+#define SECONDS (5.0)
+
+void run(const string &policy) {
+  const string image = benchImage("scheduling");
+  makeImage(image, 1024, 8 * UPLOAD_SIZE / 4096);
+  vector<string> args = {"-i", image, "-t", to_string(WORKERS), "-b", "64", "-s", policy};
+  const int pid = startServer(args);
+  httpRequest("127.0.0.1", "PUT", "/ds3/small", string(100, 's'));
+
+  const string upload(UPLOAD_SIZE, 'b');
+  vector<double> small;
+  vector<double> large;
+  mutex samplesLock;
+  bool failed = false;
+  const double deadline = now() + SECONDS;
+  runThreads(BULK_CLIENTS + SMALL_CLIENTS, [&](int client) {
+    const bool bulk = client < BULK_CLIENTS;
+    const string source = bulk ? "127.0.0.10" : "127.0.0." + to_string(2 + client - BULK_CLIENTS);
+    const string path = bulk ? "/ds3/bulk/f" + to_string(client) : "/ds3/small";
+    while (now() < deadline) {
+      const double start = now();
+      const int status = bulk ? httpRequest(source, "PUT", path, upload) : httpRequest(source, "GET", path, "");
+      const double latency = (now() - start) * 1000;
+      lock_guard<mutex> guard(samplesLock);
+      if (status != 200) {
+        failed = true;
+        return;
+      }
+      (bulk ? large : small).push_back(latency);
+    }
+  });
+  stopServer(pid);
+  if (failed) {
+    cerr << "a request failed under " << policy << endl;
+    exit(1);
+  }
+
+  cout << policy << "\t" << small.size() << "\t" << percentile(small, 50) << "\t" << percentile(small, 99)
+       << "\t" << large.size() << "\t" << percentile(large, 50) << "\t" << percentile(large, 99) << endl;
+}
+
+int main() {
+  cout << fixed << setprecision(1);
+  cout << "policy\tsmall GETs\tp50 ms\tp99 ms\t4 MB PUTs\tp50 ms\tp99 ms" << endl;
+  const char *policies[] = {"FIFO", "SFF", "DRR"};
+  for (const char *policy : policies) {
+    run(policy);
+  }
+  return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * Requests per second through server_web with 1 to 64 worker threads.
+ *
+ * For each pool size the server is started on a fresh image holding 256
+ * files of 16 KB, then 64 client threads send requests for a fixed time:
+ * nine GETs of a random file for every PUT that rewrites one. Each request
+ * is a new connection, as the server closes it after replying. The
+ * clients share the machine with the server, so scaling flattens well
+ * before the pool outgrows the cores.
+ */
+
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Bench.h"
+
+using namespace std;
+
+#define FILES (256)
+#define FILE_SIZE (16 * 1024)
+#define CLIENTS (64)
+#define SECONDS (2.0)
+
+double run(int threads) {
+  const string image = benchImage("server-scaling");
+  makeImage(image, 1024, 4096);
+  vector<string> args = {"-i", image, "-t", to_string(threads), "-b", to_string(CLIENTS)};
+  const int pid = startServer(args);
+
+  const string content(FILE_SIZE, 'x');
+  for (int file = 0; file < FILES; ++file) {
+    httpRequest("127.0.0.1", "PUT", "/ds3/data/f" + to_string(file), content);
+  }
+
+  vector<long> completed(CLIENTS, 0);
+  bool failed = false;
+  const double deadline = now() + SECONDS;
+  const double start = now();
+  runThreads(CLIENTS, [&](int client) {
+    mt19937 random(client);
+    while (now() < deadline) {
+      const string path = "/ds3/data/f" + to_string(random() % FILES);
+      const bool put = random() % 10 == 0;
+      if (httpRequest("127.0.0.1", put ? "PUT" : "GET", path, put ? content : "") != 200) {
+        failed = true;
+        return;
+      }
+      completed[client]++;
+    }
+  });
+  const double elapsed = now() - start;
+  stopServer(pid);
+  if (failed) {
+    cerr << "a request failed with " << threads << " worker threads" << endl;
+    exit(1);
+  }
+
+  long requests = 0;
+  for (long count : completed) {
+    requests += count;
+  }
+  return requests / elapsed;
+}
+
+int main() {
+  cout << thread::hardware_concurrency() << " cores" << endl;
+  cout << "threads\trequests/s" << endl;
+  const int threadCounts[] = {1, 2, 4, 8, 16, 32, 64};
+  for (int threads : threadCounts) {
+    cout << threads << "\t" << (int) run(threads) << endl;
+  }
+  return 0;
+}
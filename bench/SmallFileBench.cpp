@@ -0,0 +1,74 @@
+/*
+ * Space and latency of tiny files stored inline in the inode.
+ *
+ * Writes the same number of files of MAX_INLINE_SIZE bytes, which are kept
+ * in the inode, and of one byte more, which need a data block, each on a
+ * fresh image. Reported per file: data blocks used, PUT latency (a create
+ * and a write), and GET latency and read syscalls after reopening the
+ * image with the block cache off, so GETs read it.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Bench.h"
+#include "LocalFileSystem.h"
+#include "ufs.h"
+
+using namespace std;
+
+#define FILES (2000)
+#define NUM_INODES (4096)
+#define NUM_DATA (4096)
+
+void run(int size, const char *label) {
+  const string image = benchImage("small-file");
+  makeImage(image, NUM_INODES, NUM_DATA);
+  vector<char> content(size, 'x');
+  vector<int> inodeNumbers;
+  double putSeconds;
+  double blocksPerFile;
+  {
+    Disk disk(image, UFS_BLOCK_SIZE);
+    LocalFileSystem fileSystem(&disk);
+    super_t super;
+    fileSystem.readSuperBlock(&super);
+    const int freeBefore = super.free_data;
+    const double start = now();
+    for (int file = 0; file < FILES; ++file) {
+      int inodeNumber = fileSystem.create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_REGULAR_FILE, "f" + to_string(file));
+      if (inodeNumber < 0 || fileSystem.write(inodeNumber, content.data(), size) != size) {
+        cerr << "PUT failed" << endl;
+        exit(1);
+      }
+      inodeNumbers.push_back(inodeNumber);
+    }
+    putSeconds = now() - start;
+    fileSystem.readSuperBlock(&super);
+    blocksPerFile = (double) (freeBefore - super.free_data) / FILES;
+  }
+
+  // GETs by inode number, so directory lookups do not count
+  Disk disk(image, UFS_BLOCK_SIZE);
+  LocalFileSystem fileSystem(&disk);
+  const unsigned long syscalls = disk.syscallCount();
+  const double start = now();
+  for (int file = 0; file < FILES; ++file) {
+    if (fileSystem.read(inodeNumbers[file], content.data(), size) != size) {
+      cerr << "GET failed" << endl;
+      exit(1);
+    }
+  }
+  const double getSeconds = now() - start;
+
+  cout << label << "\t" << size << "\t" << blocksPerFile << "\t" << (int) (putSeconds / FILES * 1e6) << "\t"
+       << (int) (getSeconds / FILES * 1e6) << "\t" << (double) (disk.syscallCount() - syscalls) / FILES << endl;
+}
+
+int main() {
+  cout << "layout\tbytes\tblocks/file\tPUT us\tGET us\tsyscalls/GET" << endl;
+  run(MAX_INLINE_SIZE, "inline");
+  run(MAX_INLINE_SIZE + 1, "block");
+  return 0;
+}
@@ -39,7 +39,7 @@ int main(int argc, char *argv[]) {
   string diskImageFileName(argv[1]);
 
   // Initialize Disk, LocalFileSystem
-  Disk disk(diskImageFileName, UFS_BLOCK_SIZE);
+  Disk disk(diskImageFileName, UFS_BLOCK_SIZE, true);
   LocalFileSystem localFileSystem(&disk);
 
   // Read super block
@@ -8,6 +8,7 @@
 #include <string>
 #include <algorithm>
 #include <cstring>
+#include <vector>
 
 #include "LocalFileSystem.h"
 #include "Disk.h"
@@ -29,7 +30,7 @@ int main(int argc, char *argv[]) {
 
   // PASSED ERROR CHECK
   // Parse arguments
-  Disk disk(argv[1], UFS_BLOCK_SIZE);
+  Disk disk(argv[1], UFS_BLOCK_SIZE, true);
   int inodeNumber = atoi(argv[2]);
 
   // Initialize Disk, LocalFileSystem
@@ -45,19 +46,20 @@ int main(int argc, char *argv[]) {
       return -1; // ERROR: invalid
   }
 
-  // FIND number of blocks
-  int numBlocks = (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  // FIND the blocks, following indirect blocks for large files
+  vector<int> blocks;
+  localFileSystem.fileBlocks(&inode, blocks);
 
   // PRINT the File blocks
   cout << "File blocks" << endl;
-  for (int blockIndex = 0; blockIndex < numBlocks; ++blockIndex) {
-      cout << inode.direct[blockIndex] << endl;
+  for (size_t blockIndex = 0; blockIndex < blocks.size(); ++blockIndex) {
+      cout << blocks[blockIndex] << endl;
   }
   cout << endl;
 
   // FIND bytes read
-  char dataFile[inode.size + 1];
-  int bytesRead = localFileSystem.read(inodeNumber, dataFile, inode.size);
+  vector<char> dataFile(inode.size + 1);
+  int bytesRead = localFileSystem.read(inodeNumber, dataFile.data(), inode.size);
 
   // PRINT the File data
   cout << "File data" << endl;
@@ -65,7 +67,7 @@ int main(int argc, char *argv[]) {
       return -1; // ERROR: fail read
   }
   dataFile[inode.size] = '\0';
-  cout << dataFile;
+  cout << dataFile.data();
 
   return 0;
 }
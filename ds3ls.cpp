@@ -16,7 +16,7 @@
 #include "Disk.h"
 #include "ufs.h"
 
-//#include <vector>
+#include <vector>
 using namespace std;
 
 // Uses:
@@ -39,15 +39,15 @@ void printDir(int num, LocalFileSystem &fileSystem, string path) {
   }
   
   int numDirectoryEntries = inode.size / sizeof(dir_ent_t);
-  dir_ent_t entries[numDirectoryEntries];
+  vector<dir_ent_t> entries(numDirectoryEntries);
 
   // ERROR CHECK
-  if (fileSystem.read(num, entries, inode.size) < 0) {
+  if (fileSystem.read(num, entries.data(), inode.size) < 0) {
     return;
   }
 
   // Sort entries by name
-  sort(entries, entries + numDirectoryEntries, compareEntries);
+  sort(entries.begin(), entries.end(), compareEntries);
 
   // PRINT each directory entry
   for (const dir_ent_t &entry : entries) {
@@ -84,7 +84,7 @@ int main(int argc, char *argv[]) {
   }
 
   // Parse arguments
-  Disk disk(argv[1], UFS_BLOCK_SIZE);
+  Disk disk(argv[1], UFS_BLOCK_SIZE, true);
   LocalFileSystem localFileSystem(&disk);
 
   // Read super block
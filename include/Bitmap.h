@@ -0,0 +1,92 @@
+#ifndef _BITMAP_H_
+#define _BITMAP_H_
+
+#include <vector>
+#include <stdint.h>
+
+#include "Disk.h"
+
+/**
+ * An allocation bitmap kept resident in memory.
+ *
+ * The bitmap occupies `len` blocks starting at `addr` on disk, of which only
+ * the first `numBits` bits describe real inodes or data blocks. Changes are
+ * made in memory and mark the 4KB block that holds the bit as dirty; flush()
+ * then writes just the dirty blocks, normally inside the transaction that
+ * made the change.
+ *
+ * A bit can also be reserved: it counts as used in memory, so searches
+ * skip it, but is written to disk as clear until claim() makes the
+ * allocation real. unreserve() gives it back. Reservations therefore never
+ * survive a crash, and a reserved bit that is never claimed costs nothing
+ * on disk.
+ *
+ * Bits are stored in 64-bit words (bit i is bit i % 64 of word i / 64,
+ * which matches the on-disk byte order on little-endian machines). Above
+ * the words sits a summary tree with one bit per word of the level below,
+ * set when that word is full, so finding a free bit costs one word per
+ * level instead of a scan.
+ */
+class Bitmap {
+ public:
+  Bitmap();
+
+  void load(Disk *disk, int addr, int len, int numBits);
+  void flush(Disk *disk);
+
+  bool isSet(int bit);
+  void clear(int bit);
+
+  bool isReserved(int bit);
+  void reserve(int bit);
+  void unreserve(int bit);
+  void claim(int bit);
+
+  // First clear bit below numBits, or -1 if every bit is set.
+  int findFirstFree();
+  // Number of clear bits below numBits, kept up to date as bits change.
+  // Reserved bits are not clear.
+  int countFree();
+  int countReserved();
+
+  // Length of the run of clear bits starting at bit, at most maxLength.
+  int freeRunAt(int bit, int maxLength);
+  // Start of the first run of at least minLength clear bits, or -1. The
+  // run's length, capped at maxLength, is stored in length. Full words are
+  // skipped through the summary tree, so a single free bit costs one word
+  // per level to find however full the bitmap is.
+  int findFreeRun(int minLength, int maxLength, int *length);
+
+  // Whole-bitmap access for the utilities. copyTo gives the bitmap as it
+  // is written to disk.
+  void copyTo(unsigned char *buffer);
+  void copyFrom(const unsigned char *buffer);
+
+ private:
+  void setInMemory(int bit);
+  void clearInMemory(int bit);
+  void markDirty(int bit);
+  uint64_t validMask(size_t word);
+  bool wordFull(size_t word);
+  void buildSummary();
+  void rebuildSummary(size_t firstWord, size_t lastWord);
+  void markFull(size_t word);
+  void markNotFull(size_t word);
+  size_t nextNotFull(size_t word);
+  int scanFree();
+
+  int addr;
+  int len;
+  int numBits;
+  int freeBits;
+  int reservedBits;
+  std::vector<uint64_t> words;
+  // bits set in words that are written as clear
+  std::vector<uint64_t> reserved;
+  std::vector<bool> dirty;
+  // summary[0] has a bit per word of `words`, summary[k] a bit per word of
+  // summary[k - 1]. Bits past the end of a level are kept set.
+  std::vector<std::vector<uint64_t> > summary;
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef _BLOCK_CACHE_H_
+#define _BLOCK_CACHE_H_
+
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "ReplacementPolicy.h"
+
+#define BLOCK_CACHE_SHARDS (16)
+
+/**
+ * A fixed-capacity cache of disk blocks.
+ *
+ * Blocks are spread over BLOCK_CACHE_SHARDS shards by block number and
+ * every shard has its own lock and replacement policy, so lookups of
+ * unrelated blocks do not contend. LRU is the default; 2Q and ARC keep hot
+ * metadata resident through large sequential scans.
+ *
+ * Disk fills the cache after a miss and writes committed blocks into it.
+ * A fill races with commits of the same block, so a reader takes a fill
+ * token before reading the block from storage, and the fill is dropped if
+ * the shard changed in the meantime.
+ */
+class BlockCache {
+ public:
+  BlockCache(int capacity, int blockSize, ReplacementPolicyType policy = REPLACEMENT_LRU);
+  ~BlockCache();
+
+  // Copy a cached block into buffer. Returns false on a miss.
+  bool get(int blockNumber, void *buffer);
+
+  uint64_t fillToken(int blockNumber);
+  void fill(int blockNumber, const void *buffer, uint64_t token);
+
+  // Install the newly committed contents of a block.
+  void put(int blockNumber, const void *buffer);
+
+  int capacity();
+  unsigned long hits();
+  unsigned long misses();
+  unsigned long evictions();
+
+ private:
+  struct Shard {
+    pthread_mutex_t lock;
+    uint64_t generation;
+    int capacity;
+    ReplacementPolicy *policy;
+    std::unordered_map<int, unsigned char *> blocks;
+  };
+
+  Shard &shardFor(int blockNumber);
+  void insertLocked(Shard &shard, int blockNumber, const void *buffer);
+
+  int blockSize;
+  int totalCapacity;
+  std::vector<Shard *> shards;
+  std::atomic<unsigned long> hitCount;
+  std::atomic<unsigned long> missCount;
+  std::atomic<unsigned long> evictionCount;
+};
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef _DENTRY_CACHE_H_
+#define _DENTRY_CACHE_H_
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <atomic>
+
+#include <pthread.h>
+
+// Cached result for a name that is known not to exist.
+#define DENTRY_NEGATIVE (-1)
+
+/**
+ * Caches directory lookups by (parent inode, name).
+ *
+ * Both hits and misses are remembered: a negative entry records that the
+ * name does not exist, so probing for a missing path component (as PUT
+ * does before creating it) also avoids the directory blocks. The file
+ * system keeps entries exact by updating them in create and unlink.
+ * Entries are evicted least recently used first.
+ */
+class DentryCache {
+ public:
+  DentryCache(int capacity);
+  ~DentryCache();
+
+  // Returns false on a miss; otherwise sets inodeNumber, which is
+  // DENTRY_NEGATIVE if the name is known not to exist.
+  bool get(int parentInodeNumber, const std::string &name, int *inodeNumber);
+  void put(int parentInodeNumber, const std::string &name, int inodeNumber);
+  // Drop every entry looked up inside a directory that has been removed,
+  // since its inode number can be reused.
+  void forgetDirectory(int inodeNumber);
+  void clear();
+
+  unsigned long hits();
+  unsigned long misses();
+
+ private:
+  typedef std::list<std::pair<std::string, int> > EntryList;
+
+  static std::string keyFor(int parentInodeNumber, const std::string &name);
+
+  pthread_mutex_t lock;
+  int capacity;
+  // most recently used at the front
+  EntryList entries;
+  std::unordered_map<std::string, EntryList::iterator> index;
+  std::atomic<unsigned long> hitCount;
+  std::atomic<unsigned long> missCount;
+};
+
+#endif
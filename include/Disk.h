@@ -3,29 +3,253 @@
 
 #include <string>
 #include <deque>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <thread>
 
-struct UndoRecord {
-  int blockNumber;
-  unsigned char *blockData;
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "BlockCache.h"
+
+// How transactional writes reach stable storage.
+//
+// Blocks written inside a transaction are always buffered and written out
+// at commit, either as one record in the redo journal or, for images without
+// a journal, straight to their home locations.
+//
+// DURABILITY_SYNC flushes each commit as soon as its writes are issued.
+//
+// DURABILITY_GROUP_COMMIT lets a committing transaction wait for other open
+// transactions so that a single fdatasync covers all of them.
+enum DurabilityMode {
+  DURABILITY_SYNC,
+  DURABILITY_GROUP_COMMIT
+};
+
+struct Transaction {
+  std::map<int, unsigned char *> writeBuffer;
+  // set once writeBlocksOrdered has written data outside the journal
+  bool orderedData;
+  // log blocks set aside by reserveJournalSpace
+  int64_t reservedBlocks;
+
+  Transaction() : orderedData(false), reservedBlocks(0) {}
+};
+
+/**
+ * Redo journal layout.
+ *
+ * The first block of the journal region holds a JournalHeader naming the
+ * oldest record that has not been checkpointed. The remaining blocks are a
+ * circular log. Each transaction is appended as one contiguous record:
+ * descriptor blocks (a JournalRecordHeader followed by the home block
+ * numbers, continued into as many blocks as they fill), the block images,
+ * and a commit block whose checksum covers the descriptors and the images.
+ * Records are appended at the head, which starts at the header's tail; a
+ * record that does not fit before the end of the log starts over at
+ * offset 0.
+ *
+ * A transaction is therefore limited to the log: with a journal of
+ * journalLen blocks it may write at most maxTransactionBlocks(), a little
+ * under journalLen - 2, blocks. Committing a larger one is a fatal error,
+ * since writing it in place would not be crash-atomic; callers check the
+ * limit first and fail the operation instead. mkfs sizes the journal so the
+ * largest write the file system makes fits.
+ */
+#define JOURNAL_HEADER_MAGIC     (0x4a48445253334453ULL)
+#define JOURNAL_DESCRIPTOR_MAGIC (0x4a44455343334453ULL)
+#define JOURNAL_COMMIT_MAGIC     (0x4a434d5443334453ULL)
+
+struct JournalHeader {
+  uint64_t magic;
+  uint64_t tailSequence;  // sequence number of the first live record
+  int64_t tailOffset;     // log offset of that record, in blocks
+};
+
+struct JournalRecordHeader {
+  uint64_t magic;
+  uint64_t sequence;
+  uint64_t checksum;      // only used in the commit block
+  int64_t count;          // number of block images in the record
+};
+
+// A committed block image waiting to be checkpointed to its home location.
+struct PendingBlock {
+  unsigned char *data;
+  uint64_t sequence;
+};
+
+// Where a live record sits in the log, used to advance the tail.
+struct JournalRecord {
+  uint64_t sequence;
+  int64_t endOffset;
+  int64_t usedBlocks;
 };
 
 class Disk {
  public:
-  Disk(std::string imageFile, int blockSize);
+  // A read-only Disk opens the image O_RDONLY, so it works on images the
+  // caller cannot write. It never writes, flushes or checkpoints: any write
+  // is a fatal error, and openJournal only reads the committed records into
+  // memory so reads still see them.
+  Disk(std::string imageFile, int blockSize, bool readOnly = false);
+  ~Disk();
   void readBlock(int blockNumber, void *buffer);
   void writeBlock(int blockNumber, void *buffer);
+
+  // Read count adjacent blocks, with a single pread when none of them has
+  // a newer copy in this thread's transaction or the journal. Bulk reads
+  // bypass the cache so they do not push out metadata.
+  void readBlocks(int blockNumber, int count, void *buffer);
   int numberOfBlocks();
 
+  // Transactions are tracked per calling thread, so request threads can
+  // each have one open at the same time.
   void beginTransaction();
   void commit();
   void rollback();
+
+  /**
+   * commit() in three steps, for callers that order their commits under a
+   * lock of their own but should not hold it across a flush.
+   * syncOrderedData() makes the data this thread's transaction wrote with
+   * writeBlocksOrdered durable. publish() gives the transaction its place
+   * in the commit order and makes its blocks visible to every thread; it
+   * returns false if the transaction wrote nothing. waitForPublished()
+   * returns once everything this thread published is durable. Only
+   * publish() needs the caller's lock.
+   */
+  void syncOrderedData();
+  bool publish();
+  void waitForPublished();
+
+  // Number of blocks this thread's open transaction has written, and the
+  // most a transaction can write and still be committed atomically.
+  int transactionBlocks();
+  int maxTransactionBlocks();
+
+  /**
+   * Set aside log space for this thread's transaction, which will write at
+   * most `blocks` blocks in all, checkpointing first if the log is too full.
+   * publish() then appends the record without waiting for a checkpoint, so
+   * callers that publish under a lock of their own reserve before taking
+   * it. The space is given back if the transaction rolls back.
+   */
+  void reserveJournalSpace(int blocks);
+
+  /**
+   * Write count blocks of file data straight to their home locations,
+   * bypassing the journal, for transactions too large to journal. Must be
+   * called inside a transaction; commit flushes this data before it writes
+   * the transaction's metadata, so committed metadata never points at data
+   * that did not reach the disk.
+   */
+  void writeBlocksOrdered(int blockNumber, int count, const void *buffer);
+
+  // groupCommitWaitMicros is the longest a committing transaction will wait
+  // for others to join its flush. It is only used in group commit mode.
+  void setDurability(DurabilityMode mode, int groupCommitWaitMicros = 0);
+
+  // Serve reads from cache, which is filled on misses and receives the
+  // blocks of every committed transaction. The Disk does not own it.
+  void setCache(BlockCache *cache);
+  BlockCache *getCache();
+
+  /**
+   * Use the redo journal stored in blocks [journalAddr, journalAddr + journalLen).
+   *
+   * Any committed records left by a crash are replayed and checkpointed
+   * before this returns, except on a read-only Disk, where they are only
+   * loaded. Returns the number of transactions replayed.
+   */
+  int openJournal(int journalAddr, int journalLen);
+
+  // Write every committed journal record to its home location and free
+  // the log space it used.
+  void checkpoint();
+
+  // Number of system calls issued against the image file so far. Reads and
+  // writes use pread/pwrite on a shared descriptor, so they are safe to issue
+  // from many threads at once.
+  unsigned long syscallCount();
+  // Number of fsync/fdatasync calls issued so far.
+  unsigned long syncCount();
   
  private:
+  void preadBlock(int blockNumber, void *buffer);
+  void pwriteBlock(int blockNumber, const void *buffer);
+  void preadBlocks(int blockNumber, int count, void *buffer);
+  void pwriteBlocks(int blockNumber, int count, const void *buffer);
+  void checkBlockNumber(int blockNumber);
+  Transaction *currentTransaction();
+  Transaction *detachTransaction();
+  void freeTransaction(Transaction *transaction);
+  void groupSync();
+  void dataSync();
+  void cacheTransaction(Transaction *transaction);
+
+  int64_t descriptorBlocks(int64_t count);
+  int64_t worstCaseRecord(int64_t count);
+  void commitToJournal(Transaction *transaction);
+  void commitInPlace(Transaction *transaction);
+  int replayJournal();
+  bool loadRecord(int64_t offset, struct JournalRecordHeader *descriptor, std::vector<unsigned char> &record);
+  void writeJournalHeader();
+  void checkpointLocked();
+  static void *checkpointThread(void *arg);
+
   std::string imageFile;
   int blockSize;
-  int imageFileSize;
-  bool isInTransaction;
-  std::deque<struct UndoRecord> undoLog;
+  bool readOnly;
+  off_t imageFileSize;
+  int imageFileDescriptor;
+  std::atomic<unsigned long> syscalls;
+  std::atomic<unsigned long> syncs;
+
+  DurabilityMode durability;
+  int groupCommitWaitMicros;
+  BlockCache *cache;
+
+  pthread_mutex_t transactionLock;
+  std::map<std::thread::id, Transaction *> transactions;
+  std::atomic<int> openTransactions;
+
+  // Group commit state, protected by groupLock. Every commit takes a ticket
+  // after its writes are issued; a flush started after that point covers it.
+  pthread_mutex_t groupLock;
+  pthread_cond_t groupCond;
+  unsigned long issuedTicket;
+  unsigned long syncedTicket;
+  bool syncInProgress;
+
+  // Journal state. journalLock orders appends to the log and protects the
+  // head, tail and live record list. pendingLock protects pendingBlocks,
+  // which readers consult before going to the image. checkpointLock allows
+  // one checkpoint at a time.
+  bool hasJournal;
+  int journalAddr;
+  int journalLen;
+  int64_t logLen;
+  int64_t headOffset;
+  int64_t tailOffset;
+  int64_t usedBlocks;
+  // log blocks promised to transactions that have not been appended yet;
+  // usedBlocks + reservedBlocks never exceeds logLen
+  int64_t reservedBlocks;
+  uint64_t nextSequence;
+  uint64_t tailSequence;
+  std::deque<struct JournalRecord> liveRecords;
+  pthread_mutex_t journalLock;
+  pthread_mutex_t pendingLock;
+  pthread_mutex_t checkpointLock;
+  std::map<int, struct PendingBlock> pendingBlocks;
+
+  pthread_t checkpointer;
+  pthread_cond_t checkpointCond;
+  bool stopCheckpointer;
 };
 
 #endif
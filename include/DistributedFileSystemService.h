@@ -3,19 +3,40 @@
 
 #include "HttpService.h"
 #include "LocalFileSystem.h"
+#include "PathCache.h"
 
 #include <string>
+#include <vector>
+
+#include <pthread.h>
+
+// Number of request paths whose resolved inode is remembered
+#define PATH_CACHE_SIZE (65536)
 
 class DistributedFileSystemService : public HttpService {
  public:
-  DistributedFileSystemService(std::string driveFile);
+  DistributedFileSystemService(Disk *disk);
 
   virtual void get(HTTPRequest *request, HTTPResponse *response);
   virtual void put(HTTPRequest *request, HTTPResponse *response);
+  virtual void post(HTTPRequest *request, HTTPResponse *response);
   virtual void del(HTTPRequest *request, HTTPResponse *response);
 
+  // Size of the file or directory at url if its path has been resolved
+  // before, or -1. Only consults caches, so it is cheap and safe to call
+  // from any thread.
+  long estimateSize(const std::string &url);
+
 private:
+  void writeFile(const std::string &url, const std::string &content, bool append, HTTPResponse *response);
+  void getRanges(int inodeNum, int size, std::vector<std::pair<int, int> > &ranges, HTTPResponse *response);
+
   LocalFileSystem *fileSystem;
+  PathCache *pathCache;
+  // LocalFileSystem locks the inodes each operation works on, so GET, PUT
+  // and POST ?append all share this. DELETE holds it exclusively, so no
+  // request sees a path it resolved disappear before it is done with it.
+  pthread_rwlock_t lock;
 };
 
 #endif
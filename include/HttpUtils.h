@@ -9,6 +9,10 @@
 
 #include "MySocket.h"
 
+// Most ranges a Range header may list before it is ignored and the whole
+// body is sent instead
+#define MAX_BYTE_RANGES (32)
+
 class MalformedQueryString : public std::runtime_error {
  public:
 MalformedQueryString(std::string query) : std::runtime_error("could not parse query string " + query) {}
@@ -22,6 +26,14 @@ class HttpUtils {
 
   static std::vector<std::string> split(const std::string &s, char delim);
 
+  // Parse a "bytes=" Range header for a body of size bytes into inclusive
+  // (first, last) ranges, sorted, with overlapping and adjacent ranges
+  // merged. Returns false if the header should be ignored, which includes
+  // headers listing more than MAX_BYTE_RANGES ranges; an empty result means
+  // no range can be satisfied.
+  static bool byteRanges(const std::string &header, int size,
+                         std::vector<std::pair<int, int> > &ranges);
+
  private:
   static std::vector<std::string> &split(const std::string &s,
 					 char delim,
@@ -0,0 +1,80 @@
+#ifndef _INODE_CACHE_H_
+#define _INODE_CACHE_H_
+
+#include <list>
+#include <set>
+#include <unordered_map>
+#include <atomic>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "Disk.h"
+#include "ufs.h"
+
+/**
+ * Decoded inodes kept in memory.
+ *
+ * acquire returns the cached inode with a reference held; an inode with
+ * references is pinned and never evicted. Updates are made in memory and
+ * marked dirty, and flush writes the dirty inodes back, one read-modify-
+ * write per inode-table block, inside the caller's transaction. They stay
+ * dirty, and so cannot be evicted and read back from the old inode-table
+ * block, until published() reports that the transaction is visible. Clean,
+ * unreferenced inodes are evicted least recently used first.
+ *
+ * A miss reads the inode-table block without holding the cache's lock. As
+ * in BlockCache, the reader takes a fill token first and reads again if a
+ * put changed the cache in the meantime.
+ */
+class InodeCache {
+ public:
+  InodeCache(Disk *disk, int inodeRegionAddr, int capacity);
+  ~InodeCache();
+
+  inode_t *acquire(int inodeNumber);
+  void release(int inodeNumber);
+
+  // Copy an inode out, or replace it and mark it dirty.
+  void get(int inodeNumber, inode_t *inode);
+  void put(int inodeNumber, const inode_t *inode);
+
+  void flush();
+  // Call once the transaction flush wrote into has been published.
+  void published();
+  // Reload every cached inode after the inode table was rewritten directly.
+  void refresh();
+
+  unsigned long hits();
+  unsigned long misses();
+
+ private:
+  struct Entry {
+    inode_t inode;
+    int references;
+    bool dirty;
+    std::list<int>::iterator position;
+  };
+
+  Entry *lookupLocked(int inodeNumber);
+  Entry *insertLocked(int inodeNumber);
+  Entry *loadLocked(int inodeNumber);
+  void readInode(int inodeNumber, inode_t *inode);
+  void evictLocked();
+
+  pthread_mutex_t lock;
+  Disk *disk;
+  int inodeRegionAddr;
+  int capacity;
+  std::unordered_map<int, Entry *> entries;
+  // most recently used at the front
+  std::list<int> recency;
+  std::set<int> dirtyInodes;
+  // written by the last flush but not yet published
+  std::set<int> flushedInodes;
+  uint64_t generation;
+  std::atomic<unsigned long> hitCount;
+  std::atomic<unsigned long> missCount;
+};
+
+#endif
@@ -1,9 +1,19 @@
 #ifndef _LOCAL_FILE_SYSTEM_H_
 #define _LOCAL_FILE_SYSTEM_H_
 
+#include <atomic>
+#include <deque>
+#include <map>
 #include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
 
 #include "Disk.h"
+#include "Bitmap.h"
+#include "DentryCache.h"
+#include "InodeCache.h"
 #include "ufs.h"
 
 /**
@@ -17,13 +27,32 @@
  * callers operate will not align on disk block boundaries, so your job is
  * to manage the interactions with the underlying storage to provide a higher
  * level of abstraction for any code that uses this class.
+ *
+ * The operations are safe to call from many threads. Each one locks the
+ * inodes it works on, shared to read and exclusive to change them; unlink
+ * takes both the parent and the child, in a fixed order. The bitmaps, the
+ * free counters and the order in which transactions commit are guarded by
+ * one allocation lock that is only held for short stretches, and never
+ * while waiting for an inode lock, a flush or a checkpoint: an operation
+ * syncs its ordered data and reserves its space in the journal before it
+ * takes the lock, and waits for its commit to be durable after releasing
+ * it. Under the lock it only appends its record to the journal. Blocks and
+ * inodes an operation frees stay allocated until it commits, so no other
+ * operation can reuse them before then.
+ *
+ * Each thread allocates from its own pool of inode and data bits, reserved
+ * in the bitmaps a batch at a time, so most operations only take the
+ * allocation lock to commit. Reserved bits are not written to disk until
+ * the operation that used them commits. When the disk runs short, the
+ * pools are handed back to the bitmaps before giving up.
  */
 
 // Note: If a function invocation has more than one error, return
 // whichever error makes the most sense in your implementation and
 // it will be considered correct.
 
-// the operation failed because there wasn't enough space on the disk
+// the operation failed because there wasn't enough space on the disk, or
+// its transaction is larger than the journal can hold
 #define ENOTENOUGHSPACE    (1)
 // Unlinking a directory that is _not_ empty
 #define EDIRNOTEMPTY       (2)
@@ -44,9 +73,29 @@
 // Unlinking '.' or '..'
 #define EUNLINKNOTALLOWED  (10)
 
+// Number of (directory, name) lookups remembered
+#define DENTRY_CACHE_SIZE  (65536)
+// Number of decoded inodes kept in memory
+#define INODE_CACHE_SIZE   (16384)
+
+// Writes of up to this many blocks journal their data along with the
+// metadata. Larger ones write the data to newly allocated blocks before
+// committing the metadata that points at them, and free the blocks they
+// replace in the same transaction, so a failed commit leaves the old data.
+#define JOURNALED_DATA_BLOCKS (DIRECT_PTRS)
+// Most adjacent blocks moved by one read or write call
+#define MAX_RUN_BLOCKS        (1024)
+// Inode n is guarded by lock n % INODE_LOCK_STRIPES
+#define INODE_LOCK_STRIPES    (1024)
+// Inodes and data blocks reserved for a thread each time its pool runs dry
+#define INODE_POOL_BATCH      (16)
+#define DATA_POOL_BATCH       (64)
+
 class LocalFileSystem {
  public:
   LocalFileSystem(Disk *disk);
+  // Hands every thread's reserved bits back to the bitmaps
+  ~LocalFileSystem();
   /**
    * Lookup an inode.
    *
@@ -81,8 +130,9 @@ class LocalFileSystem {
    * Success: return the inode number of the new file or directory
    * Failure: -EINVALIDINODE, -EINVALIDNAME, -EINVALIDTYPE, -ENOTENOUGHSPACE.
    * Failure modes: parentInodeNumber does not exist, or name is too long.
-   * If name already exists and is of the correct type, return success, but
-   * if the name already exists and is of the wrong type, return an error.
+   * If name already exists and is of the correct type, return its inode
+   * number, but if the name already exists and is of the wrong type,
+   * return an error.
    */
   int create(int parentInodeNumber, int type, std::string name);
 
@@ -112,6 +162,47 @@ class LocalFileSystem {
    */
   int read(int inodeNumber, void *buffer, int size);
 
+  /**
+   * Read part of a file or directory.
+   *
+   * Reads up to `size` bytes starting at byte `offset`, touching only the
+   * blocks in that range. Reading at or past the end returns 0.
+   *
+   * Success: number of bytes read
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE.
+   * Failure modes: invalid inodeNumber, invalid size or offset.
+   */
+  int pread(int inodeNumber, void *buffer, int size, int offset);
+
+  /**
+   * Write part of a file.
+   *
+   * Writes `size` bytes at byte `offset`, growing the file if the write
+   * ends past it; a gap between the old end and `offset` reads as zeros.
+   * Only the blocks in the range are written, and only blocks past the
+   * old end are allocated, unless the range is too large to journal: then
+   * it moves to new blocks, see JOURNALED_DATA_BLOCKS.
+   *
+   * Success: number of bytes written
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE, -EINVALIDTYPE, -ENOTENOUGHSPACE.
+   * Failure modes: invalid inodeNumber, invalid size or offset, not a
+   * regular file.
+   */
+  int pwrite(int inodeNumber, const void *buffer, int size, int offset);
+
+  /**
+   * Append to a file.
+   *
+   * Writes `size` bytes at the current end of the file, in one transaction
+   * that touches only the last block, the new blocks and the inode.
+   *
+   * Success: number of bytes written
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE, -EINVALIDTYPE, -ENOTENOUGHSPACE.
+   * Failure modes: invalid inodeNumber, invalid size or the file would grow
+   * too large, not a regular file.
+   */
+  int append(int inodeNumber, const void *buffer, int size);
+
   /**
    * Remove a file or directory.
    *
@@ -136,6 +227,34 @@ class LocalFileSystem {
   void readSuperBlock(super_t *super);
 
   /**
+   * The superblock is read once when the file system is constructed and
+   * readSuperBlock returns that copy, with the free counters as of the
+   * last commit, without taking any lock. Anything that changes the layout
+   * on disk (growing or reformatting the image) must call
+   * invalidateSuperBlock to load it again, while no operation is running.
+   * superBlockReads counts how often block 0 was read.
+   */
+  void invalidateSuperBlock();
+  unsigned long superBlockReads();
+
+  /**
+   * lookup answers from this cache when it can, including for names that
+   * are known not to exist. create and unlink keep it up to date.
+   */
+  DentryCache *getDentryCache();
+
+  /**
+   * stat reads inodes from this cache. writeInode holds an operation's
+   * updates back until it commits, then puts them here and writes them to
+   * the inode table in the same transaction.
+   */
+  InodeCache *getInodeCache();
+
+  /**
+   * The superblock also carries the number of free inodes and data blocks,
+   * updated in the same transaction as the bitmaps, so this check does not
+   * touch the bitmaps at all.
+   *
    * numDataBytesNeeded is converted to blocks and added to numDataBlocksNeeded
    * Having two separate arguments for data helps for operations that write
    * new data to two separate entities. If you don't need a value
@@ -143,18 +262,145 @@ class LocalFileSystem {
    */
   bool diskHasSpace(super_t *super, int numInodesNeeded, int numDataBytesNeeded, int numDataBlocksNeeded=0);
 
+  /**
+   * Hand every thread's reserved inodes and data blocks back to the
+   * bitmaps. Allocation does this by itself when the disk runs short; call
+   * it before shutting down or inspecting the bitmaps. Nothing is written,
+   * since reservations never reach the disk.
+   */
+  void returnReservations();
+
   // Helper functions, you should read/write the entire inode and bitmap regions
-  void readInodeBitmap(super_t *super, unsigned char *inodeBitmap);
-  void writeInodeBitmap(super_t *super, unsigned char *inodeBitmap);
-  void readDataBitmap(super_t *super, unsigned char *dataBitmap);
-  void writeDataBitmap(super_t *super, unsigned char *dataBitmap);
+  void readInodeBitmap(super_t *super, unsigned char *buffer);
+  void writeInodeBitmap(super_t *super, unsigned char *buffer);
+  void readDataBitmap(super_t *super, unsigned char *buffer);
+  void writeDataBitmap(super_t *super, unsigned char *buffer);
   void readInodeRegion(super_t *super, inode_t *inodes);
   void writeInodeRegion(super_t *super, inode_t *inodes);
 
+  // Update a single inode. It is written, together with any other dirty
+  // inodes in the same inode-table block, by the next commit or by
+  // flushInodes.
+  void writeInode(super_t *super, int inodeNumber, inode_t *inode);
+  void flushInodes();
+
+  /**
+   * Collect a file's data blocks in file order. With pointerBlocks, also
+   * collect the indirect blocks that map them. fileBlockRange collects only
+   * count blocks from block `first` on.
+   */
+  void fileBlocks(inode_t *inode, std::vector<int> &dataBlocks, std::vector<int> *pointerBlocks = NULL);
+  void fileBlockRange(inode_t *inode, int first, int count, std::vector<int> &dataBlocks);
+
+  // Data and pointer blocks a file of size bytes occupies.
+  int blocksForSize(int size);
+
+  // Number of new blocks that adding one entry to `directory` allocates:
+  // a new entry block, and a hash block when the index is built or grows.
+  int blocksToAddEntry(inode_t *directory);
+
   // Normally we'd mark this as private but we expose it so that you can access
   // it in a function you add that is not part of the LocalFileSystem object but
   // can still access the disk.
   Disk *disk;
+
+ private:
+  // What an operation has allocated, freed and written to inodes but not
+  // yet committed. Kept per thread, like the disk's transactions.
+  struct PendingChanges {
+    std::vector<int> allocatedInodes;
+    std::vector<int> allocatedData;   // data bitmap bits
+    std::vector<int> freedInodes;
+    std::vector<int> freedData;
+    std::map<int, inode_t> inodes;
+  };
+
+  // Bits reserved for one thread. Only that thread takes from them, so
+  // lock is uncontended unless returnReservations runs.
+  struct AllocationPool {
+    pthread_mutex_t lock;
+    std::deque<int> inodes;
+    std::deque<int> data;   // data bitmap bits, mostly in adjacent runs
+  };
+
+  struct ThreadState {
+    PendingChanges pending;
+    AllocationPool pool;
+  };
+
+  // Holds the locks of one or two inodes until release() or the end of
+  // the scope. Two are taken in stripe order.
+  class InodeLocks {
+   public:
+    InodeLocks(LocalFileSystem *fileSystem);
+    InodeLocks(LocalFileSystem *fileSystem, int inodeNumber, bool exclusive);
+    ~InodeLocks();
+    void acquire(int first, int second, bool exclusive);
+    void release();
+
+   private:
+    LocalFileSystem *fileSystem;
+    pthread_rwlock_t *locks[2];
+    int count;
+  };
+
+  ThreadState *threadState();
+  PendingChanges &pendingChanges();
+  void abandonChanges();
+  bool takeReserved(bool inodes, int batch, int count, std::vector<int> &bits);
+  int allocateInode();
+  int allocateDataBlock(super_t &super);
+  void freeDataBlock(super_t &super, int block);
+  int freeDataBlocks();
+  int readData(inode_t *inode, void *buffer, int size, int offset);
+  int pwriteLocked(int inodeNumber, const void *buffer, int size, int offset);
+
+  void loadSuperBlock();
+  void writeFreeCounts();
+  int commitBlocks();
+  bool commitTransaction();
+  bool resizeBlocks(super_t &super, std::vector<int> &blocks, int count);
+  bool growContiguous(super_t &super, std::vector<int> &blocks, int count);
+  bool mapBlocks(super_t &super, inode_t *inode, const std::vector<int> &dataBlocks,
+                 std::vector<int> &pointerBlocks, std::vector<std::vector<unsigned int> > &pointers);
+  int extendMapping(super_t &super, inode_t *inode, int numBlocks, const std::vector<int> &added,
+                    std::map<int, std::vector<unsigned int> > &pointerWrites);
+  void writeRange(const std::vector<int> &blocks, int first, int oldSize,
+                  const void *buffer, int size, int offset, const void *inlineData = NULL,
+                  const std::vector<int> *previous = NULL);
+  int findEntry(inode_t *directory, const std::string &name, dir_ent_t *found);
+
+  // The layout, which only the constructor and invalidateSuperBlock
+  // change, so it is read without a lock. Its free counters are not kept
+  // up to date: the current ones are freeInodes and freeData, which
+  // change under allocationLock as operations commit. countersWritten is
+  // set once block 0 holds valid counters.
+  super_t superBlock;
+  std::atomic<int> freeInodes;
+  std::atomic<int> freeData;
+  bool countersWritten;
+  unsigned long superBlockReadCount;
+
+  // Both allocation bitmaps stay in memory. Operations change them there,
+  // holding allocationLock, and flush the blocks that changed as they
+  // commit.
+  Bitmap inodeBitmap;
+  Bitmap dataBitmap;
+
+  DentryCache dentries;
+  InodeCache *inodeCache;
+
+  pthread_rwlock_t inodeLocks[INODE_LOCK_STRIPES];
+  // Guards the bitmaps and changes to the free counters, and is held while a
+  // transaction writes them and the inodes it changed and takes its place
+  // in the commit order. Journal space is reserved before taking it.
+  pthread_mutex_t allocationLock;
+  // Each thread's state, created on its first operation. Threads remember
+  // theirs, so changesLock is only taken the first time and to visit every
+  // pool.
+  std::map<std::thread::id, ThreadState *> threads;
+  pthread_mutex_t changesLock;
+  unsigned long instance;
 };  
 
 #endif
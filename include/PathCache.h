@@ -0,0 +1,58 @@
+#ifndef _PATH_CACHE_H_
+#define _PATH_CACHE_H_
+
+#include <list>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+
+#include <pthread.h>
+
+/**
+ * Maps whole request paths (everything after /ds3/) to inode numbers.
+ *
+ * Every directory has a generation number that is bumped whenever an entry
+ * is removed from it. A cached path remembers the generation of each
+ * directory it walked through and is only used while all of them are
+ * unchanged, so deleting anything along the way (or the directory itself)
+ * invalidates every path beneath it without having to find them. Adding
+ * entries never invalidates a path, and only successful resolutions are
+ * cached.
+ */
+class PathCache {
+ public:
+  PathCache(int capacity, int numInodes);
+  ~PathCache();
+
+  bool get(const std::string &path, int *inodeNumber);
+  // directories lists every directory walked to resolve path, root first.
+  void put(const std::string &path, int inodeNumber, const std::vector<int> &directories);
+  // Call after removing an entry from the directory.
+  void invalidateDirectory(int inodeNumber);
+
+  unsigned long hits();
+  unsigned long misses();
+
+ private:
+  struct Entry {
+    std::string path;
+    int inodeNumber;
+    std::vector<int> directories;
+    std::vector<unsigned long> generations;
+  };
+  typedef std::list<Entry> EntryList;
+
+  bool validLocked(const Entry &entry);
+
+  pthread_mutex_t lock;
+  int capacity;
+  std::vector<unsigned long> generations;
+  // most recently used at the front
+  EntryList entries;
+  std::unordered_map<std::string, EntryList::iterator> index;
+  std::atomic<unsigned long> hitCount;
+  std::atomic<unsigned long> missCount;
+};
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef _REPLACEMENT_POLICY_H_
+#define _REPLACEMENT_POLICY_H_
+
+#include <list>
+#include <string>
+#include <unordered_map>
+
+enum ReplacementPolicyType {
+  REPLACEMENT_LRU,
+  REPLACEMENT_2Q,
+  REPLACEMENT_ARC
+};
+
+/**
+ * Decides which block a full cache shard gives up.
+ *
+ * A policy only tracks block numbers; the shard that owns it stores the
+ * data. The shard calls hit() when a resident block is accessed and
+ * admit() when a block that is not resident is inserted. admit() returns
+ * the resident block to evict to make room, or -1 if there is still space.
+ * Policies are not thread safe; the owning shard's lock protects them.
+ */
+class ReplacementPolicy {
+ public:
+  virtual ~ReplacementPolicy() {}
+  virtual void hit(int blockNumber) = 0;
+  virtual int admit(int blockNumber) = 0;
+
+  static ReplacementPolicy *create(ReplacementPolicyType type, int capacity);
+  // Parses "lru", "2q" or "arc". Returns false for anything else.
+  static bool parse(std::string name, ReplacementPolicyType *type);
+};
+
+// Plain least recently used.
+class LruPolicy : public ReplacementPolicy {
+ public:
+  LruPolicy(int capacity);
+  virtual void hit(int blockNumber);
+  virtual int admit(int blockNumber);
+
+ private:
+  int capacity;
+  std::list<int> lru;  // most recently used first
+  std::unordered_map<int, std::list<int>::iterator> index;
+};
+
+/**
+ * 2Q (Johnson and Shasha). New blocks enter a small FIFO (A1in) and are
+ * only promoted to the main LRU list (Am) if they are referenced again
+ * after falling out of it, which the ghost list A1out remembers. A one-pass
+ * scan therefore only cycles through A1in and leaves Am alone.
+ */
+class TwoQueuePolicy : public ReplacementPolicy {
+ public:
+  TwoQueuePolicy(int capacity);
+  virtual void hit(int blockNumber);
+  virtual int admit(int blockNumber);
+
+ private:
+  enum Queue { A1IN, A1OUT, AM };
+  struct Slot {
+    Queue queue;
+    std::list<int>::iterator position;
+  };
+
+  int reclaim();
+  void remember(int blockNumber);
+
+  int capacity;
+  int maxIn;
+  int maxOut;
+  std::list<int> a1in;   // newest first
+  std::list<int> a1out;  // ghost entries, newest first
+  std::list<int> am;     // most recently used first
+  std::unordered_map<int, struct Slot> slots;
+};
+
+/**
+ * ARC (Megiddo and Modha). T1 holds blocks seen once recently and T2
+ * blocks seen at least twice; B1 and B2 remember what was recently evicted
+ * from each. Hits in the ghost lists move the target size of T1 (p), so the
+ * cache adapts between recency and frequency without tuning.
+ */
+class ArcPolicy : public ReplacementPolicy {
+ public:
+  ArcPolicy(int capacity);
+  virtual void hit(int blockNumber);
+  virtual int admit(int blockNumber);
+
+ private:
+  enum Queue { T1, T2, B1, B2 };
+  struct Slot {
+    Queue queue;
+    std::list<int>::iterator position;
+  };
+
+  std::list<int> &listFor(Queue queue);
+  void moveTo(int blockNumber, Queue queue);
+  void drop(std::list<int> &from);
+  int replace(bool inB2);
+
+  int capacity;
+  int target;  // p, the target size of T1
+  std::list<int> t1, t2, b1, b2;  // most recent first
+  std::unordered_map<int, struct Slot> slots;
+};
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef _REQUEST_SCHEDULER_H_
+#define _REQUEST_SCHEDULER_H_
+
+#include <deque>
+#include <list>
+#include <map>
+#include <string>
+
+#include <pthread.h>
+
+#include "MySocket.h"
+
+enum SchedulingPolicy {
+  SCHEDULE_FIFO,
+  SCHEDULE_SFF,
+  SCHEDULE_DRR
+};
+
+// Bytes of a request looked at to estimate its cost
+#define SCHEDULER_PEEK_BYTES (8192)
+// A request under smallest-file-first is served once this many others
+// have been served while it waited, so large ones cannot starve
+#define SFF_MAX_BYPASS       (32)
+// Every request costs at least this much under deficit round-robin, and
+// each client earns DRR_QUANTUM per turn
+#define DRR_REQUEST_COST     (4096)
+#define DRR_QUANTUM          (256 * 1024)
+
+/**
+ * The bounded buffer between the acceptor and the worker threads.
+ *
+ * push() blocks while `capacity` connections are waiting and pop() while
+ * none are. The policy decides which waiting connection pop() returns:
+ *
+ *  - FIFO hands them out in the order they were accepted.
+ *  - SFF (smallest file first) takes the cheapest request, using the cost
+ *    function on the bytes that have arrived. Requests are costed as they
+ *    are pushed, and those whose header was incomplete then are costed
+ *    again by the next pop(); until their header arrives they wait behind
+ *    the ones that could be costed.
+ *  - DRR (deficit round-robin) keeps a queue per client address and lets
+ *    each client in turn spend DRR_QUANTUM bytes of cost, so one client's
+ *    uploads cannot crowd out everyone else.
+ *
+ * The cost function gets the start of the request (request line and
+ * headers) and returns an estimate in bytes, or a negative number if it
+ * cannot tell yet. push() calls it before taking the buffer's lock, and
+ * so does SFF's pop() when it costs a request again. DRR calls it under
+ * the lock for a request push() could not cost.
+ */
+class RequestScheduler {
+ public:
+  typedef long (*CostFunction)(const std::string &head);
+
+  RequestScheduler(int capacity, SchedulingPolicy policy, CostFunction costOf);
+  ~RequestScheduler();
+
+  void push(MySocket *client);
+  MySocket *pop();
+
+  // Parses "FIFO", "SFF" or "DRR", in any case. Returns false for anything else.
+  static bool parse(std::string name, SchedulingPolicy *policy);
+
+ private:
+  struct Request {
+    MySocket *client;
+    long cost;             // negative until the header has been seen
+    unsigned long served;  // requests served before this one arrived
+  };
+  // SFF order: cost, with requests that could not be costed last, then
+  // arrival
+  typedef std::pair<long, unsigned long> SizeKey;
+  struct Flow {
+    std::deque<Request> requests;
+    long deficit;
+    bool turnStarted;
+  };
+
+  long estimate(MySocket *client);
+  void recostIncomplete();
+  MySocket *popSmallest();
+  MySocket *popFair();
+
+  int capacity;
+  int count;
+  SchedulingPolicy policy;
+  CostFunction costOf;
+
+  // FIFO, in arrival order
+  std::deque<Request> requests;
+  // SFF, by size and by arrival number
+  std::map<SizeKey, Request> bySize;
+  std::map<unsigned long, SizeKey> byArrival;
+  unsigned long arrivals;
+  unsigned long served;
+  // DRR, per client address, and the clients with requests in turn order
+  std::map<std::string, Flow> flows;
+  std::list<std::string> activeFlows;
+
+  pthread_mutex_t lock;
+  pthread_cond_t notEmpty;
+  pthread_cond_t notFull;
+};
+
+#endif
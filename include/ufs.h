@@ -10,12 +10,57 @@
 
 #define DIRECT_PTRS (30)
 
-#define MAX_FILE_SIZE (DIRECT_PTRS * UFS_BLOCK_SIZE)
+// Largest file that direct pointers alone can map, and the only size
+// images older than UFS_VERSION_INDIRECT allow.
+#define MAX_DIRECT_FILE_SIZE (DIRECT_PTRS * UFS_BLOCK_SIZE)
+
+// With indirect blocks the limit is the range of inode_t.size.
+#define MAX_FILE_SIZE (0x7fffffff)
 
 // Note: Bitmap indexes identify disk blocks relative to the start of a region.
 
+// inode flags
+#define UFS_FLAG_HASHED_DIR (0x1) // directory keeps a name hash index
+#define UFS_FLAG_INDIRECT   (0x2) // file maps blocks through indirect blocks
+#define UFS_FLAG_EXTENTS    (0x4) // file is a list of extents
+#define UFS_FLAG_INLINE     (0x8) // file data is stored in the inode
+
+// A file with UFS_FLAG_INDIRECT keeps its first INDIRECT_DATA_PTRS blocks
+// in direct pointers. direct[INDIRECT_PTR] is a block of PTRS_PER_BLOCK
+// pointers to the next blocks, and direct[DOUBLE_INDIRECT_PTR] a block of
+// pointers to such pointer blocks for the rest. Files that fit in
+// DIRECT_PTRS blocks do not use the flag.
+#define INDIRECT_PTR (DIRECT_PTRS - 2)
+#define DOUBLE_INDIRECT_PTR (DIRECT_PTRS - 1)
+#define INDIRECT_DATA_PTRS (DIRECT_PTRS - 2)
+#define PTRS_PER_BLOCK (UFS_BLOCK_SIZE / sizeof(unsigned int))
+
+// A file with UFS_FLAG_EXTENTS reads direct[] as up to MAX_EXTENTS runs of
+// adjacent blocks, in file order. Large files that fit in that many runs
+// use it in place of indirect blocks.
+#define MAX_EXTENTS (DIRECT_PTRS / 2)
+
+// A file with UFS_FLAG_INLINE keeps its bytes in direct[] itself and owns
+// no data blocks. Regular files of up to MAX_INLINE_SIZE bytes use it; the
+// rest of direct[] past the size is zero.
+#define MAX_INLINE_SIZE (DIRECT_PTRS * sizeof(unsigned int))
+
 typedef struct {
-    int type;   // UFS_DIRECTORY or UFS_REGULAR
+    unsigned int start;   // first block of the run
+    unsigned int length;  // in blocks
+} extent_t;
+
+// A hashed directory gives its last DIR_HASH_PTRS direct pointers to hash
+// blocks: an array of 16-bit name hashes, one per entry and in the same
+// order as the entries, so a lookup compares hashes and then reads only the
+// block whose entry matched.
+#define DIR_HASH_PTRS (2)
+#define DIR_DATA_PTRS (DIRECT_PTRS - DIR_HASH_PTRS)
+#define DIR_HASHES_PER_BLOCK (UFS_BLOCK_SIZE / sizeof(unsigned short))
+
+typedef struct {
+    short type;             // UFS_DIRECTORY or UFS_REGULAR
+    unsigned short flags;   // UFS_FLAG_*, 0 on older images
     int size;   // bytes
     unsigned int direct[DIRECT_PTRS];
 } inode_t;
@@ -38,7 +83,23 @@ typedef struct __super {
     int data_region_len;   // in blocks
     int num_inodes;        // just the number of inodes
     int num_data;          // and data blocks...
+    int journal_addr;      // block address (in blocks) of the redo journal
+    int journal_len;       // in blocks, 0 if the image has no journal
+    int free_inodes;       // unallocated inodes and data blocks, kept in step
+    int free_data;         // with the bitmaps when counters_magic is set
+    int counters_magic;    // UFS_COUNTERS_MAGIC, 0 on images that predate it
+    int version;           // on-disk format version, 0 on the oldest images
 } super_t;
 
+#define UFS_COUNTERS_MAGIC (0x46524545)
+
+// Format versions. Files larger than MAX_DIRECT_FILE_SIZE need
+// UFS_VERSION_INDIRECT so that older tools never see indirect inodes, and
+// extents need UFS_VERSION_EXTENTS and inline data UFS_VERSION_INLINE.
+#define UFS_VERSION_INDIRECT (2)
+#define UFS_VERSION_EXTENTS (3)
+#define UFS_VERSION_INLINE (4)
+#define UFS_VERSION (UFS_VERSION_INLINE)
+
 
 #endif // __ufs_h__
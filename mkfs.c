@@ -7,8 +7,30 @@
 
 #include "ufs.h"
 
+// Descriptor header and home block number sizes in a journal record, see
+// Disk.h
+#define JOURNAL_RECORD_HEADER_BYTES (32)
+#define JOURNAL_ENTRY_BYTES (4)
+
+/*
+ * Journal blocks needed to commit the largest transaction the file system
+ * makes: a write that maps the whole data region through pointer blocks,
+ * with the data bitmap, one inode bitmap block, the inode, the superblock
+ * and a directory's worth of blocks besides. Each transaction is one record
+ * of descriptor blocks, block images and a commit block, and anything
+ * larger than the log fails with ENOTENOUGHSPACE rather than being written
+ * without the journal.
+ */
+int journal_blocks_needed(int num_data, int data_bitmap_len) {
+    int pointer_blocks = num_data / (UFS_BLOCK_SIZE / sizeof(unsigned int)) + 3;
+    int blocks = pointer_blocks + data_bitmap_len + 3 + DIRECT_PTRS;
+    int descriptors = (JOURNAL_RECORD_HEADER_BYTES + blocks * JOURNAL_ENTRY_BYTES + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+    // journal header, descriptors, images, commit
+    return 1 + descriptors + blocks + 1;
+}
+
 void usage() {
-    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>]\n");
+    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>] [-j <num_journal_blocks>]\n  the journal defaults to enough blocks for the largest write, at least 128\n");
     exit(1);
 }
 
@@ -17,9 +39,10 @@ int main(int argc, char *argv[]) {
     char *image_file = NULL;
     int num_inodes = 32;
     int num_data = 32;
+    int num_journal = -1; // enough for the largest transaction, at least 128
     int visual = 0;
 
-    while ((ch = getopt(argc, argv, "i:d:f:v")) != -1) {
+    while ((ch = getopt(argc, argv, "i:d:f:j:v")) != -1) {
 	switch (ch) {
 	case 'i':
 	    num_inodes = atoi(optarg);
@@ -30,6 +53,9 @@ int main(int argc, char *argv[]) {
 	case 'f':
 	    image_file = optarg;
 	    break;
+	case 'j':
+	    num_journal = atoi(optarg);
+	    break;
 	case 'v':
 	    visual = 1;
 	    break;
@@ -58,6 +84,7 @@ int main(int argc, char *argv[]) {
 
     assert(num_inodes >= 32);
     assert(num_data >= 32);
+    assert(num_journal == -1 || num_journal == 0 || num_journal >= 3);
 
     // presumed: block 0 is the super block
     super_t s;
@@ -91,7 +118,23 @@ int main(int argc, char *argv[]) {
     s.data_region_addr = s.inode_region_addr + s.inode_region_len;
     s.data_region_len = num_data;
 
-    int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.data_region_len;
+    // redo journal: a header block followed by the log
+    int journal_needed = journal_blocks_needed(num_data, s.data_bitmap_len);
+    if (num_journal < 0)
+	num_journal = journal_needed > 128 ? journal_needed : 128;
+    else if (num_journal > 0 && num_journal < journal_needed)
+	fprintf(stderr, "warning: a %d block journal is smaller than the %d blocks the largest write needs; writes too large for it fail\n",
+		num_journal, journal_needed);
+    s.journal_addr = num_journal > 0 ? s.data_region_addr + s.data_region_len : 0;
+    s.journal_len = num_journal;
+
+    // the root directory takes one inode and one data block
+    s.free_inodes = num_inodes - 1;
+    s.free_data = num_data - 1;
+    s.counters_magic = UFS_COUNTERS_MAGIC;
+    s.version = UFS_VERSION;
+
+    int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.data_region_len + s.journal_len;
 
     // super block is the first block
     int rc = pwrite(fd, &s, sizeof(super_t), 0);
@@ -106,11 +149,12 @@ int main(int argc, char *argv[]) {
     printf("layout details\n");
     printf("  inode bitmap address/len %d [%d]\n", s.inode_bitmap_addr, s.inode_bitmap_len);
     printf("  data bitmap address/len  %d [%d]\n", s.data_bitmap_addr, s.data_bitmap_len);
+    printf("  journal address/len      %d [%d]\n", s.journal_addr, s.journal_len);
 
     // first, zero out all the blocks
     int i;
     for (i = 1; i < total_blocks; i++) {
-	rc = pwrite(fd, empty_buffer, UFS_BLOCK_SIZE, i * UFS_BLOCK_SIZE);
+	rc = pwrite(fd, empty_buffer, UFS_BLOCK_SIZE, (off_t) i * UFS_BLOCK_SIZE);
 	if (rc != UFS_BLOCK_SIZE) {
 	    perror("write");
 	    exit(1);
@@ -130,14 +174,14 @@ int main(int argc, char *argv[]) {
 	b.bits[i] = 0;
     b.bits[0] = 0x1; // first entry is allocated
     
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.inode_bitmap_addr * UFS_BLOCK_SIZE);
+    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, (off_t) s.inode_bitmap_addr * UFS_BLOCK_SIZE);
     assert(rc == UFS_BLOCK_SIZE);
 
     //
     // need to allocate first data block in data bitmap
     // (can just reuse this to write out data bitmap too)
     //
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.data_bitmap_addr * UFS_BLOCK_SIZE);
+    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, (off_t) s.data_bitmap_addr * UFS_BLOCK_SIZE);
     assert(rc == UFS_BLOCK_SIZE);
 
     //
@@ -149,12 +193,13 @@ int main(int argc, char *argv[]) {
 
     inode_block itable;
     itable.inodes[0].type = UFS_DIRECTORY;
+    itable.inodes[0].flags = 0;
     itable.inodes[0].size = 2 * sizeof(dir_ent_t); // in bytes
     itable.inodes[0].direct[0] = s.data_region_addr;
     for (i = 1; i < DIRECT_PTRS; i++)
 	itable.inodes[0].direct[i] = -1;
 
-    rc = pwrite(fd, &itable, UFS_BLOCK_SIZE, s.inode_region_addr * UFS_BLOCK_SIZE);
+    rc = pwrite(fd, &itable, UFS_BLOCK_SIZE, (off_t) s.inode_region_addr * UFS_BLOCK_SIZE);
     assert(rc == UFS_BLOCK_SIZE);
 
     // 
@@ -177,7 +222,7 @@ int main(int argc, char *argv[]) {
     for (i = 2; i < 128; i++)
 	parent.entries[i].inum = -1;
 
-    rc = pwrite(fd, &parent, UFS_BLOCK_SIZE, s.data_region_addr * UFS_BLOCK_SIZE);
+    rc = pwrite(fd, &parent, UFS_BLOCK_SIZE, (off_t) s.data_region_addr * UFS_BLOCK_SIZE);
     assert(rc == UFS_BLOCK_SIZE);
 
     if (visual) {
@@ -192,6 +237,8 @@ int main(int argc, char *argv[]) {
 	    printf("I");
 	for (i = 0; i < s.data_region_len; i++)
 	    printf("D");
+	for (i = 0; i < s.journal_len; i++)
+	    printf("J");
 	printf("\n\n");
     }
 
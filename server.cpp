@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <strings.h>
 
 #include <iostream>
 #include <memory>
@@ -10,6 +11,7 @@
 #include <vector>
 #include <sstream>
 #include <deque>
+#include <algorithm>
 
 #include "ClientError.h"
 #include "HTTPRequest.h"
@@ -18,9 +20,13 @@
 #include "HttpUtils.h"
 #include "FileService.h"
 #include "DistributedFileSystemService.h"
+#include "Disk.h"
+#include "BlockCache.h"
+#include "ufs.h"
 #include "MySocket.h"
 #include "MyServerSocket.h"
 #include "dthread.h"
+#include "RequestScheduler.h"
 
 using namespace std;
 int PORT = 8080;
@@ -30,9 +36,19 @@ string BASEDIR = "ds3";
 string SCHEDALG = "FIFO";
 string LOGFILE = "/dev/null";
 string DISKFILE = "disk.img";
+int GROUP_COMMIT_WAIT = -1;
+int CACHE_SIZE = 1024;
+string CACHE_POLICY = "lru";
 
 vector<HttpService *> services;
 
+DistributedFileSystemService *fileSystemService = NULL;
+
+// Accepted connections wait here, up to BUFFER_SIZE of them, until a
+// worker takes them in the order SCHEDALG picks. The acceptor blocks
+// while it is full.
+RequestScheduler *scheduler = NULL;
+
 HttpService *find_service(HTTPRequest *request) {
    // find a service that is registered for this path prefix
   for (unsigned int idx = 0; idx < services.size(); idx++) {
@@ -122,12 +138,49 @@ void handle_request(MySocket *client) {
   delete client;
 }
 
+// Estimate the work in a request from its request line and headers: the
+// body for uploads, the file size for GETs of paths the file system has
+// resolved before. -1 until the whole header has arrived.
+long request_cost(const string &head) {
+  const size_t headerEnd = head.find("\r\n\r\n");
+  if (headerEnd == string::npos) {
+    return -1;
+  }
+
+  istringstream lines(head.substr(0, headerEnd));
+  string line;
+  getline(lines, line);
+  istringstream requestLine(line);
+  string method, path;
+  requestLine >> method >> path;
+
+  long contentLength = 0;
+  while (getline(lines, line)) {
+    const size_t colon = line.find(':');
+    if (colon != string::npos && strcasecmp(line.substr(0, colon).c_str(), "Content-Length") == 0) {
+      contentLength = atol(line.c_str() + colon + 1);
+    }
+  }
+
+  if (method == "GET" && fileSystemService != NULL) {
+    return max(0L, fileSystemService->estimateSize(path));
+  }
+  return max(0L, contentLength);
+}
+
+void *worker(void *arg) {
+  while (true) {
+    handle_request(scheduler->pop());
+  }
+  return NULL;
+}
+
 int main(int argc, char *argv[]) {
 
   signal(SIGPIPE, SIG_IGN);
   int option;
 
-  while ((option = getopt(argc, argv, "d:p:t:b:s:l:i:")) != -1) {
+  while ((option = getopt(argc, argv, "d:p:t:b:s:l:i:g:c:r:")) != -1) {
     switch (option) {
     case 'd':
       BASEDIR = string(optarg);
@@ -150,12 +203,32 @@ int main(int argc, char *argv[]) {
     case 'i':
       DISKFILE = string(optarg);
       break;
+    case 'g':
+      GROUP_COMMIT_WAIT = atoi(optarg);
+      break;
+    case 'c':
+      CACHE_SIZE = atoi(optarg);
+      break;
+    case 'r':
+      CACHE_POLICY = string(optarg);
+      break;
     default:
-      cerr<< "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers] [-i diskFile]" << endl;
+      cerr<< "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers] [-s FIFO|SFF|DRR] [-i diskFile] [-g groupCommitWaitMicros] [-c cacheBlocks] [-r lru|2q|arc]" << endl;
       exit(1);
     }
   }
 
+  if (THREAD_POOL_SIZE < 1 || BUFFER_SIZE < 1) {
+    cerr << "the thread pool and the request buffer need at least one slot" << endl;
+    exit(1);
+  }
+
+  SchedulingPolicy schedulingPolicy;
+  if (!RequestScheduler::parse(SCHEDALG, &schedulingPolicy)) {
+    cerr << "unknown scheduling policy " << SCHEDALG << endl;
+    exit(1);
+  }
+
   set_log_file(LOGFILE);
 
   cout << "Lisening on port " << PORT << endl;
@@ -166,13 +239,36 @@ int main(int argc, char *argv[]) {
 
   // The order that you push services dictates the search order
   // for path prefix matching
-  services.push_back(new DistributedFileSystemService(DISKFILE));
+  Disk *disk = new Disk(DISKFILE, UFS_BLOCK_SIZE);
+  if (GROUP_COMMIT_WAIT >= 0) {
+    disk->setDurability(DURABILITY_GROUP_COMMIT, GROUP_COMMIT_WAIT);
+  }
+  ReplacementPolicyType cachePolicy;
+  if (!ReplacementPolicy::parse(CACHE_POLICY, &cachePolicy)) {
+    cerr << "unknown cache replacement policy " << CACHE_POLICY << endl;
+    exit(1);
+  }
+  if (CACHE_SIZE > 0) {
+    disk->setCache(new BlockCache(CACHE_SIZE, UFS_BLOCK_SIZE, cachePolicy));
+  }
+  fileSystemService = new DistributedFileSystemService(disk);
+  services.push_back(fileSystemService);
   services.push_back(new FileService(BASEDIR));
+
+  scheduler = new RequestScheduler(BUFFER_SIZE, schedulingPolicy, request_cost);
+  for (int idx = 0; idx < THREAD_POOL_SIZE; idx++) {
+    pthread_t thread;
+    if (dthread_create(&thread, NULL, worker, NULL) != 0) {
+      cerr << "could not start worker thread" << endl;
+      exit(1);
+    }
+    dthread_detach(thread);
+  }
   
   while(true) {
     sync_print("waiting_to_accept", "");
     client = server->accept();
     sync_print("client_accepted", "");
-    handle_request(client);
+    scheduler->push(client);
   }
 }
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <string>
 
 #include <iostream>
@@ -102,3 +103,27 @@ void MySocket::close(void) {
 
     sockFd = -1;
 }
+
+int MySocket::peek(char *buffer, int len) {
+    if(sockFd<0) {
+      throw SocketNotConnected();
+    }
+
+    int ret = ::recv(sockFd, buffer, len, MSG_PEEK | MSG_DONTWAIT);
+    return ret < 0 ? -1 : ret;
+}
+
+string MySocket::peerAddress() {
+    struct sockaddr_in peer;
+    socklen_t len = sizeof(peer);
+    char address[INET_ADDRSTRLEN];
+
+    if(sockFd<0 || getpeername(sockFd, (struct sockaddr *) &peer, &len) != 0 ||
+       peer.sin_family != AF_INET) {
+      return "";
+    }
+    if(inet_ntop(AF_INET, &peer.sin_addr, address, sizeof(address)) == NULL) {
+      return "";
+    }
+    return string(address);
+}
@@ -52,6 +52,20 @@ class MySocket {
   virtual std::string read();
   virtual void write(std::string data);
   virtual void close(void);
+
+  /*
+   * copies up to len bytes that have arrived but not been read yet,
+   * without consuming them or waiting for more.  Returns the number of
+   * bytes copied, 0 if the peer closed the connection or -1 if nothing
+   * has arrived yet.
+   */
+  int peek(char *buffer, int len);
+
+  /*
+   * the IPv4 address of the other end ("192.168.0.1"), or "" if it
+   * cannot be determined
+   */
+  std::string peerAddress();
   
  protected:
   void call_connect(const char *inetAddr, int port);
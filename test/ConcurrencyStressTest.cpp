@@ -0,0 +1,249 @@
+/*
+ * N readers and M writers on one file system, checking that every read
+ * sees a whole write and that nothing leaks.
+ *
+ * Each writer owns a few files and rewrites them with versioned contents
+ * whose size and bytes follow from the version, so a reader can tell a
+ * torn or mixed read from a whole one. Writers also create, write and
+ * unlink scratch files in a shared directory that readers list. Once they
+ * are done the test checks:
+ *   - every read during the run matched some whole version
+ *   - every file holds the last version its writer wrote, before and
+ *     after reopening the image
+ *   - the free counters in the superblock agree with the bitmaps
+ *   - unlinking everything gives back exactly the inodes and blocks the
+ *     run took
+ * Finally it times a read-only phase with 1 to 8 readers to report how
+ * reads scale; that part only prints.
+ *
+ * The test drives LocalFileSystem, whose inode locks and allocation lock
+ * are what keep concurrent requests apart. It formats its image with
+ * ./mkfs, so run it from the repository root (make test does).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "LocalFileSystem.h"
+#include "ufs.h"
+
+using namespace std;
+
+#define IMAGE "/tmp/ds3-concurrency-stress-test.img"
+#define WRITERS (4)
+#define READERS (4)
+#define FILES_PER_WRITER (4)
+#define SCRATCH_PER_WRITER (8)
+#define WRITES_PER_WRITER (150)
+#define LARGEST_FILE (48 * 1024)
+#define HEADER_SIZE (16)
+#define SCALING_READS (20000)
+
+static atomic<int> failures(0);
+
+#define CHECK(condition, message)                                       \
+  do {                                                                  \
+    if (!(condition)) {                                                 \
+      if (failures++ < 10) {                                            \
+        cout << "FAIL " << message << endl;                             \
+      }                                                                 \
+    }                                                                   \
+  } while (0)
+
+// Inline, single-block and multi-block sizes, depending on the version
+int sizeFor(int version) {
+  return HEADER_SIZE + (int) ((version * 7919L) % (LARGEST_FILE - HEADER_SIZE));
+}
+
+void fillVersion(int file, int version, vector<char> &content) {
+  content.resize(sizeFor(version));
+  snprintf(content.data(), HEADER_SIZE, "%07x:%07x", file, version);
+  content[HEADER_SIZE - 1] = '\n';
+  for (size_t i = HEADER_SIZE; i < content.size(); ++i) {
+    content[i] = (char) (version + i);
+  }
+}
+
+// True if the first length bytes of buffer are one whole version of file
+bool isWholeVersion(int file, const char *buffer, int length, int *version) {
+  int header;
+  if (length < HEADER_SIZE || sscanf(buffer, "%7x:%7x", &header, version) != 2 || header != file) {
+    return false;
+  }
+  if (length != sizeFor(*version)) {
+    return false;
+  }
+  for (int i = HEADER_SIZE; i < length; ++i) {
+    if (buffer[i] != (char) (*version + i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+string fileName(int file) {
+  return "f" + to_string(file);
+}
+
+string scratchName(int writer, int slot) {
+  return "s" + to_string(writer) + "-" + to_string(slot);
+}
+
+void readFile(LocalFileSystem &fileSystem, int directory, int file, vector<char> &buffer, int *version) {
+  int inodeNumber = fileSystem.lookup(directory, fileName(file));
+  int length = fileSystem.read(inodeNumber, buffer.data(), buffer.size());
+  CHECK(isWholeVersion(file, buffer.data(), length, version),
+        "read of " << fileName(file) << " returned " << length << " bytes that are not a whole version");
+}
+
+void checkCounters(Disk &disk, LocalFileSystem &fileSystem) {
+  // LocalFileSystem recounts the bitmaps when it opens an image; the
+  // counters written to the superblock must agree with them
+  unsigned char block[UFS_BLOCK_SIZE];
+  disk.readBlock(0, block);
+  super_t *written = (super_t *) block;
+  super_t counted;
+  fileSystem.readSuperBlock(&counted);
+  CHECK(written->free_inodes == counted.free_inodes && written->free_data == counted.free_data,
+        "superblock counts " << written->free_inodes << " free inodes and " << written->free_data
+        << " free blocks, the bitmaps " << counted.free_inodes << " and " << counted.free_data);
+}
+
+int main() {
+  if (system("./mkfs -f " IMAGE " -i 1024 -d 8192 > /dev/null") != 0) {
+    cout << "FAIL could not run ./mkfs (run from the repository root)" << endl;
+    return 1;
+  }
+
+  super_t baseline;
+  vector<int> lastVersion(WRITERS * FILES_PER_WRITER, 0);
+  {
+    Disk disk(IMAGE, UFS_BLOCK_SIZE);
+    LocalFileSystem fileSystem(&disk);
+    int data = fileSystem.create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_DIRECTORY, "data");
+    int scratch = fileSystem.create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_DIRECTORY, "scratch");
+    fileSystem.readSuperBlock(&baseline);
+
+    vector<char> content;
+    for (int file = 0; file < WRITERS * FILES_PER_WRITER; ++file) {
+      fillVersion(file, 0, content);
+      int inodeNumber = fileSystem.create(data, UFS_REGULAR_FILE, fileName(file));
+      CHECK(fileSystem.write(inodeNumber, content.data(), content.size()) == (int) content.size(),
+            "initial write of " << fileName(file));
+    }
+
+    atomic<int> writersLeft(WRITERS);
+    atomic<long> reads(0);
+    vector<thread> threads;
+    for (int writer = 0; writer < WRITERS; ++writer) {
+      threads.push_back(thread([&, writer] {
+        vector<char> content;
+        for (int write = 1; write <= WRITES_PER_WRITER; ++write) {
+          const int file = writer * FILES_PER_WRITER + write % FILES_PER_WRITER;
+          const int version = write * WRITERS + writer;
+          fillVersion(file, version, content);
+          int inodeNumber = fileSystem.lookup(data, fileName(file));
+          CHECK(fileSystem.write(inodeNumber, content.data(), content.size()) == (int) content.size(),
+                "write of " << fileName(file));
+          lastVersion[file] = version;
+
+          const string name = scratchName(writer, write % SCRATCH_PER_WRITER);
+          int scratchFile = fileSystem.create(scratch, UFS_REGULAR_FILE, name);
+          CHECK(scratchFile >= 0 && fileSystem.write(scratchFile, content.data(), content.size()) == (int) content.size(),
+                "scratch write of " << name);
+          CHECK(fileSystem.unlink(scratch, name) == 0, "unlink of " << name);
+        }
+        writersLeft--;
+      }));
+    }
+    for (int reader = 0; reader < READERS; ++reader) {
+      threads.push_back(thread([&, reader] {
+        vector<char> buffer(LARGEST_FILE);
+        unsigned int seed = reader;
+        while (writersLeft > 0) {
+          int version;
+          readFile(fileSystem, data, rand_r(&seed) % (WRITERS * FILES_PER_WRITER), buffer, &version);
+
+          // listings must only ever show whole entries
+          int length = fileSystem.read(scratch, buffer.data(), buffer.size());
+          CHECK(length >= 0 && length % sizeof(dir_ent_t) == 0, "listing of scratch returned " << length << " bytes");
+          for (dir_ent_t *entry = (dir_ent_t *) buffer.data(); length > 0 && (char *) entry < buffer.data() + length; ++entry) {
+            CHECK(entry->inum == -1 || memchr(entry->name, 0, DIR_ENT_NAME_SIZE) != NULL, "unterminated entry in scratch");
+          }
+          reads++;
+        }
+      }));
+    }
+    for (size_t i = 0; i < threads.size(); ++i) {
+      threads[i].join();
+    }
+    cout << "checked " << reads << " concurrent reads and listings" << endl;
+
+    vector<char> buffer(LARGEST_FILE);
+    for (int file = 0; file < WRITERS * FILES_PER_WRITER; ++file) {
+      int version;
+      readFile(fileSystem, data, file, buffer, &version);
+      CHECK(version == lastVersion[file], fileName(file) << " holds version " << version << ", expected " << lastVersion[file]);
+    }
+  }
+
+  {
+    Disk disk(IMAGE, UFS_BLOCK_SIZE);
+    LocalFileSystem fileSystem(&disk);
+    checkCounters(disk, fileSystem);
+    int data = fileSystem.lookup(UFS_ROOT_DIRECTORY_INODE_NUMBER, "data");
+    vector<char> buffer(LARGEST_FILE);
+    for (int file = 0; file < WRITERS * FILES_PER_WRITER; ++file) {
+      int version;
+      readFile(fileSystem, data, file, buffer, &version);
+      CHECK(version == lastVersion[file], "after reopening, " << fileName(file) << " holds version " << version
+            << ", expected " << lastVersion[file]);
+    }
+
+    for (int readers = 1; readers <= 8; readers *= 2) {
+      auto start = chrono::steady_clock::now();
+      vector<thread> threads;
+      for (int reader = 0; reader < readers; ++reader) {
+        threads.push_back(thread([&, reader] {
+          vector<char> buffer(LARGEST_FILE);
+          for (int i = reader; i < SCALING_READS; i += readers) {
+            int version;
+            readFile(fileSystem, data, i % (WRITERS * FILES_PER_WRITER), buffer, &version);
+          }
+        }));
+      }
+      for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+      }
+      double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      cout << readers << " readers: " << (int) (SCALING_READS / seconds) << " reads/s" << endl;
+    }
+
+    for (int file = 0; file < WRITERS * FILES_PER_WRITER; ++file) {
+      CHECK(fileSystem.unlink(data, fileName(file)) == 0, "unlink of " << fileName(file));
+    }
+    super_t after;
+    fileSystem.readSuperBlock(&after);
+    CHECK(after.free_inodes == baseline.free_inodes && after.free_data == baseline.free_data,
+          "after unlinking everything " << after.free_inodes << " inodes and " << after.free_data
+          << " blocks are free, expected " << baseline.free_inodes << " and " << baseline.free_data);
+  }
+
+  {
+    Disk disk(IMAGE, UFS_BLOCK_SIZE);
+    LocalFileSystem fileSystem(&disk);
+    checkCounters(disk, fileSystem);
+  }
+
+  cout << (failures == 0 ? "PASS" : "FAIL") << " " << READERS << " readers and " << WRITERS
+       << " writers left the file system consistent" << endl;
+  return failures == 0 ? 0 : 1;
+}
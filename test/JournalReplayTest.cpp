@@ -0,0 +1,147 @@
+/*
+ * Crash replay of the redo journal after a clean restart.
+ *
+ * A clean shutdown checkpoints everything and leaves the header naming the
+ * current head as the tail, with older records still lying in the log. The
+ * test makes that state, then plants a torn record at the tail: a valid
+ * descriptor with the sequence number replay expects next but no commit
+ * block, as a crash in the middle of an append would leave. A child process
+ * then opens the journal, commits one transaction and exits without
+ * checkpointing, and the test reopens the image and checks that replay
+ * finds the committed blocks. It does this once with a record that fits
+ * after the tail and once with one that has to start over at offset 0.
+ *
+ * The test drives Disk directly on a raw image in /tmp.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+#define IMAGE "/tmp/ds3-journal-replay-test.img"
+#define IMAGE_BLOCKS (160)
+#define JOURNAL_ADDR (80)
+#define JOURNAL_LEN (65)
+#define HOME_BLOCK (4)
+// leaves the tail at log offset 42, so 22 blocks fit after it
+#define FIRST_BLOCKS (40)
+
+static int failures = 0;
+
+#define CHECK(condition, message)                                       \
+  do {                                                                  \
+    if (!(condition)) {                                                 \
+      if (failures++ < 10) {                                            \
+        cout << "FAIL " << message << endl;                             \
+      }                                                                 \
+    }                                                                   \
+  } while (0)
+
+static void fillBlock(vector<unsigned char> &block, int blockNumber, int round) {
+  for (size_t i = 0; i < block.size(); ++i) {
+    block[i] = (unsigned char) (blockNumber * 31 + round * 7 + i);
+  }
+}
+
+static void commitBlocks(Disk &disk, int count, int round) {
+  vector<unsigned char> block(UFS_BLOCK_SIZE);
+  disk.beginTransaction();
+  for (int i = 0; i < count; ++i) {
+    fillBlock(block, HOME_BLOCK + i, round);
+    disk.writeBlock(HOME_BLOCK + i, block.data());
+  }
+  disk.commit();
+}
+
+static void rawBlock(int blockNumber, void *buffer, bool write) {
+  int fd = open(IMAGE, O_RDWR);
+  if (fd < 0) {
+    perror(IMAGE);
+    exit(1);
+  }
+  off_t offset = (off_t) blockNumber * UFS_BLOCK_SIZE;
+  ssize_t done = write ? pwrite(fd, buffer, UFS_BLOCK_SIZE, offset) : pread(fd, buffer, UFS_BLOCK_SIZE, offset);
+  if (done != UFS_BLOCK_SIZE) {
+    perror("raw block");
+    exit(1);
+  }
+  close(fd);
+}
+
+static void runCase(const string &name, int count) {
+  int fd = open(IMAGE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, (off_t) IMAGE_BLOCKS * UFS_BLOCK_SIZE) != 0) {
+    perror(IMAGE);
+    exit(1);
+  }
+  close(fd);
+
+  // first run: one record at offset 0, then a clean shutdown
+  {
+    Disk disk(IMAGE, UFS_BLOCK_SIZE);
+    disk.openJournal(JOURNAL_ADDR, JOURNAL_LEN);
+    commitBlocks(disk, FIRST_BLOCKS, 1);
+  }
+
+  struct JournalHeader header;
+  vector<unsigned char> block(UFS_BLOCK_SIZE);
+  rawBlock(JOURNAL_ADDR, block.data(), false);
+  memcpy(&header, block.data(), sizeof(header));
+  CHECK(header.magic == JOURNAL_HEADER_MAGIC && header.tailOffset == FIRST_BLOCKS + 2,
+        name << ": clean shutdown left the tail at " << header.tailOffset);
+
+  // a torn append at the tail, carrying the sequence replay expects next
+  struct JournalRecordHeader torn;
+  memset(block.data(), 0xa5, block.size());
+  torn.magic = JOURNAL_DESCRIPTOR_MAGIC;
+  torn.sequence = header.tailSequence;
+  torn.checksum = 0;
+  torn.count = 1;
+  memcpy(block.data(), &torn, sizeof(torn));
+  rawBlock(JOURNAL_ADDR + 1 + header.tailOffset, block.data(), true);
+
+  // second run: commit, then crash before any checkpoint
+  pid_t child = fork();
+  if (child == 0) {
+    Disk disk(IMAGE, UFS_BLOCK_SIZE);
+    disk.openJournal(JOURNAL_ADDR, JOURNAL_LEN);
+    commitBlocks(disk, count, 2);
+    _exit(0);
+  }
+  int status;
+  if (child < 0 || waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    cout << "FAIL " << name << ": the committing process did not exit cleanly" << endl;
+    exit(1);
+  }
+
+  Disk disk(IMAGE, UFS_BLOCK_SIZE);
+  int replayed = disk.openJournal(JOURNAL_ADDR, JOURNAL_LEN);
+  CHECK(replayed == 1, name << ": replayed " << replayed << " transactions, expected 1");
+  vector<unsigned char> expected(UFS_BLOCK_SIZE);
+  for (int i = 0; i < FIRST_BLOCKS; ++i) {
+    disk.readBlock(HOME_BLOCK + i, block.data());
+    fillBlock(expected, HOME_BLOCK + i, i < count ? 2 : 1);
+    CHECK(block == expected, name << ": block " << HOME_BLOCK + i << " does not hold its last commit");
+  }
+}
+
+int main(int argc, char *argv[]) {
+  runCase("record after the tail", 4);
+  runCase("record wrapped to offset 0", 24);
+  unlink(IMAGE);
+
+  cout << (failures == 0 ? "PASS" : "FAIL") << " committed records survive a torn append at the tail" << endl;
+  return failures == 0 ? 0 : 1;
+}
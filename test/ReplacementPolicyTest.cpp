@@ -0,0 +1,95 @@
+/*
+ * Replays a block trace through the block cache and checks that a large
+ * sequential scan leaves hot file system metadata resident under 2Q and
+ * ARC, and pushes it out under plain LRU.
+ *
+ * The trace follows the layout mkfs gives a small image: the superblock,
+ * both bitmaps and the inode table sit in the first blocks, and file data
+ * comes after them. A run of small GETs reads the metadata between data
+ * blocks of different files; a ds3cat or a sequential GET of a large file
+ * then reads many times the cache's capacity of data blocks once each.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "BlockCache.h"
+
+using namespace std;
+
+#define CACHE_BLOCKS (1024)
+#define BLOCK_SIZE (64)
+
+// superblock, inode bitmap, data bitmap and the inode table
+#define METADATA_BLOCKS (8)
+#define DATA_REGION (METADATA_BLOCKS)
+
+#define WARM_ROUNDS (4)
+#define SMALL_FILES_PER_ROUND (384)
+#define SCAN_BLOCKS (16 * CACHE_BLOCKS)
+
+// Read a block the way Disk does: the cache first, a fill on a miss
+void access(BlockCache &cache, int blockNumber) {
+  unsigned char buffer[BLOCK_SIZE];
+  if (!cache.get(blockNumber, buffer)) {
+    uint64_t token = cache.fillToken(blockNumber);
+    buffer[0] = (unsigned char) blockNumber;
+    cache.fill(blockNumber, buffer, token);
+  }
+}
+
+// Number of metadata blocks still cached after the trace
+int residentAfterScan(ReplacementPolicyType policy) {
+  BlockCache cache(CACHE_BLOCKS, BLOCK_SIZE, policy);
+  int nextData = DATA_REGION;
+
+  for (int round = 0; round < WARM_ROUNDS; ++round) {
+    for (int block = 0; block < METADATA_BLOCKS; ++block) {
+      access(cache, block);
+    }
+    for (int file = 0; file < SMALL_FILES_PER_ROUND; ++file) {
+      access(cache, nextData++);
+    }
+  }
+
+  for (int block = 0; block < SCAN_BLOCKS; ++block) {
+    access(cache, nextData++);
+  }
+
+  int resident = 0;
+  unsigned char buffer[BLOCK_SIZE];
+  for (int block = 0; block < METADATA_BLOCKS; ++block) {
+    if (cache.get(block, buffer)) {
+      resident++;
+    }
+  }
+  return resident;
+}
+
+int main() {
+  int failures = 0;
+
+  struct {
+    const char *name;
+    ReplacementPolicyType policy;
+    int expected;
+  } cases[] = {
+    {"lru", REPLACEMENT_LRU, 0},
+    {"2q", REPLACEMENT_2Q, METADATA_BLOCKS},
+    {"arc", REPLACEMENT_ARC, METADATA_BLOCKS},
+  };
+
+  for (size_t idx = 0; idx < sizeof(cases) / sizeof(cases[0]); ++idx) {
+    int resident = residentAfterScan(cases[idx].policy);
+    bool passed = resident == cases[idx].expected;
+    cout << (passed ? "PASS " : "FAIL ") << cases[idx].name << ": " << resident << " of "
+         << METADATA_BLOCKS << " metadata blocks resident after a " << SCAN_BLOCKS
+         << " block scan, expected " << cases[idx].expected << endl;
+    if (!passed) {
+      failures++;
+    }
+  }
+
+  return failures == 0 ? 0 : 1;
+}